@@ -0,0 +1,78 @@
+#include "ActiveBlocks.h"
+#include <algorithm>
+#include "Profiler.h"
+#include "ThreadPool.h"
+
+ActiveBlocks::ActiveBlocks() :mPool(nullptr), mBlocksX(0), mBlocksY(0), mBlocksZ(0){
+}
+
+void ActiveBlocks::setThreadPool(ThreadPool* pool){
+	mPool = pool;
+}
+
+void ActiveBlocks::resize(int width, int height, int depth){
+	mBlocksX = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	mBlocksY = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	mBlocksZ = (depth + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	const std::size_t blocks = mBlocksX * mBlocksY * mBlocksZ;
+	mFlags.assign(blocks, 1);
+	//Atomics can't be copied, so the flags are replaced rather than resized
+	std::vector<std::atomic<unsigned char>>(blocks).swap(mHasParticle);
+	mWillBeActive.assign(blocks, 0);
+	mActive.clear();
+	mDeactivated.clear();
+	for (int bz = 0; bz < mBlocksZ; ++bz)
+		for (int by = 0; by < mBlocksY; ++by)
+			for (int bx = 0; bx < mBlocksX; ++bx)
+				mActive.push_back(glm::ivec3(bx, by, bz) * BLOCK_SIZE);
+}
+
+void ActiveBlocks::update(const float* x, const float* y, const float* z, std::size_t count){
+	PROFILE_ZONE("ActiveBlocks::update");
+	//Find the blocks that contain a particle from the particles themselves, rather than looking at every cell.
+	//Every thread only ever sets flags, so relaxed stores are enough. A flag is read before it is set, and a run of
+	//particles in the same block only looks at it once, so threads rarely write to the same line.
+	for (std::atomic<unsigned char>& flag : mHasParticle)
+		flag.store(0, std::memory_order_relaxed);
+	util::parallelFor(mPool, 0, count, [&](int begin, int end){
+		int previous = -1;
+		for (int i = begin; i < end; ++i)
+		{
+			const int bx = static_cast<int>(x[i]) / BLOCK_SIZE, by = static_cast<int>(y[i]) / BLOCK_SIZE, bz = static_cast<int>(z[i]) / BLOCK_SIZE;
+			const int block = bx + mBlocksX * (by + mBlocksY * bz);
+			if (block != previous && !mHasParticle[block].load(std::memory_order_relaxed))
+				mHasParticle[block].store(1, std::memory_order_relaxed);
+			previous = block;
+		}
+	});
+
+	//Then activate them along with their neighbors. One flag per block, so this and the pass below are
+	//BLOCK_SIZE^3 times cheaper than a pass over the cells.
+	std::fill(mWillBeActive.begin(), mWillBeActive.end(), 0);
+	for (int bz = 0; bz < mBlocksZ; ++bz)
+		for (int by = 0; by < mBlocksY; ++by)
+			for (int bx = 0; bx < mBlocksX; ++bx)
+			{
+				if (!mHasParticle[bx + mBlocksX * (by + mBlocksY * bz)].load(std::memory_order_relaxed))
+					continue;
+				for (int nz = std::max(bz - 1, 0); nz <= std::min(bz + 1, mBlocksZ - 1); ++nz)
+					for (int ny = std::max(by - 1, 0); ny <= std::min(by + 1, mBlocksY - 1); ++ny)
+						for (int nx = std::max(bx - 1, 0); nx <= std::min(bx + 1, mBlocksX - 1); ++nx)
+							mWillBeActive[nx + mBlocksX * (ny + mBlocksY * nz)] = 1;
+			}
+
+	mActive.clear();
+	mDeactivated.clear();
+	for (int bz = 0; bz < mBlocksZ; ++bz)
+		for (int by = 0; by < mBlocksY; ++by)
+			for (int bx = 0; bx < mBlocksX; ++bx)
+			{
+				const int block = bx + mBlocksX * (by + mBlocksY * bz);
+				const unsigned char active = mWillBeActive[block];
+				if (active)
+					mActive.push_back(glm::ivec3(bx, by, bz) * BLOCK_SIZE);
+				else if (mFlags[block])
+					mDeactivated.push_back(glm::ivec3(bx, by, bz) * BLOCK_SIZE);
+				mFlags[block] = active;
+			}
+}
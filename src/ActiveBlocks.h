@@ -0,0 +1,52 @@
+#ifndef _ACTIVEBLOCKS_H_
+#define _ACTIVEBLOCKS_H_
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+
+class ThreadPool;
+
+//Size of a block along each axis, in cells
+const int BLOCK_SIZE = 8;
+
+/*
+Splits a grid into BLOCK_SIZE^3 blocks and keeps track of which of them hold fluid. A block is active if it or any
+of its 26 neighbors contains a marker particle, so there is always at least a block of air around the fluid.
+Simulation stages only visit the cells of active blocks. This only skips work, the grids themselves still cover
+the whole domain.
+*/
+class ActiveBlocks{
+public:
+	ActiveBlocks();
+
+	//Splits the particle scan of update over pool, or runs it all on the calling thread if it is null
+	void setThreadPool(ThreadPool* pool);
+
+	//Sets up the blocks for a grid of the given size (boundary layer included). Every block starts out active.
+	void resize(int width, int height, int depth);
+
+	//Activates the blocks containing one of count particles at (x[i], y[i], z[i]) and the blocks around them,
+	//deactivates the rest. Every particle must be inside the grid. Only which blocks hold a particle matters,
+	//so the result doesn't depend on how the particles are split over the pool.
+	void update(const float* x, const float* y, const float* z, std::size_t count);
+
+	//First cell of every active block, x first, then y, then z
+	const std::vector<glm::ivec3>& active() const { return mActive; }
+	//First cell of every block that was deactivated by the last update
+	const std::vector<glm::ivec3>& deactivated() const { return mDeactivated; }
+
+private:
+	ThreadPool* mPool;
+	int mBlocksX, mBlocksY, mBlocksZ;
+	//Whether each block is active
+	std::vector<unsigned char> mFlags;
+	//Scratch for update, whether each block holds a particle. Set from every thread of the scan.
+	std::vector<std::atomic<unsigned char>> mHasParticle;
+	//Scratch for update, whether each block will be active
+	std::vector<unsigned char> mWillBeActive;
+	std::vector<glm::ivec3> mActive, mDeactivated;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _ALIGNEDALLOCATOR_H_
+#define _ALIGNEDALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+/*
+Allocator for standard containers that aligns storage to Alignment bytes, so the start of the data
+(and of every row, if rows are padded to a multiple of Alignment) can be loaded with aligned SIMD loads.
+Alignment must be a power of two and a multiple of sizeof(void*).
+*/
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator{
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef std::size_t size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind{
+		typedef AlignedAllocator<U, Alignment> other;
+	};
+
+	AlignedAllocator(){}
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U, Alignment>&){}
+
+	T* allocate(std::size_t n){
+		if (n == 0)
+			return nullptr;
+#ifdef _WIN32
+		void* p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+		void* p = nullptr;
+		if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+			p = nullptr;
+#endif
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, std::size_t){
+#ifdef _WIN32
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+};
+
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator==(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&){ return true; }
+template <typename T, typename U, std::size_t Alignment>
+inline bool operator!=(const AlignedAllocator<T, Alignment>&, const AlignedAllocator<U, Alignment>&){ return false; }
+
+#endif
@@ -0,0 +1,284 @@
+/*
+Times each stage of a CFDSimulation step on its own, across grid sizes and particle counts.
+Prints a table per run and can write every result as JSON, so changes to a stage can be compared against a baseline.
+Built by the CMake project as fluidsim_bench, see --help for the options.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "CFDSimulation.h"
+#include "DensitySplatter.h"
+#include "ThreadPool.h"
+
+//Kinematic viscosity used while timing diffuseVelocity, which is skipped entirely at 0
+const float BENCHMARK_VISCOSITY = 1.0f;
+//Squared particle radius of the density splatted for meshing, the viewer's value
+const float BENCHMARK_DENSITY_RADIUS_SQUARED = 1.0f;
+
+struct StageResult{
+	std::string name;
+	//Median and fastest time of a call, in seconds
+	double medianSeconds, minSeconds;
+	//Bytes of every array the stage reads or writes, each counted once, per cell of the grid.
+	//A lower bound on the memory traffic of the stage.
+	double bytesPerCell;
+	//True for stages whose work is per particle rather than per cell
+	bool perParticle;
+};
+
+struct RunResult{
+	int size;
+	long long cells;
+	std::size_t particles;
+	std::vector<StageResult> stages;
+};
+
+template <typename T, typename Layout>
+static double gridBytes(const Grid3D<T, Layout>& grid){
+	return static_cast<double>(grid.size() * sizeof(T));
+}
+
+class StageBenchmark{
+public:
+	//Fills the lower half of the tank with particles at random positions, using a fixed seed so runs are repeatable
+	static void addParticles(CFDSimulation& sim, std::size_t count){
+		unsigned int state = 12345u;
+		auto random = [&state](){
+			state = state * 1664525u + 1013904223u;
+			return (state >> 8) * (1.0f / 16777216.0f);
+		};
+		const glm::vec3 low(1.0f);
+		const glm::vec3 extent(sim.mWidth - 2.0f, (sim.mHeight - 2.0f) * 0.5f, sim.mDepth - 2.0f);
+		sim.mParticles.reserve(count);
+		for (std::size_t i = 0; i < count; ++i)
+			sim.mParticles.add(low + extent * glm::vec3(random(), random(), random()));
+	}
+
+	static std::vector<StageResult> run(CFDSimulation& sim, int repeats){
+		const float dt = DEFAULT_MAX_TIMESTEP;
+		const double cells = static_cast<double>(sim.mWidth) * sim.mHeight * sim.mDepth;
+		const double interior = static_cast<double>(sim.mWidth - 2) * (sim.mHeight - 2) * (sim.mDepth - 2);
+		const double boundaryCells = cells - interior;
+		const double velocity = gridBytes(sim.mU) + gridBytes(sim.mV) + gridBytes(sim.mW);
+		const double velocityBuffers = gridBytes(sim.mUBuffer) + gridBytes(sim.mVBuffer) + gridBytes(sim.mWBuffer);
+		const double positions = sim.mParticles.size() * 3.0 * sizeof(float);
+		const int field = sim.addScalarField(1.0f);
+		sim.setViscosity(BENCHMARK_VISCOSITY);
+		sim.determineFluidCells();
+		//The density the mesher works on has a point on every cell corner
+		Grid3D<float> density(sim.mWidth + 1, sim.mHeight + 1, sim.mDepth + 1);
+		DensitySplatter splatter;
+		splatter.setThreadPool(sim.mPool);
+
+		struct Stage{
+			const char* name;
+			std::function<void()> body;
+			double bytes;
+			bool perParticle;
+		};
+		const Stage stages[] = {
+			{ "determineFluidCells", [&](){ sim.determineFluidCells(); }, gridBytes(sim.mFluid) + positions, true },
+			{ "applyForces", [&](){ sim.applyForces(dt); }, gridBytes(sim.mFluid) + gridBytes(sim.mV), false },
+			{ "diffuseVelocity", [&](){ sim.diffuseVelocity(dt); },
+				velocity + gridBytes(sim.mResidual) + gridBytes(sim.mSearch) + gridBytes(sim.mProduct), false },
+			{ "project", [&](){ sim.project(); },
+				velocity + gridBytes(sim.mPressure) + gridBytes(sim.mBuffer) + gridBytes(sim.mFluid), false },
+			{ "advectVelocity", [&](){ sim.advectVelocity(dt); }, velocity + velocityBuffers, false },
+			{ "advectQuantity", [&](){ sim.advectFields(dt); },
+				velocity + gridBytes(sim.mFields[field]) + gridBytes(sim.mFieldBuffers[field]), false },
+			{ "updateParticles", [&](){ sim.updateParticles(dt); }, velocity + positions, true },
+			//Boundary passes read the cell next to each boundary cell and write the boundary cell
+			{ "setBoundariesField", [&](){ sim.setBoundariesField(sim.mFields[field]); }, boundaryCells * 2.0 * sizeof(float), false },
+			{ "splatDensity", [&](){ splatter.splat(sim.mParticles.x(), sim.mParticles.y(), sim.mParticles.z(), sim.mParticles.size(),
+				BENCHMARK_DENSITY_RADIUS_SQUARED, density); }, gridBytes(density) + positions, true },
+		};
+
+		typedef std::chrono::steady_clock Clock;
+		std::vector<StageResult> results;
+		std::vector<double> times(repeats);
+		for (const Stage& stage : stages)
+		{
+			//The first call warms up caches and scratch allocations and isn't timed
+			stage.body();
+			for (int r = 0; r < repeats; ++r)
+			{
+				const Clock::time_point start = Clock::now();
+				stage.body();
+				times[r] = std::chrono::duration<double>(Clock::now() - start).count();
+			}
+			std::sort(times.begin(), times.end());
+			StageResult result;
+			result.name = stage.name;
+			result.medianSeconds = times[repeats / 2];
+			result.minSeconds = times[0];
+			result.bytesPerCell = stage.bytes / cells;
+			result.perParticle = stage.perParticle;
+			results.push_back(result);
+		}
+		return results;
+	}
+};
+
+struct Options{
+	std::vector<int> sizes;
+	std::vector<std::size_t> particles;
+	int threads;
+	int repeats;
+	PressureSolver solver;
+	std::string solverName;
+	std::string jsonPath;
+
+	Options() :sizes({ 25, 64, 128, 256 }), particles({ 100000, 1000000 }), threads(1), repeats(5),
+		solver(PressureSolver::PCG), solverName("pcg"){}
+};
+
+static void printUsage(const char* program){
+	std::printf("usage: %s [options]\n"
+		"  --sizes N,N,...       cubic grid sizes, boundary layer included (default 25,64,128,256)\n"
+		"  --particles N,N,...   marker particle counts, every size runs with every count (default 100000,1000000)\n"
+		"  --threads N           threads to run on, 1 for the calling thread only (default 1)\n"
+		"  --repeats N           timed calls per stage, the median is reported (default 5)\n"
+		"  --solver gs|mg|pcg    pressure solver used by project (default pcg)\n"
+		"  --json PATH           also write the results to PATH as JSON\n", program);
+}
+
+template <typename T>
+static bool parseList(const char* text, std::vector<T>& values){
+	values.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+	{
+		long long value = std::atoll(item.c_str());
+		if (value <= 0)
+			return false;
+		values.push_back(static_cast<T>(value));
+	}
+	return !values.empty();
+}
+
+//Returns false if the arguments can't be parsed
+static bool parseOptions(int argc, char** argv, Options& options){
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		if (i + 1 >= argc)
+			return false;
+		const char* value = argv[++i];
+		if (arg == "--sizes")
+		{
+			if (!parseList(value, options.sizes))
+				return false;
+		}
+		else if (arg == "--particles")
+		{
+			if (!parseList(value, options.particles))
+				return false;
+		}
+		else if (arg == "--threads")
+			options.threads = std::atoi(value);
+		else if (arg == "--repeats")
+			options.repeats = std::atoi(value);
+		else if (arg == "--solver")
+		{
+			options.solverName = value;
+			if (options.solverName == "gs")
+				options.solver = PressureSolver::GAUSS_SEIDEL;
+			else if (options.solverName == "mg")
+				options.solver = PressureSolver::MULTIGRID;
+			else if (options.solverName == "pcg")
+				options.solver = PressureSolver::PCG;
+			else
+				return false;
+		}
+		else if (arg == "--json")
+			options.jsonPath = value;
+		else
+			return false;
+	}
+	for (int size : options.sizes)
+		if (size < 3 || size > MAX_GRID_SIZE)
+			return false;
+	return options.threads > 0 && options.repeats > 0;
+}
+
+static bool writeJson(const std::string& path, const Options& options, const std::vector<RunResult>& runs){
+	FILE* file = std::fopen(path.c_str(), "w");
+	if (!file)
+		return false;
+	std::fprintf(file, "{\n  \"benchmark\": \"cfd_stages\",\n  \"threads\": %d,\n  \"repeats\": %d,\n  \"solver\": \"%s\",\n  \"runs\": [\n",
+		options.threads, options.repeats, options.solverName.c_str());
+	for (std::size_t r = 0; r < runs.size(); ++r)
+	{
+		const RunResult& run = runs[r];
+		std::fprintf(file, "    {\n      \"width\": %d, \"height\": %d, \"depth\": %d, \"cells\": %lld, \"particles\": %zu,\n      \"stages\": [\n",
+			run.size, run.size, run.size, run.cells, run.particles);
+		for (std::size_t s = 0; s < run.stages.size(); ++s)
+		{
+			const StageResult& stage = run.stages[s];
+			std::fprintf(file, "        { \"name\": \"%s\", \"median_ms\": %.6f, \"min_ms\": %.6f, \"cells_per_second\": %.6g, "
+				"\"particles_per_second\": %.6g, \"bytes_per_cell\": %.3f, \"bytes_per_second\": %.6g }%s\n",
+				stage.name.c_str(), stage.medianSeconds * 1e3, stage.minSeconds * 1e3, run.cells / stage.medianSeconds,
+				stage.perParticle ? run.particles / stage.medianSeconds : 0.0, stage.bytesPerCell,
+				stage.bytesPerCell * run.cells / stage.medianSeconds, s + 1 < run.stages.size() ? "," : "");
+		}
+		std::fprintf(file, "      ]\n    }%s\n", r + 1 < runs.size() ? "," : "");
+	}
+	std::fprintf(file, "  ]\n}\n");
+	return std::fclose(file) == 0;
+}
+
+int main(int argc, char** argv){
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	//The calling thread takes part in parallel loops, so it counts as one of the threads
+	ThreadPool pool(options.threads - 1);
+	std::vector<RunResult> runs;
+	for (int size : options.sizes)
+		for (std::size_t particles : options.particles)
+		{
+			CFDSimulation sim(size, size, size, options.solver);
+			if (options.threads > 1)
+				sim.setThreadPool(&pool);
+			StageBenchmark::addParticles(sim, particles);
+
+			RunResult run;
+			run.size = size;
+			run.cells = static_cast<long long>(size) * size * size;
+			run.particles = particles;
+			run.stages = StageBenchmark::run(sim, options.repeats);
+			runs.push_back(run);
+
+			std::printf("grid %d^3 (%lld cells), %zu particles, %d thread(s), %s\n", size, run.cells, particles,
+				options.threads, options.solverName.c_str());
+			std::printf("  %-22s %10s %10s %12s %14s %11s %9s\n", "stage", "median ms", "min ms", "Mcells/s", "Mparticles/s", "bytes/cell", "GB/s");
+			for (const StageResult& stage : run.stages)
+			{
+				std::printf("  %-22s %10.3f %10.3f %12.2f ", stage.name.c_str(), stage.medianSeconds * 1e3, stage.minSeconds * 1e3,
+					run.cells / stage.medianSeconds * 1e-6);
+				if (stage.perParticle)
+					std::printf("%14.2f ", particles / stage.medianSeconds * 1e-6);
+				else
+					std::printf("%14s ", "-");
+				std::printf("%11.2f %9.2f\n", stage.bytesPerCell, stage.bytesPerCell * run.cells / stage.medianSeconds * 1e-9);
+			}
+		}
+
+	if (!options.jsonPath.empty() && !writeJson(options.jsonPath, options, runs))
+	{
+		std::fprintf(stderr, "could not write %s\n", options.jsonPath.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _BOUNDARYCONDITIONS_H_
+#define _BOUNDARYCONDITIONS_H_
+
+//What the walls of the simulation do to the fluid next to them
+enum class BoundaryCondition{
+	NO_SLIP, //solid walls the fluid sticks to
+	FREE_SLIP, //solid walls the fluid slides along freely
+	OPEN //no walls, fluid flows out into still air
+};
+
+/*
+Boundary condition policies. Stencil kernels and the velocity sampler take one as a template parameter and ask it for
+the value on the far side of a wall instead of reading the boundary layer, so the boundary layers of velocity and
+pressure are never written.
+Each policy has
+	SOLID - true if nothing flows through the wall, so velocity normal to it is 0 on the wall face
+	float tangential(float inside) - velocity along the wall in a boundary cell, given the one in the cell next to it
+	float pressure(float inside) - pressure in a boundary cell, given the one in the cell next to it
+*/
+struct NoSlip{
+	static const bool SOLID = true;
+	//Velocity along the wall averages to 0 on the wall
+	static inline float tangential(float inside){ return -inside; }
+	//Pressure doesn't change across the wall, so it pushes back just as hard as the fluid pushes on it
+	static inline float pressure(float inside){ return inside; }
+};
+
+struct FreeSlip{
+	static const bool SOLID = true;
+	static inline float tangential(float inside){ return inside; }
+	static inline float pressure(float inside){ return inside; }
+};
+
+struct Open{
+	static const bool SOLID = false;
+	static inline float tangential(float inside){ return inside; }
+	//Air outside the grid, which has no pressure
+	static inline float pressure(float){ return 0.0f; }
+};
+
+//Sum of the 6 neighbors of interior cell (x, y, z) of a pressure grid. Neighbors in the boundary layer come from the policy.
+template <typename Policy, typename Grid>
+inline float pressureNeighborSum(const Grid& p, int x, int y, int z){
+	const float center = p(x, y, z);
+	return (x < p.width() - 2 ? p(x + 1, y, z) : Policy::pressure(center)) + (x > 1 ? p(x - 1, y, z) : Policy::pressure(center))
+		+ (y < p.height() - 2 ? p(x, y + 1, z) : Policy::pressure(center)) + (y > 1 ? p(x, y - 1, z) : Policy::pressure(center))
+		+ (z < p.depth() - 2 ? p(x, y, z + 1) : Policy::pressure(center)) + (z > 1 ? p(x, y, z - 1) : Policy::pressure(center));
+}
+
+//Calls function with the policy for condition, so a kernel templated on the policy is only picked once per call
+template <typename Function>
+inline void withBoundaryPolicy(BoundaryCondition condition, const Function& function){
+	switch (condition)
+	{
+	case BoundaryCondition::FREE_SLIP:
+		function(FreeSlip());
+		break;
+	case BoundaryCondition::OPEN:
+		function(Open());
+		break;
+	case BoundaryCondition::NO_SLIP:
+	default:
+		function(NoSlip());
+		break;
+	}
+}
+
+#endif
@@ -1,27 +1,109 @@
 #include "CFDSimulation.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
-CFDSimulation::CFDSimulation(){
+#include "Checkpoint.h"
+#include "MappedFile.h"
+#include "PressureStencil.h"
+#include "Profiler.h"
+
+
+//Where each quantity is stored within a cell. Cell (x, y, z) covers the cube from (x, y, z) to (x + 1, y + 1, z + 1).
+//Velocity components sit on the centers of the cell faces they are normal to, everything else at the cell center.
+//Components are numbered by the axis they are normal to, 0 for u.
+static const glm::vec3 FACE_OFFSETS[3] = { glm::vec3(0.0f, 0.5f, 0.5f), glm::vec3(0.5f, 0.0f, 0.5f), glm::vec3(0.5f, 0.5f, 0.0f) };
+static const glm::vec3 CELL_OFFSET(0.5f, 0.5f, 0.5f);
+
+template <typename Body>
+void CFDSimulation::forEachRegion(const glm::ivec3& begin, const glm::ivec3& end, const Body& body){
+	if (!mActiveBlocksOnly)
+	{
+		//Split the whole range into slabs along z
+		util::parallelFor(mPool, begin.z, end.z, [&](int zBegin, int zEnd){
+			body(glm::ivec3(begin.x, begin.y, zBegin), glm::ivec3(end.x, end.y, zEnd));
+		});
+		return;
+	}
+	//One region per active block, clipped to the range
+	const std::vector<glm::ivec3>& blocks = mBlocks.active();
+	util::parallelFor(mPool, 0, blocks.size(), [&](int first, int last){
+		for (int b = first; b < last; ++b)
+		{
+			glm::ivec3 regionBegin = glm::max(begin, blocks[b]);
+			glm::ivec3 regionEnd = glm::min(end, blocks[b] + BLOCK_SIZE);
+			if (regionBegin.x < regionEnd.x && regionBegin.y < regionEnd.y && regionBegin.z < regionEnd.z)
+				body(regionBegin, regionEnd);
+		}
+	});
+}
+
+template <typename Body>
+double CFDSimulation::sumOverRegions(const glm::ivec3& begin, const glm::ivec3& end, const Body& body){
+	if (!mActiveBlocksOnly)
+	{
+		return util::parallelSum(mPool, begin.z, end.z, [&](int zBegin, int zEnd){
+			return body(glm::ivec3(begin.x, begin.y, zBegin), glm::ivec3(end.x, end.y, zEnd));
+		});
+	}
+	const std::vector<glm::ivec3>& blocks = mBlocks.active();
+	return util::parallelSum(mPool, 0, blocks.size(), [&](int first, int last){
+		double sum = 0.0;
+		for (int b = first; b < last; ++b)
+		{
+			glm::ivec3 regionBegin = glm::max(begin, blocks[b]);
+			glm::ivec3 regionEnd = glm::min(end, blocks[b] + BLOCK_SIZE);
+			if (regionBegin.x < regionEnd.x && regionBegin.y < regionEnd.y && regionBegin.z < regionEnd.z)
+				sum += body(regionBegin, regionEnd);
+		}
+		return sum;
+	});
+}
+
+template <typename Body>
+float CFDSimulation::maxOverRegions(const glm::ivec3& begin, const glm::ivec3& end, const Body& body){
+	if (!mActiveBlocksOnly)
+	{
+		return util::parallelMax(mPool, begin.z, end.z, [&](int zBegin, int zEnd){
+			return body(glm::ivec3(begin.x, begin.y, zBegin), glm::ivec3(end.x, end.y, zEnd));
+		});
+	}
+	const std::vector<glm::ivec3>& blocks = mBlocks.active();
+	return util::parallelMax(mPool, 0, blocks.size(), [&](int first, int last){
+		float m = 0.0f;
+		for (int b = first; b < last; ++b)
+		{
+			glm::ivec3 regionBegin = glm::max(begin, blocks[b]);
+			glm::ivec3 regionEnd = glm::min(end, blocks[b] + BLOCK_SIZE);
+			if (regionBegin.x < regionEnd.x && regionBegin.y < regionEnd.y && regionBegin.z < regionEnd.z)
+				m = std::max(m, body(regionBegin, regionEnd));
+		}
+		return m;
+	});
+}
+
+CFDSimulation::CFDSimulation() :mPressureSolver(PressureSolver::GAUSS_SEIDEL), mBoundaryCondition(BoundaryCondition::NO_SLIP), mAdvectionScheme(AdvectionScheme::SEMI_LAGRANGIAN),
+	mFlipRatio(DEFAULT_FLIP_RATIO), mPressureTolerance(DEFAULT_PRESSURE_TOLERANCE), mViscosity(DEFAULT_VISCOSITY),
+	mCFLNumber(DEFAULT_CFL_NUMBER), mMinTimestep(DEFAULT_MIN_TIMESTEP), mMaxTimestep(DEFAULT_MAX_TIMESTEP), mPool(nullptr), mActiveBlocksOnly(false),
+	mParticleSortInterval(0), mStepsSinceSort(0), mFrameEpoch(0), mSnapshotFields(false), mSnapshotVelocity(false){
 	//Initialize the simulation using the default constants defined in the header
 	resize(DEFAULT_FLUID_WIDTH, DEFAULT_FLUID_HEIGHT, DEFAULT_FLUID_DEPTH);
 
 	//Remove this later
 	//Hard code setting up the marker particles for testing
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < 15; ++y)
-			for (int z = 1; z < mDepth - 1; ++z)
-			{
-				mFluid[Index(x, y, z)] = true;
-				mMarkerParticles.push_back(glm::vec3(x + 0.5f , y + 0.5f, z + 0.5f));
-				
-			}
+	addFluidBlock(glm::ivec3(1), glm::ivec3(mWidth - 1, 15, mDepth - 1));
 
 	for (int x = 5; x < mWidth - 5; ++x)
-		for (int y = 5; y < 15; ++y)
+		for (int y = 5; y <= 15; ++y)
 			for (int z = 5; z < mDepth - 5; ++z)
 			{
-				mVelocity[Index(x, y, z)] = glm::vec3(0.0f, 50.0f, 0.0f);
+				mV(x, y, z) = 50.0f;
 
 			}
+	//Particles start out moving with the fluid around them
+	gridToParticles(0.0f);
+	publishFrame();
 
 
 
@@ -31,12 +113,229 @@ CFDSimulation::CFDSimulation(){
 	
 }
 
-CFDSimulation::CFDSimulation(int width, int height, int depth){
+CFDSimulation::CFDSimulation(int width, int height, int depth, PressureSolver pressureSolver, AdvectionScheme advectionScheme)
+	:mPressureSolver(pressureSolver), mBoundaryCondition(BoundaryCondition::NO_SLIP), mAdvectionScheme(advectionScheme), mFlipRatio(DEFAULT_FLIP_RATIO), mPressureTolerance(DEFAULT_PRESSURE_TOLERANCE), mViscosity(DEFAULT_VISCOSITY),
+	mCFLNumber(DEFAULT_CFL_NUMBER), mMinTimestep(DEFAULT_MIN_TIMESTEP), mMaxTimestep(DEFAULT_MAX_TIMESTEP), mPool(nullptr), mActiveBlocksOnly(false),
+	mParticleSortInterval(0), mStepsSinceSort(0), mFrameEpoch(0), mSnapshotFields(false), mSnapshotVelocity(false){
 	//Initialize the simulation using the given width, height, and depth
 	resize(width, height, depth);
+	publishFrame();
+}
+
+void CFDSimulation::addFluidBlock(const glm::ivec3& begin, const glm::ivec3& end){
+	const glm::ivec3 first = glm::max(begin, glm::ivec3(1));
+	const glm::ivec3 last = glm::min(end, glm::ivec3(mWidth - 1, mHeight - 1, mDepth - 1));
+	for (int x = first.x; x < last.x; ++x)
+		for (int y = first.y; y < last.y; ++y)
+			for (int z = first.z; z < last.z; ++z)
+			{
+				const glm::vec3 position(x + 0.5f, y + 0.5f, z + 0.5f);
+				mFluid(x, y, z) = true;
+				mParticles.add(position, velocityAt(position));
+			}
+}
+
+int CFDSimulation::update(float frameTime){
+	PROFILE_ZONE("CFDSimulation::update");
+	//Leftovers smaller than this are rounding error, not time left to simulate
+	const float epsilon = frameTime * 1e-4f;
+	float remaining = frameTime;
+	int substeps = 0;
+	while (remaining > epsilon)
+	{
+		//Split what is left of the frame into equal substeps no larger than the stable timestep,
+		//so the frame doesn't end with a sliver of a step
+		float dt = computeTimestep();
+		dt = dt >= remaining ? remaining : remaining / std::ceil(remaining / dt);
+		step(dt);
+		remaining -= dt;
+		++substeps;
+	}
+	publishFrame();
+	return substeps;
+}
+
+void CFDSimulation::publishFrame(){
+	PROFILE_ZONE("publishFrame");
+	//The slot being written holds a frame from a while ago, copying into it reuses its storage
+	SimulationFrame& frame = mFrames.writeSlot();
+	frame.epoch = mFrameEpoch++;
+	mParticles.copyTo(frame.particles);
+	if (mSnapshotFields)
+		frame.fields = mFields;
+	else
+		frame.fields.clear();
+	if (mSnapshotVelocity)
+	{
+		frame.u = mU;
+		frame.v = mV;
+		frame.w = mW;
+		frame.pressure = mPressure;
+	}
+	else
+		frame.u = frame.v = frame.w = frame.pressure = Grid3D<float>();
+	mFrames.publish();
+}
+
+const SimulationFrame& CFDSimulation::latestFrame(){
+	mFrames.acquire();
+	return mFrames.readSlot();
+}
+
+//Copies every cell of q to out, x first, then y, then z, without the padding of the grid's layout
+template <typename T>
+static void storeGrid(ThreadPool* pool, const Grid3D<T>& q, unsigned char* out){
+	T* values = reinterpret_cast<T*>(out);
+	util::parallelFor(pool, 0, q.depth(), [&](int zBegin, int zEnd){
+		for (int z = zBegin; z < zEnd; ++z)
+			for (int y = 0; y < q.height(); ++y)
+			{
+				T* row = values + (static_cast<std::size_t>(z) * q.height() + y) * q.width();
+				for (int x = 0; x < q.width(); ++x)
+					row[x] = q(x, y, z);
+			}
+	});
+}
+
+//Reverse of storeGrid, q has to have the size of the grid that was stored
+template <typename T>
+static void loadGrid(ThreadPool* pool, const unsigned char* in, Grid3D<T>& q){
+	const T* values = reinterpret_cast<const T*>(in);
+	util::parallelFor(pool, 0, q.depth(), [&](int zBegin, int zEnd){
+		for (int z = zBegin; z < zEnd; ++z)
+			for (int y = 0; y < q.height(); ++y)
+			{
+				const T* row = values + (static_cast<std::size_t>(z) * q.height() + y) * q.width();
+				for (int x = 0; x < q.width(); ++x)
+					q(x, y, z) = row[x];
+			}
+	});
+}
+
+std::future<bool> CFDSimulation::saveCheckpoint(const std::string& path) const{
+	PROFILE_ZONE("saveCheckpoint");
+	checkpoint::Header header;
+	std::memcpy(header.magic, checkpoint::MAGIC, sizeof(header.magic));
+	header.version = checkpoint::VERSION;
+	header.width = mWidth;
+	header.height = mHeight;
+	header.depth = mDepth;
+	header.fieldCount = mFields.size();
+	header.reserved = 0;
+	header.particleCount = mParticles.size();
+	const checkpoint::Sections sections = checkpoint::sections(header);
+
+	//The whole file is laid out in memory here, the background thread only has to write it out
+	std::vector<unsigned char> image(sections.end, 0);
+	std::memcpy(image.data(), &header, sizeof(header));
+	storeGrid(mPool, mU, &image[sections.u]);
+	storeGrid(mPool, mV, &image[sections.v]);
+	storeGrid(mPool, mW, &image[sections.w]);
+	storeGrid(mPool, mPressure, &image[sections.pressure]);
+	storeGrid(mPool, mFluid, &image[sections.fluid]);
+	const float* particles[checkpoint::PARTICLE_ARRAYS] = { mParticles.x(), mParticles.y(), mParticles.z(),
+		mParticles.u(), mParticles.v(), mParticles.w() };
+	if (!mParticles.empty())
+		for (int i = 0; i < checkpoint::PARTICLE_ARRAYS; ++i)
+			std::memcpy(&image[sections.particles[i]], particles[i], mParticles.size() * sizeof(float));
+	for (unsigned int f = 0; f < mFields.size(); ++f)
+		storeGrid(mPool, mFields[f], &image[sections.fields + f * sections.fieldStride]);
+
+	return std::async(std::launch::async, [image = std::move(image), path](){
+		PROFILE_ZONE("writeCheckpoint");
+		const std::string temporary = path + ".tmp";
+		FILE* file = std::fopen(temporary.c_str(), "wb");
+		if (!file)
+			return false;
+		const bool written = std::fwrite(image.data(), 1, image.size(), file) == image.size();
+		if (std::fclose(file) != 0 || !written)
+		{
+			std::remove(temporary.c_str());
+			return false;
+		}
+#ifdef _WIN32
+		//rename doesn't replace existing files on Windows
+		std::remove(path.c_str());
+#endif
+		return std::rename(temporary.c_str(), path.c_str()) == 0;
+	});
+}
+
+bool CFDSimulation::loadCheckpoint(const std::string& path){
+	PROFILE_ZONE("loadCheckpoint");
+	MappedFile file;
+	if (!file.open(path) || file.size() < sizeof(checkpoint::Header))
+		return false;
+	checkpoint::Header header;
+	std::memcpy(&header, file.data(), sizeof(header));
+	auto validSize = [](std::int32_t size){ return size >= 3 && size <= MAX_GRID_SIZE; };
+	if (std::memcmp(header.magic, checkpoint::MAGIC, sizeof(header.magic)) != 0 || header.version != checkpoint::VERSION
+		|| !validSize(header.width) || !validSize(header.height) || !validSize(header.depth))
+		return false;
+	//Counts too large for the file are rejected before they go into the section offsets, where they could overflow
+	const std::size_t cells = static_cast<std::size_t>(header.width) * header.height * header.depth;
+	if (header.particleCount > file.size() / (checkpoint::PARTICLE_ARRAYS * sizeof(float))
+		|| header.fieldCount > file.size() / (cells * sizeof(float)))
+		return false;
+	const checkpoint::Sections sections = checkpoint::sections(header);
+	if (sections.end > file.size())
+		return false;
+	//Particles index the grid by their cell, so every one must be inside it
+	const std::size_t particleCount = static_cast<std::size_t>(header.particleCount);
+	const std::int32_t size[3] = { header.width, header.height, header.depth };
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float* p = reinterpret_cast<const float*>(file.data() + sections.particles[axis]);
+		const float high = static_cast<float>(size[axis] - 1);
+		for (std::size_t i = 0; i < particleCount; ++i)
+			if (!(p[i] >= 1.0f && p[i] <= high))
+				return false;
+	}
+
+	//Grids are filled straight from the mapped file
+	const unsigned char* data = file.data();
+	mFields.resize(header.fieldCount);
+	mFieldBuffers.resize(header.fieldCount);
+	resize(header.width, header.height, header.depth);
+	loadGrid(mPool, data + sections.u, mU);
+	loadGrid(mPool, data + sections.v, mV);
+	loadGrid(mPool, data + sections.w, mW);
+	clearWallFaces();
+	loadGrid(mPool, data + sections.pressure, mPressure);
+	loadGrid(mPool, data + sections.fluid, mFluid);
+	for (unsigned int f = 0; f < mFields.size(); ++f)
+		loadGrid(mPool, data + sections.fields + f * sections.fieldStride, mFields[f]);
+	auto particles = [&](int i){ return reinterpret_cast<const float*>(data + sections.particles[i]); };
+	mParticles.assign(header.particleCount, particles(0), particles(1), particles(2), particles(3), particles(4), particles(5));
+	mStepsSinceSort = 0;
+	publishFrame();
+	return true;
 }
 
-void CFDSimulation::update(float dt){
+float CFDSimulation::computeTimestep(){
+	PROFILE_ZONE("computeTimestep");
+	//Velocity outside active blocks is still air. Faces on the far side of a region's cells are included,
+	//which covers the last face along each axis.
+	auto maxAbs = [&](const Grid3D<float>& q){
+		const glm::ivec3 size(q.width(), q.height(), q.depth());
+		return maxOverRegions(glm::ivec3(0), size, [&](const glm::ivec3& begin, const glm::ivec3& regionEnd){
+			const glm::ivec3 end = glm::min(regionEnd + 1, size);
+			float m = 0.0f;
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					for (int x = begin.x; x < end.x; ++x)
+						m = std::max(m, std::abs(q(x, y, z)));
+			return m;
+		});
+	};
+	//Fluid at rest can still pick up speed from gravity within the step, sqrt(5 * g * dx) accounts for that
+	//(Bridson, "Fluid Simulation for Computer Graphics").
+	float speed = std::max(maxAbs(mU), std::max(maxAbs(mV), maxAbs(mW))) + std::sqrt(5.0f * std::abs(GRAVITY));
+	return glm::clamp(mCFLNumber / speed, mMinTimestep, mMaxTimestep);
+}
+
+void CFDSimulation::step(float dt){
+	PROFILE_ZONE("step");
 	/*
 	updateParticles(dt);
 	diffuseVelocity();
@@ -44,331 +343,733 @@ void CFDSimulation::update(float dt){
 	diffuseVelocity();
 	project();
 	*/
+	if (mAdvectionScheme == AdvectionScheme::FLIP)
+	{
+		//The particles hand their velocity to the grid, which applies forces, viscosity and the projection
+		//and hands back the change. Particles are sorted every substep for the per cell ranges particlesToGrid gathers from.
+		mParticles.sortByCell(mWidth, mHeight, mDepth);
+		determineFluidCells();
+		particlesToGrid();
+		applyForces(dt);
+		diffuseVelocity(dt);
+		project();
+		gridToParticles(mFlipRatio);
+		advectFields(dt);
+		updateParticles(dt);
+		return;
+	}
+	if (mParticleSortInterval > 0 && ++mStepsSinceSort >= mParticleSortInterval)
+	{
+		mParticles.sortByCell(mWidth, mHeight, mDepth);
+		mStepsSinceSort = 0;
+	}
 	determineFluidCells();
 	applyForces(dt);
-	diffuseVelocity();
+	diffuseVelocity(dt);
 	project();
+	advectFields(dt);
 	advectVelocity(dt);
 	project();
 	updateParticles(dt);
 }
 
+void CFDSimulation::setThreadPool(ThreadPool* pool){
+	mPool = pool;
+	mMultigrid.setThreadPool(pool);
+	mPCGSolver.setThreadPool(pool);
+	mBlocks.setThreadPool(pool);
+}
+
+void CFDSimulation::setBoundaryCondition(BoundaryCondition condition){
+	mBoundaryCondition = condition;
+	mMultigrid.setBoundaryCondition(condition);
+	mPCGSolver.setBoundaryCondition(condition);
+	clearWallFaces();
+}
+
+void CFDSimulation::setAdvectionScheme(AdvectionScheme advectionScheme){
+	if (advectionScheme == AdvectionScheme::FLIP && mAdvectionScheme != AdvectionScheme::FLIP)
+		gridToParticles(0.0f);
+	mAdvectionScheme = advectionScheme;
+}
+
+void CFDSimulation::setActiveBlocksOnly(bool activeBlocksOnly){
+	mActiveBlocksOnly = activeBlocksOnly;
+	//Start from every block active, the next step deactivates the ones without fluid
+	mBlocks.resize(mWidth, mHeight, mDepth);
+}
+
 void CFDSimulation::updateParticles(float dt)
 {
-	for (auto &p : mMarkerParticles)
+	PROFILE_ZONE("updateParticles");
+	//Particles are kept this far inside the walls so they always land in an interior cell
+	const float margin = 1e-3f;
+	const glm::vec3 low(1.0f + margin);
+	const glm::vec3 high(mWidth - 1 - margin, mHeight - 1 - margin, mDepth - 1 - margin);
+	float* px = mParticles.x();
+	float* py = mParticles.y();
+	float* pz = mParticles.z();
+	util::parallelFor(mPool, 0, mParticles.size(), [&](int begin, int end){
+		float x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH], u[SAMPLE_BATCH], v[SAMPLE_BATCH], w[SAMPLE_BATCH];
+		for (int first = begin; first < end; first += SAMPLE_BATCH)
+		{
+			const int count = std::min(SAMPLE_BATCH, end - first);
+			//Second order Runge-Kutta (midpoint method). The velocity at the particle takes it half a step forward,
+			//and the velocity there takes it the whole step.
+			velocityAt(px + first, py + first, pz + first, count, u, v, w);
+			for (int i = 0; i < count; ++i)
+			{
+				x[i] = glm::clamp(px[first + i] + 0.5f * dt * u[i], low.x, high.x);
+				y[i] = glm::clamp(py[first + i] + 0.5f * dt * v[i], low.y, high.y);
+				z[i] = glm::clamp(pz[first + i] + 0.5f * dt * w[i], low.z, high.z);
+			}
+			velocityAt(x, y, z, count, u, v, w);
+			for (int i = 0; i < count; ++i)
+			{
+				px[first + i] = glm::clamp(px[first + i] + dt * u[i], low.x, high.x);
+				py[first + i] = glm::clamp(py[first + i] + dt * v[i], low.y, high.y);
+				pz[first + i] = glm::clamp(pz[first + i] + dt * w[i], low.z, high.z);
+			}
+		}
+	});
+}
+
+void CFDSimulation::particlesToGrid(){
+	PROFILE_ZONE("particlesToGrid");
+	//The buffers hold the splatting weights, then a copy of the new velocity to measure the change against
+	splatComponent(mParticles.u(), 0, mU, mUBuffer);
+	splatComponent(mParticles.v(), 1, mV, mVBuffer);
+	splatComponent(mParticles.w(), 2, mW, mWBuffer);
+	extrapolateComponent(0, mU, mUBuffer);
+	extrapolateComponent(1, mV, mVBuffer);
+	extrapolateComponent(2, mW, mWBuffer);
+	const std::pair<Grid3D<float>*, Grid3D<float>*> components[] = { { &mU, &mUBuffer }, { &mV, &mVBuffer }, { &mW, &mWBuffer } };
+	for (const auto& c : components)
 	{
-		//no safety checks for now, nothing should even be moving
-		glm::vec3 newPosition = p + mVelocity[(Index(static_cast<int>(p.x), static_cast<int>(p.y), static_cast<int>(p.z)))] * dt;
-		p = newPosition;
+		const Grid3D<float>& q = *c.first;
+		Grid3D<float>& copy = *c.second;
+		forEachRegion(glm::ivec3(0), glm::ivec3(q.width(), q.height(), q.depth()), [&](const glm::ivec3& begin, const glm::ivec3& end){
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					for (int x = begin.x; x < end.x; ++x)
+						copy(x, y, z) = q(x, y, z);
+		});
+	}
+}
+
+void CFDSimulation::splatComponent(const float* values, int axis, Grid3D<float>& q, Grid3D<float>& weights){
+	const glm::vec3 offset = FACE_OFFSETS[axis];
+	const float* px = mParticles.x();
+	const float* py = mParticles.y();
+	const float* pz = mParticles.z();
+	const Grid3D<int>& cellStart = mParticles.cellStart();
+	const Grid3D<int>& cellCount = mParticles.cellCount();
+	const glm::ivec3 lastCell(mWidth - 1, mHeight - 1, mDepth - 1);
+	//Each face averages the particles less than a cell away from it along every axis, weighted by the same trilinear
+	//hat the sampler interpolates with. Faces gather from the cells around them instead of particles scattering
+	//to the faces around them, so regions never write to the same face and can run in parallel.
+	glm::ivec3 facesBegin, facesEnd;
+	velocityFaces(axis, q, facesBegin, facesEnd);
+	forEachRegion(facesBegin, facesEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x)
+				{
+					const glm::vec3 face = glm::vec3(x, y, z) + offset;
+					//Cells overlapping (face - 1, face + 1) along each axis
+					const glm::ivec3 low = glm::max(glm::ivec3(glm::floor(face)) - 1, glm::ivec3(0));
+					const glm::ivec3 high = glm::min(glm::ivec3(glm::ceil(face)), lastCell);
+					float sum = 0.0f, weightSum = 0.0f;
+					for (int cz = low.z; cz <= high.z; ++cz)
+						for (int cy = low.y; cy <= high.y; ++cy)
+							for (int cx = low.x; cx <= high.x; ++cx)
+							{
+								const int first = cellStart(cx, cy, cz), last = first + cellCount(cx, cy, cz);
+								for (int i = first; i < last; ++i)
+								{
+									const float wx = 1.0f - std::abs(px[i] - face.x);
+									const float wy = 1.0f - std::abs(py[i] - face.y);
+									const float wz = 1.0f - std::abs(pz[i] - face.z);
+									if (wx > 0.0f && wy > 0.0f && wz > 0.0f)
+									{
+										const float weight = wx * wy * wz;
+										sum += weight * values[i];
+										weightSum += weight;
+									}
+								}
+							}
+					q(x, y, z) = weightSum > 0.0f ? sum / weightSum : 0.0f;
+					weights(x, y, z) = weightSum;
+				}
+	});
+}
 
+void CFDSimulation::extrapolateComponent(int axis, Grid3D<float>& q, Grid3D<float>& weights){
+	//Faces no particle reached take the average of the neighboring faces that have a velocity, one layer at a time.
+	//Particles at the surface then interpolate velocity that carries on from the fluid's instead of dropping to 0.
+	glm::ivec3 facesBegin, facesEnd;
+	velocityFaces(axis, q, facesBegin, facesEnd);
+	for (int layer = 0; layer < VELOCITY_EXTRAPOLATION_LAYERS; ++layer)
+	{
+		//weights is only read in this pass and flags are applied in the next, so the faces of a layer don't feed each other
+		forEachRegion(facesBegin, facesEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					for (int x = begin.x; x < end.x; ++x)
+					{
+						mFaceFlags(x, y, z) = false;
+						if (weights(x, y, z) > 0.0f)
+							continue;
+						float sum = 0.0f;
+						int known = 0;
+						//Splatting didn't write weights outside the faces it updates, those faces never count as known
+						auto gather = [&](int i, int j, int k){
+							const bool interior = i >= facesBegin.x && j >= facesBegin.y && k >= facesBegin.z
+								&& i < facesEnd.x && j < facesEnd.y && k < facesEnd.z;
+							if (interior && weights(i, j, k) > 0.0f)
+							{
+								sum += q(i, j, k);
+								++known;
+							}
+						};
+						gather(x - 1, y, z);
+						gather(x + 1, y, z);
+						gather(x, y - 1, z);
+						gather(x, y + 1, z);
+						gather(x, y, z - 1);
+						gather(x, y, z + 1);
+						if (known > 0)
+						{
+							q(x, y, z) = sum / known;
+							mFaceFlags(x, y, z) = true;
+						}
+					}
+		});
+		forEachRegion(facesBegin, facesEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					for (int x = begin.x; x < end.x; ++x)
+						if (mFaceFlags(x, y, z))
+							weights(x, y, z) = 1.0f;
+		});
 	}
 }
+
+void CFDSimulation::gridToParticles(float flipRatio){
+	PROFILE_ZONE("gridToParticles");
+	const float* px = mParticles.x();
+	const float* py = mParticles.y();
+	const float* pz = mParticles.z();
+	float* pu = mParticles.u();
+	float* pv = mParticles.v();
+	float* pw = mParticles.w();
+	util::parallelFor(mPool, 0, mParticles.size(), [&](int begin, int end){
+		float u[SAMPLE_BATCH], v[SAMPLE_BATCH], w[SAMPLE_BATCH], oldU[SAMPLE_BATCH], oldV[SAMPLE_BATCH], oldW[SAMPLE_BATCH];
+		for (int first = begin; first < end; first += SAMPLE_BATCH)
+		{
+			const int count = std::min(SAMPLE_BATCH, end - first);
+			velocityAt(px + first, py + first, pz + first, count, u, v, w);
+			if (flipRatio > 0.0f)
+			{
+				sampleComponent(0, mUBuffer, px + first, py + first, pz + first, count, oldU);
+				sampleComponent(1, mVBuffer, px + first, py + first, pz + first, count, oldV);
+				sampleComponent(2, mWBuffer, px + first, py + first, pz + first, count, oldW);
+			}
+			else
+			{
+				std::fill(oldU, oldU + count, 0.0f);
+				std::fill(oldV, oldV + count, 0.0f);
+				std::fill(oldW, oldW + count, 0.0f);
+			}
+			for (int i = 0; i < count; ++i)
+			{
+				const int p = first + i;
+				pu[p] = flipRatio * (pu[p] + u[i] - oldU[i]) + (1.0f - flipRatio) * u[i];
+				pv[p] = flipRatio * (pv[p] + v[i] - oldV[i]) + (1.0f - flipRatio) * v[i];
+				pw[p] = flipRatio * (pw[p] + w[i] - oldW[i]) + (1.0f - flipRatio) * w[i];
+			}
+		}
+	});
+}
+
 void CFDSimulation::resize(int width, int height, int depth){
 	//Set the width, height, and depth
 	mWidth = width;
 	mHeight = height;
 	mDepth = depth;
-	//Compute the total volume of the fluid
-	unsigned int volume = mWidth * mHeight * mDepth;
 	//Then reallocate new data structures of the required size with default values.
-	mVelocity = std::vector<glm::vec3>(volume, glm::vec3(0.0f, 0.0f, 0.0f));
-	mVelocityBuffer = std::vector<glm::vec3>(volume, glm::vec3(0.0f, 0.0f, 0.0f));
-	mPressure = std::vector<float>(volume, 0.0f);
-	mBuffer = std::vector<float>(volume, 0.0f);
-	mBuffer2 = std::vector<float>(volume, 0.0f);
-	mFluid = std::vector<bool>(volume, false);
+	//There is one more face than there are cells along the axis each velocity component is normal to
+	mU.resize(width + 1, height, depth, 0.0f);
+	mV.resize(width, height + 1, depth, 0.0f);
+	mW.resize(width, height, depth + 1, 0.0f);
+	mUBuffer.resize(width + 1, height, depth, 0.0f);
+	mVBuffer.resize(width, height + 1, depth, 0.0f);
+	mWBuffer.resize(width, height, depth + 1, 0.0f);
+	mPressure.resize(width, height, depth, 0.0f);
+	mBuffer.resize(width, height, depth, 0.0f);
+	mBuffer2.resize(width, height, depth, 0.0f);
+	mFluid.resize(width, height, depth, false);
+	mFaceFlags.resize(width + 1, height + 1, depth + 1, false);
+	mResidual.resize(width + 1, height + 1, depth + 1, 0.0f);
+	mSearch.resize(width + 1, height + 1, depth + 1, 0.0f);
+	mProduct.resize(width + 1, height + 1, depth + 1, 0.0f);
+	mMultigrid.resize(width, height, depth);
+	mPCGSolver.resize(width, height, depth);
+	mBlocks.resize(width, height, depth);
+	for (unsigned int f = 0; f < mFields.size(); ++f)
+	{
+		mFields[f].resize(width, height, depth, 0.0f);
+		mFieldBuffers[f].resize(width, height, depth, 0.0f);
+	}
 }
 
 void CFDSimulation::advectVelocity(float dt){
-	//for every voxel
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < mHeight - 1; ++y)
-			for (int z = 1; z < mDepth - 1; ++z)
-			{
-				//Predict where the current voxel of fluid was last time step 
-				//by using (previous position) = (current position) - velocity * dt.
-				glm::vec3 prevPosition = glm::vec3(x, y, z) - mVelocity[Index(x,y,z)] * dt;
-
-				//Get a rounded version of this position
-				glm::ivec3 iPrevPosition = glm::round(prevPosition);
-
-				//get the 6 different x, y, and z positions we will need to use as indices for the 8 nieghbors of this position
-				int x1 = iPrevPosition.x + 1;
-				int y1 = iPrevPosition.y + 1;
-				int z1 = iPrevPosition.z + 1;
-				int x0 = iPrevPosition.x - 1;
-				int y0 = iPrevPosition.y - 1;
-				int z0 = iPrevPosition.z - 1;
-
-				//Get the weights to be used for trilinear interpolation. 
-				//positive direction(right, above, forward)
-				float wx1 = x1 - prevPosition.x;
-				float wy1 = y1 - prevPosition.y;
-				float wz1 = z1 - prevPosition.z;
-
-				//negative direction is just 1.0 - positive direction weight in this case
-				float wx0 = 1.0f - wx1;
-				float wy0 = 1.0f - wy1;
-				float wz0 = 1.0f - wz1;
-
-				//Do trilinear interpolation
-				mVelocityBuffer[Index(x, y, z)] = (wx1 * wy1 * wz1 * mVelocity[Index(x1, y1, z1)] + wx1 * wy1 * wz0 * mVelocity[Index(x1, y1, z0)] +
-					wx1 * wy0 * wz1 * mVelocity[Index(x1, y0, z1)] + wx0 * wy1 * wz1 * mVelocity[Index(x0, y1, z1)] +
-					wx1 * wy0 * wz0 * mVelocity[Index(x1, y0, z0)] + wx0 * wy1 * wz0 * mVelocity[Index(x0, y1, z0)] +
-					wx0 * wy0 * wz1 * mVelocity[Index(x0, y0, z1)] + wx0 * wy0 * wz0 * mVelocity[Index(x0, y0, z0)]);
-
-			
-			
-			}
-	mVelocity.swap(mVelocityBuffer);
-	
+	PROFILE_ZONE("advectVelocity");
+	//Each component is advected into its buffer using the old velocity field, then all three are swapped in at once.
+	advectComponent(0, mU, mUBuffer, dt);
+	advectComponent(1, mV, mVBuffer, dt);
+	advectComponent(2, mW, mWBuffer, dt);
+	mU.swap(mUBuffer);
+	mV.swap(mVBuffer);
+	mW.swap(mWBuffer);
 }
 
-void CFDSimulation::diffuseVelocity(){
-	for (int it = 20; it > 0; --it)
-	{
-		for (int x = 1; x < mWidth - 1; ++x)
-			for (int y = 1; y < mHeight - 1; ++y)
-				for (int z = 1; z < mDepth - 1; ++z)
+void CFDSimulation::advectComponent(int axis, const Grid3D<float>& q, Grid3D<float>& out, float dt){
+	//for every face, in batches along x. Each region only writes to its own faces in the buffer, so regions can run in parallel.
+	//Faces on solid walls are left at 0.
+	const glm::vec3 offset = FACE_OFFSETS[axis];
+	glm::ivec3 facesBegin, facesEnd;
+	velocityFaces(axis, q, facesBegin, facesEnd);
+	forEachRegion(facesBegin, facesEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+		float x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH], result[SAMPLE_BATCH];
+		for (int k = begin.z; k < end.z; ++k)
+			for (int j = begin.y; j < end.y; ++j)
+				for (int first = begin.x; first < end.x; first += SAMPLE_BATCH)
 				{
-					//calculate the divergence of the velocity for this cell
-					float divergence = ((mVelocity[Index(x + 1, y, z)].x - mVelocity[Index(x - 1, y, z)].x)
-						+ (mVelocity[Index(x, y + 1, z)].y - mVelocity[Index(x, y - 1, z)].y)
-						+ (mVelocity[Index(x, y, z + 1)].z - mVelocity[Index(x, y, z - 1)].z)) / 2.0f;
-					//Calculate the updated velocity and place it in the buffer.
-					mVelocity[Index(x, y, z)] = (mVelocity[Index(x + 1, y, z)] + mVelocity[Index(x - 1, y, z)]
-						+ mVelocity[Index(x, y + 1, z)] + mVelocity[Index(x, y - 1, z)]
-						+ mVelocity[Index(x, y, z + 1)] + mVelocity[Index(x, y, z - 1)]
-						- divergence) / 6.0f;
-					
-
+					const int count = std::min(SAMPLE_BATCH, end.x - first);
+					for (int i = 0; i < count; ++i)
+					{
+						x[i] = first + i + offset.x;
+						y[i] = j + offset.y;
+						z[i] = k + offset.z;
+					}
+					//Predict where the fluid at these faces was last time step, then interpolate the component there
+					backtrace(x, y, z, count, dt);
+					sampleComponent(axis, q, x, y, z, count, result);
+					for (int i = 0; i < count; ++i)
+						out(first + i, j, k) = result[i];
 				}
-		//swap with buffer
-		//mVelocity.swap(mVelocityBuffer);
-		
-		//Enforce boundary conditions on velocity
-		setBoundariesVelocity(mVelocity);
-	}
+	});
 }
 
-void CFDSimulation::advectQuantity(std::vector<float>& q, float dt){
-	//for every voxel
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < mHeight - 1; ++y)
-			for (int z = 1; z < mDepth - 1; ++z)
-			{
-				//Predict where the current voxel of fluid was last time step 
-				//by using (previous position) = (current position) - velocity * dt.
-				glm::vec3 prevPosition = glm::vec3(x, y, z) - mVelocity[Index(x, y, z)] * dt;
-
-				//Get a rounded version of this position
-				glm::ivec3 iPrevPosition = glm::round(prevPosition);
-
-				//get the 6 different x, y, and z positions we will need to use as indices for the 8 nieghbors of this position
-				int x1 = iPrevPosition.x + 1;
-				int y1 = iPrevPosition.y + 1;
-				int z1 = iPrevPosition.z + 1;
-				int x0 = iPrevPosition.x - 1;
-				int y0 = iPrevPosition.y - 1;
-				int z0 = iPrevPosition.z - 1;
-
-				//Get the weights to be used for trilinear interpolation. 
-				//positive direction(right, above, forward)
-				float wx1 = x1 - prevPosition.x;
-				float wy1 = y1 - prevPosition.y;
-				float wz1 = z1 - prevPosition.z;
-
-				//negative direction is just 1.0 - positive direction weight in this case
-				float wx0 = 1.0f - wx1;
-				float wy0 = 1.0f - wy1;
-				float wz0 = 1.0f - wz1;
-
-		
-				//Do trilinear interpolation of the quantity
-				q[Index(x, y, z)] = (wx1 * wy1 * wz1 * q[Index(x1, y1, z1)] + wx1 * wy1 * wz0 * q[Index(x1, y1, z0)] +
-					wx1 * wy0 * wz1 * q[Index(x1, y0, z1)] + wx0 * wy1 * wz1 * q[Index(x0, y1, z1)] +
-					wx1 * wy0 * wz0 * q[Index(x1, y0, z0)] + wx0 * wy1 * wz0 * q[Index(x0, y1, z0)] +
-					wx0 * wy0 * wz1 * q[Index(x0, y0, z1)] + wx0 * wy0 * wz0 * q[Index(x0, y0, z0)]);
-				
-			}
+void CFDSimulation::diffuseVelocity(float dt){
+	PROFILE_ZONE("diffuseVelocity");
+	if (mViscosity <= 0.0f)
+		return;
+	diffuseComponent(0, mU, dt);
+	diffuseComponent(1, mV, dt);
+	diffuseComponent(2, mW, dt);
 }
 
-void CFDSimulation::diffuseQuantity(std::vector<float>& q){
-	for (int it = 20; it > 0; --it)
-	{
-		for (int x = 1; x < mWidth - 1; ++x)
-			for (int y = 1; y < mHeight - 1; ++y)
-				for (int z = 1; z < mDepth - 1; ++z)
-				{
-					//calculate the divergence of the velocity for this cell
-					float divergence = ((mVelocity[Index(x + 1, y, z)].x - mVelocity[Index(x - 1, y, z)].x)
-						+ (mVelocity[Index(x, y + 1, z)].y - mVelocity[Index(x, y - 1, z)].y)
-						+ (mVelocity[Index(x, y, z + 1)].z - mVelocity[Index(x, y, z - 1)].z)) / 2.0f;
-					//Calculate the updated value of the quantity and place it in the buffer.
-					mBuffer[Index(x, y, z)] = (q[Index(x + 1, y, z)] + q[Index(x - 1, y, z)]
-						+ q[Index(x, y + 1, z)] + q[Index(x, y - 1, z)]
-						+ q[Index(x, y, z + 1)] + q[Index(x, y, z - 1)]
-						- divergence) / 6.0f;
+int CFDSimulation::diffuseComponent(int axis, Grid3D<float>& q, float dt){
+	int iterations = 0;
+	withBoundaryPolicy(mBoundaryCondition, [&](auto policy){ iterations = this->diffuseComponent<decltype(policy)>(axis, q, dt); });
+	return iterations;
+}
 
+template <typename Policy>
+int CFDSimulation::diffuseComponent(int axis, Grid3D<float>& q, float dt){
+	//Backward Euler, (1 + 6a) q - a (sum of the 6 neighbors of q) = q from before the step, with a = viscosity * dt.
+	//Solved with conjugate gradient over the faces the stages update, starting from q itself. A neighbor outside them
+	//is a multiple of the face itself, given by the policy: boundary cells along a wall hold Policy::tangential of it,
+	//faces past an open wall carry on with it and faces on a solid wall are 0. So the system stays symmetric, and
+	//apart from the faces next to the walls the diagonal is the same everywhere. Jacobi preconditioning would hardly
+	//change anything, and the system only gets harder to solve as a grows.
+	const float a = mViscosity * dt;
+	const float diagonal = 1.0f + 6.0f * a;
+	glm::ivec3 interiorBegin, interiorEnd;
+	velocityFaces(axis, q, interiorBegin, interiorEnd);
+	glm::vec3 outside(Policy::tangential(1.0f));
+	outside[axis] = Policy::SOLID ? 0.0f : 1.0f;
+	auto neighbors = [&](const Grid3D<float>& g, int x, int y, int z){
+		const float center = g(x, y, z);
+		return (x + 1 < interiorEnd.x ? g(x + 1, y, z) : outside.x * center) + (x > interiorBegin.x ? g(x - 1, y, z) : outside.x * center)
+			+ (y + 1 < interiorEnd.y ? g(x, y + 1, z) : outside.y * center) + (y > interiorBegin.y ? g(x, y - 1, z) : outside.y * center)
+			+ (z + 1 < interiorEnd.z ? g(x, y, z + 1) : outside.z * center) + (z > interiorBegin.z ? g(x, y, z - 1) : outside.z * center);
+	};
+
+	//With q as the first guess the residual is a times the laplacian of q. The search vector starts as the residual.
+	double sigma = sumOverRegions(interiorBegin, interiorEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+		double sum = 0.0;
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x)
+				{
+					float r = a * (neighbors(q, x, y, z) - 6.0f * q(x, y, z));
+					mResidual(x, y, z) = r;
+					mSearch(x, y, z) = r;
+					sum += r * r;
 				}
-		//swap with buffer
-		q.swap(mBuffer);
+		return sum;
+	});
+	const double bNorm = sumOverRegions(interiorBegin, interiorEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+		double sum = 0.0;
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x)
+					sum += q(x, y, z) * q(x, y, z);
+		return sum;
+	});
+	const double threshold = VISCOSITY_TOLERANCE * VISCOSITY_TOLERANCE * bNorm;
+
+	int iterations = 0;
+	while (sigma > threshold && iterations < MAX_VISCOSITY_ITERATIONS)
+	{
+		++iterations;
+		double sq = sumOverRegions(interiorBegin, interiorEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+			double sum = 0.0;
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					for (int x = begin.x; x < end.x; ++x)
+					{
+						float product = diagonal * mSearch(x, y, z) - a * neighbors(mSearch, x, y, z);
+						mProduct(x, y, z) = product;
+						sum += mSearch(x, y, z) * product;
+					}
+			return sum;
+		});
+		if (sq == 0.0)
+			break;
+		const float alpha = static_cast<float>(sigma / sq);
+		double sigmaNew = sumOverRegions(interiorBegin, interiorEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+			double sum = 0.0;
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					for (int x = begin.x; x < end.x; ++x)
+					{
+						q(x, y, z) += alpha * mSearch(x, y, z);
+						float r = mResidual(x, y, z) - alpha * mProduct(x, y, z);
+						mResidual(x, y, z) = r;
+						sum += r * r;
+					}
+			return sum;
+		});
+		const float beta = static_cast<float>(sigmaNew / sigma);
+		sigma = sigmaNew;
+		if (sigma <= threshold)
+			break;
+		forEachRegion(interiorBegin, interiorEnd, [&](const glm::ivec3& begin, const glm::ivec3& end){
+			for (int z = begin.z; z < end.z; ++z)
+				for (int y = begin.y; y < end.y; ++y)
+					for (int x = begin.x; x < end.x; ++x)
+						mSearch(x, y, z) = mResidual(x, y, z) + beta * mSearch(x, y, z);
+		});
 	}
+	return iterations;
 }
 
+int CFDSimulation::addScalarField(float value){
+	mFields.push_back(Grid3D<float>(mWidth, mHeight, mDepth, value));
+	mFieldBuffers.push_back(Grid3D<float>(mWidth, mHeight, mDepth, value));
+	return mFields.size() - 1;
+}
 
+int CFDSimulation::addVectorField(const glm::vec3& value){
+	int id = addScalarField(value.x);
+	addScalarField(value.y);
+	addScalarField(value.z);
+	return id;
+}
 
+void CFDSimulation::advectFields(float dt){
+	PROFILE_ZONE("advectFields");
+	if (mFields.empty())
+		return;
+	//The departure point and interpolation weights of each cell are worked out once and applied to every field.
+	//Results go to the buffers, so every cell reads the fields as they were at the start of the step.
+	forEachRegion(glm::ivec3(1), glm::ivec3(mWidth - 1, mHeight - 1, mDepth - 1), [&](const glm::ivec3& begin, const glm::ivec3& end){
+		float x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH], result[SAMPLE_BATCH];
+		sampler::Weights weights;
+		for (int k = begin.z; k < end.z; ++k)
+			for (int j = begin.y; j < end.y; ++j)
+				for (int first = begin.x; first < end.x; first += SAMPLE_BATCH)
+				{
+					const int count = std::min(SAMPLE_BATCH, end.x - first);
+					for (int i = 0; i < count; ++i)
+					{
+						x[i] = first + i + CELL_OFFSET.x;
+						y[i] = j + CELL_OFFSET.y;
+						z[i] = k + CELL_OFFSET.z;
+					}
+					backtrace(x, y, z, count, dt);
+					sampler::computeWeights(mWidth, mHeight, mDepth, CELL_OFFSET, x, y, z, count, weights);
+					for (unsigned int f = 0; f < mFields.size(); ++f)
+					{
+						sampler::sample(mFields[f], weights, result);
+						Grid3D<float>& out = mFieldBuffers[f];
+						for (int i = 0; i < count; ++i)
+							out(first + i, j, k) = result[i];
+					}
+				}
+	});
+	for (unsigned int f = 0; f < mFields.size(); ++f)
+	{
+		mFields[f].swap(mFieldBuffers[f]);
+		//Walls copy the cell next to them, same as pressure
+		setBoundariesField(mFields[f]);
+	}
+}
 
 void CFDSimulation::project(){
-	//calculate the divergence of velocity for every cell, store it in a buffer
+	PROFILE_ZONE("project");
+	//calculate the negated divergence of velocity for every cell, store it in a buffer.
+	//Pressure solves 6p - (sum of neighbors) = -divergence, so that subtracting its gradient removes the divergence.
+	//On the staggered grid the divergence is just the difference between the velocities on opposite faces.
 	//We also set the pressure for each cell to 0, which is needed for the next step.
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < mHeight - 1; ++y)
-			for (int z = 1; z < mDepth - 1; ++z)
-			{
-				mBuffer[Index(x, y, z)] = ((mVelocity[Index(x + 1, y, z)].x - mVelocity[Index(x - 1, y, z)].x)
-					+ (mVelocity[Index(x, y + 1, z)].y - mVelocity[Index(x, y - 1, z)].y)
-					+ (mVelocity[Index(x, y, z + 1)].z - mVelocity[Index(x, y, z - 1)].z)) / 2.0f;
-				mPressure[Index(x, y, z)] = 0.0f;
-			}
-	//Enforce boundary conditions on the divergence values in the buffer as well as the pressure
-	setBoundariesPressure(mBuffer);
-	setBoundariesPressure(mPressure);
-	//Do jacobi iteration over the pressure field. Store output in second float buffer, swapping after each iteration.
-	for (int it = 20; it > 0; --it)
-	{
-		for (int x = 1; x < mWidth - 1; ++x)
-			for (int y = 1; y < mHeight - 1; ++y)
-				for (int z = 1; z < mDepth - 1; ++z)
+	forEachRegion(glm::ivec3(1), glm::ivec3(mWidth - 1, mHeight - 1, mDepth - 1), [&](const glm::ivec3& begin, const glm::ivec3& end){
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x)
 				{
-					mPressure[Index(x, y, z)] = (mPressure[Index(x + 1, y, z)] + mPressure[Index(x - 1, y, z)]
-						+ mPressure[Index(x, y + 1, z)] + mPressure[Index(x, y - 1, z)]
-						+ mPressure[Index(x, y, z + 1)] + mPressure[Index(x, y, z - 1)]
-						+ mBuffer[Index(x, y, z)]) / 6.0f;
+					mBuffer(x, y, z) = -((mU(x + 1, y, z) - mU(x, y, z)) + (mV(x, y + 1, z) - mV(x, y, z)) + (mW(x, y, z + 1) - mW(x, y, z)));
+					mPressure(x, y, z) = 0.0f;
 				}
-		//mPressure.swap(mBuffer2);
-		setBoundariesPressure(mPressure);
-	}
+	});
 
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < mHeight - 1; ++y)
-			for (int z = 1; z < mDepth - 1; ++z)
-			{
-				//Get the gradient of the pressure
-				glm::vec3 gradient = glm::vec3(mPressure[Index(x + 1, y, z)] - mPressure[Index(x - 1, y, z)],
-					mPressure[Index(x, y + 1, z)] - mPressure[Index(x, y - 1, z)],
-					mPressure[Index(x, y, z + 1)] - mPressure[Index(x, y, z - 1)]) / 2.0f;
-				//Find the new velocity by subtracting the current velocity by the gradient of the pressure
-				mVelocity[Index(x, y, z)] -= gradient;
-			}
-	//Set boundaries for velocity values
-	setBoundariesVelocity(mVelocity);
+	switch (mPressureSolver)
+	{
+	case PressureSolver::MULTIGRID:
+		mMultigrid.solve(mPressure, mBuffer, mPressureTolerance, MAX_MULTIGRID_CYCLES);
+		break;
+	case PressureSolver::PCG:
+		mPCGSolver.solve(mPressure, mBuffer, mFluid, mPressureTolerance, MAX_PCG_ITERATIONS);
+		break;
+	case PressureSolver::GAUSS_SEIDEL:
+	default:
+		withBoundaryPolicy(mBoundaryCondition, [&](auto policy){ this->relaxPressure<decltype(policy)>(20); });
+		break;
+	}
+	withBoundaryPolicy(mBoundaryCondition, [&](auto policy){ this->subtractPressureGradient<decltype(policy)>(); });
 }
 
-void CFDSimulation::setBoundariesVelocity(std::vector<glm::vec3>& velocity){
-	/*Cells on the boundary can be connected to either 0 or 1 non boundary cells. 
-	We can ignore boundary cells of the former kind.
-	For the others, we need to set the boundary cell velocity to the negation of the connected non-boundary cell's velocity.
-	This results in a net velocity of 0 between the 2 cells.
-	*/
-
-	//Set left and right boundaries
-	for (int y = 1; y < mHeight - 1; ++y)
-		for (int z = 1; z < mDepth - 1; ++z)
-		{
-			//Left boundary
-			velocity[Index(0, y, z)] = -velocity[Index(1, y, z)];
-			//Right boundary
-			velocity[Index(mWidth - 1, y, z)] = -velocity[Index(mWidth - 2, y, z)];
-		}
-	//Set top and bottom boundaries
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int z = 1; z < mDepth - 1; ++z)
-		{
-			//Bottom boundary
-			velocity[Index(x, 0, z)] = -velocity[Index(x, 1, z)];
-			//Top boundary
-			velocity[Index(x, mHeight - 1, z)] = -velocity[Index(x, mHeight - 2, z)];
-		}
-	//Front and Back boundaries
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < mHeight - 1; ++y)
+template <typename Policy>
+void CFDSimulation::relaxPressure(int iterations){
+	PROFILE_ZONE("relaxPressure");
+	for (int it = iterations; it > 0; --it)
+	{
+		//Red-black Gauss-Seidel. Cells where x + y + z is even are updated first, then the odd ones.
+		//A cell only reads cells of the other color, so every cell of one color can be updated in parallel
+		//and the result is the same whatever order or thread they are updated in.
+		for (int color = 0; color < 2; ++color)
 		{
-			//Back boundary
-			velocity[Index(x, y, 0)] = -velocity[Index(x, y, 1)];
-			//Front boundary
-			velocity[Index(x, y, mDepth - 1)] = -velocity[Index(x, y, mDepth - 2)];
+			forEachRegion(glm::ivec3(1), glm::ivec3(mWidth - 1, mHeight - 1, mDepth - 1), [&](const glm::ivec3& begin, const glm::ivec3& end){
+				stencil::relaxRedBlack<Policy>(mPressure, mBuffer, begin, end, color);
+			});
 		}
+	}
+}
+
+template <typename Policy>
+void CFDSimulation::subtractPressureGradient(){
+	forEachRegion(glm::ivec3(1), glm::ivec3(mWidth - 1, mHeight - 1, mDepth - 1), [&](const glm::ivec3& begin, const glm::ivec3& end){
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x)
+				{
+					//Subtract the gradient of the pressure from the velocity on the lower faces of this cell.
+					//Faces against a solid wall are skipped, their velocity stays 0. Faces against an open boundary
+					//take the pressure outside from the policy, and the cells at the far end also update the face above them.
+					float p = mPressure(x, y, z);
+					if (x > 1)
+						mU(x, y, z) -= p - mPressure(x - 1, y, z);
+					else if (!Policy::SOLID)
+						mU(x, y, z) -= p - Policy::pressure(p);
+					if (y > 1)
+						mV(x, y, z) -= p - mPressure(x, y - 1, z);
+					else if (!Policy::SOLID)
+						mV(x, y, z) -= p - Policy::pressure(p);
+					if (z > 1)
+						mW(x, y, z) -= p - mPressure(x, y, z - 1);
+					else if (!Policy::SOLID)
+						mW(x, y, z) -= p - Policy::pressure(p);
+					if (!Policy::SOLID)
+					{
+						if (x == mWidth - 2)
+							mU(x + 1, y, z) -= Policy::pressure(p) - p;
+						if (y == mHeight - 2)
+							mV(x, y + 1, z) -= Policy::pressure(p) - p;
+						if (z == mDepth - 2)
+							mW(x, y, z + 1) -= Policy::pressure(p) - p;
+					}
+				}
+	});
+}
+
+bool CFDSimulation::solidWalls() const{
+	bool solid = true;
+	withBoundaryPolicy(mBoundaryCondition, [&](auto policy){ solid = decltype(policy)::SOLID; });
+	return solid;
+}
+
+void CFDSimulation::velocityFaces(int axis, const Grid3D<float>& q, glm::ivec3& begin, glm::ivec3& end) const{
+	begin = glm::ivec3(1);
+	end = glm::ivec3(q.width() - 1, q.height() - 1, q.depth() - 1);
+	//The faces on the walls are 1 and end - 1 along the axis the component is normal to
+	if (solidWalls())
+	{
+		begin[axis] = 2;
+		end[axis] -= 1;
+	}
+}
 
-	//Set corners
-	velocity[Index(0, 0, 0)] = (velocity[Index(1, 0, 0)] + velocity[Index(0, 1, 0)] + velocity[Index(0, 0, 1)]) / 3.0f;
-	velocity[Index(mWidth - 1, 0, 0)] = (velocity[Index(mWidth - 2, 0, 0)] + velocity[Index(mWidth - 1, 1, 0)] + velocity[Index(mWidth - 1, 0, 1)]) / 3.0f;
-	velocity[Index(0, mHeight - 1, 0)] = (velocity[Index(1, mHeight - 1, 0)] + velocity[Index(0, mHeight - 2, 0)] + velocity[Index(0, mHeight - 1, 1)]) / 3.0f;
-	velocity[Index(0, 0, mDepth - 1)] = (velocity[Index(1, 0, mDepth -1)] + velocity[Index(0, 1, mDepth - 1)] + velocity[Index(0, 0, mDepth - 2)]) / 3.0f;
-	velocity[Index(mWidth - 1, mHeight - 1, 0)] = (velocity[Index(mWidth - 2, mHeight - 1, 0)] + velocity[Index(mWidth - 1, mHeight - 2, 0)] + velocity[Index(mWidth - 1, mHeight - 1, 1)]) / 3.0f;
-	velocity[Index(mWidth - 1, 0, mDepth - 1)] = (velocity[Index(mWidth - 2, 0, mDepth - 1)] + velocity[Index(mWidth - 1, 1, mDepth - 1)] + velocity[Index(mWidth - 1, 0, mWidth - 2)]) / 3.0f;
-	velocity[Index(0, mHeight - 1, mDepth - 1)] = (velocity[Index(1, mHeight - 1, mDepth - 1)] + velocity[Index(0, mHeight - 2, mDepth - 1)] + velocity[Index(0, mHeight - 1, mDepth - 2)]) / 3.0f;
-	velocity[Index(mWidth - 1, mHeight - 1, mDepth - 1)] = (velocity[Index(mWidth - 2, mHeight - 1, mDepth - 1)] + velocity[Index(mWidth - 1, mHeight - 2, mDepth - 1)] + velocity[Index(mWidth - 1, mHeight - 1, mDepth - 2)]) / 3.0f;
+void CFDSimulation::clearWallFaces(){
+	if (!solidWalls())
+		return;
+	for (Grid3D<float>* q : { &mU, &mUBuffer })
+		for (int z = 0; z < mDepth; ++z)
+			for (int y = 0; y < mHeight; ++y)
+			{
+				(*q)(1, y, z) = 0.0f;
+				(*q)(mWidth - 1, y, z) = 0.0f;
+			}
+	for (Grid3D<float>* q : { &mV, &mVBuffer })
+		for (int z = 0; z < mDepth; ++z)
+			for (int x = 0; x < mWidth; ++x)
+			{
+				(*q)(x, 1, z) = 0.0f;
+				(*q)(x, mHeight - 1, z) = 0.0f;
+			}
+	for (Grid3D<float>* q : { &mW, &mWBuffer })
+		for (int y = 0; y < mHeight; ++y)
+			for (int x = 0; x < mWidth; ++x)
+			{
+				(*q)(x, y, 1) = 0.0f;
+				(*q)(x, y, mDepth - 1) = 0.0f;
+			}
 }
 
-void CFDSimulation::setBoundariesPressure(std::vector<float>& pressure){
+void CFDSimulation::setBoundariesField(Grid3D<float>& q){
 	/*Cells on the boundary can be connected to either 0 or 1 non boundary cells.
 	We can ignore boundary cells of the former kind.
-	For the others, we need to set the boundary cell pressure to equal the connected non-boundary cell's pressure.
+	For the others, we need to set the boundary cell value to equal the connected non-boundary cell's value.
+	Corners are the average of the 3 boundary cells next to them.
 	*/
 
 	//Set left and right boundaries
-	for (int y = 1; y < mHeight - 1; ++y)
-		for (int z = 1; z < mDepth - 1; ++z)
+	for (int z = 1; z < mDepth - 1; ++z)
+		for (int y = 1; y < mHeight - 1; ++y)
 		{
 			//Left boundary
-			pressure[Index(0, y, z)] = pressure[Index(1, y, z)];
+			q(0, y, z) = q(1, y, z);
 			//Right boundary
-			pressure[Index(mWidth - 1, y, z)] = pressure[Index(mWidth - 2, y, z)];
+			q(mWidth - 1, y, z) = q(mWidth - 2, y, z);
 		}
 	//Set top and bottom boundaries
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int z = 1; z < mDepth - 1; ++z)
+	for (int z = 1; z < mDepth - 1; ++z)
+		for (int x = 1; x < mWidth - 1; ++x)
 		{
 			//Bottom boundary
-			pressure[Index(x, 0, z)] = pressure[Index(x, 1, z)];
+			q(x, 0, z) = q(x, 1, z);
 			//Top boundary
-			pressure[Index(x, mHeight - 1, z)] = pressure[Index(x, mHeight - 2, z)];
+			q(x, mHeight - 1, z) = q(x, mHeight - 2, z);
 		}
 	//Front and Back boundaries
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < mHeight - 1; ++y)
+	for (int y = 1; y < mHeight - 1; ++y)
+		for (int x = 1; x < mWidth - 1; ++x)
 		{
 			//Back boundary
-			pressure[Index(x, y, 0)] = pressure[Index(x, y, 1)];
+			q(x, y, 0) = q(x, y, 1);
 			//Front boundary
-			pressure[Index(x, y, mDepth - 1)] = pressure[Index(x, y, mDepth - 2)];
+			q(x, y, mDepth - 1) = q(x, y, mDepth - 2);
 		}
 
-	pressure[Index(0, 0, 0)] = (pressure[Index(1, 0, 0)] + pressure[Index(0, 1, 0)] + pressure[Index(0, 0, 1)]) / 3.0f;
-	pressure[Index(mWidth - 1, 0, 0)] = (pressure[Index(mWidth - 2, 0, 0)] + pressure[Index(mWidth - 1, 1, 0)] + pressure[Index(mWidth - 1, 0, 1)]) / 3.0f;
-	pressure[Index(0, mHeight - 1, 0)] = (pressure[Index(1, mHeight - 1, 0)] + pressure[Index(0, mHeight - 2, 0)] + pressure[Index(0, mHeight - 1, 1)]) / 3.0f;
-	pressure[Index(0, 0, mDepth - 1)] = (pressure[Index(1, 0, mDepth - 1)] + pressure[Index(0, 1, mDepth - 1)] + pressure[Index(0, 0, mDepth - 2)]) / 3.0f;
-	pressure[Index(mWidth - 1, mHeight - 1, 0)] = (pressure[Index(mWidth - 2, mHeight - 1, 0)] + pressure[Index(mWidth - 1, mHeight - 2, 0)] + pressure[Index(mWidth - 1, mHeight - 1, 1)]) / 3.0f;
-	pressure[Index(mWidth - 1, 0, mDepth - 1)] = (pressure[Index(mWidth - 2, 0, mDepth - 1)] + pressure[Index(mWidth - 1, 1, mDepth - 1)] + pressure[Index(mWidth - 1, 0, mWidth - 2)]) / 3.0f;
-	pressure[Index(0, mHeight - 1, mDepth - 1)] = (pressure[Index(1, mHeight - 1, mDepth - 1)] + pressure[Index(0, mHeight - 2, mDepth - 1)] + pressure[Index(0, mHeight - 1, mDepth - 2)]) / 3.0f;
-	pressure[Index(mWidth - 1, mHeight - 1, mDepth - 1)] = (pressure[Index(mWidth - 2, mHeight - 1, mDepth - 1)] + pressure[Index(mWidth - 1, mHeight - 2, mDepth - 1)] + pressure[Index(mWidth - 1, mHeight - 1, mDepth - 2)]) / 3.0f;
+	const int cx[2] = { 0, mWidth - 1 }, cy[2] = { 0, mHeight - 1 }, cz[2] = { 0, mDepth - 1 };
+	for (int i = 0; i < 2; ++i)
+		for (int j = 0; j < 2; ++j)
+			for (int k = 0; k < 2; ++k)
+			{
+				//The neighbor of a corner along an axis is one step towards the inside of the grid
+				const int x = cx[i], y = cy[j], z = cz[k];
+				const int nx = i ? x - 1 : x + 1, ny = j ? y - 1 : y + 1, nz = k ? z - 1 : z + 1;
+				q(x, y, z) = (q(nx, y, z) + q(x, ny, z) + q(x, y, nz)) / 3.0f;
+			}
 }
 
 void CFDSimulation::determineFluidCells() {
-	mFluid.assign(mFluid.size(), false);
-	for (auto &p : mMarkerParticles)
+	PROFILE_ZONE("determineFluidCells");
+	//Fluid cells are always inside active blocks, so only those need clearing when skipping the rest
+	forEachRegion(glm::ivec3(0), glm::ivec3(mWidth, mHeight, mDepth), [&](const glm::ivec3& begin, const glm::ivec3& end){
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x)
+					mFluid(x, y, z) = false;
+	});
+	const float* px = mParticles.x();
+	const float* py = mParticles.y();
+	const float* pz = mParticles.z();
+	for (std::size_t i = 0; i < mParticles.size(); ++i)
+		mFluid(static_cast<int>(px[i]), static_cast<int>(py[i]), static_cast<int>(pz[i])) = true;
+	if (mActiveBlocksOnly)
 	{
-		mFluid[Index(p.x, p.y, p.z)] = true;
-
+		mBlocks.update(px, py, pz, mParticles.size());
+		for (const glm::ivec3& block : mBlocks.deactivated())
+			deactivateBlock(block);
 	}
 }
 
+void CFDSimulation::deactivateBlock(const glm::ivec3& origin){
+	//Stages only write to active blocks, so whatever an inactive block holds in the grids and their buffers stays there.
+	//Velocity and pressure are reset to still air in both, fields keep their latest values in both.
+	//The viscosity search vector is read one face past the regions it is written in, so it is cleared too.
+	auto forEachCell = [&](Grid3D<float>& q, const std::function<void(int, int, int)>& body){
+		for (int z = origin.z; z < std::min(origin.z + BLOCK_SIZE, q.depth()); ++z)
+			for (int y = origin.y; y < std::min(origin.y + BLOCK_SIZE, q.height()); ++y)
+				for (int x = origin.x; x < std::min(origin.x + BLOCK_SIZE, q.width()); ++x)
+					body(x, y, z);
+	};
+	for (Grid3D<float>* q : { &mU, &mV, &mW, &mUBuffer, &mVBuffer, &mWBuffer, &mPressure, &mBuffer, &mSearch })
+		forEachCell(*q, [&](int x, int y, int z){ (*q)(x, y, z) = 0.0f; });
+	for (unsigned int f = 0; f < mFields.size(); ++f)
+		forEachCell(mFields[f], [&](int x, int y, int z){ mFieldBuffers[f](x, y, z) = mFields[f](x, y, z); });
+}
+
+
 void CFDSimulation::applyForces(float dt) {
-	for (int x = 1; x < mWidth - 1; ++x)
-		for (int y = 1; y < mHeight - 1; ++y)
-			for (int z = 1; z < mDepth - 1; ++z)
-				if(mFluid[Index(x, y, z)]) 
-					mVelocity[Index(x, y, z)].y += dt * -9.8f;
+	PROFILE_ZONE("applyForces");
+	//Gravity acts on every vertical face next to a fluid cell, except the ones against the floor and ceiling
+	forEachRegion(glm::ivec3(1, 2, 1), glm::ivec3(mWidth - 1, mHeight - 1, mDepth - 1), [&](const glm::ivec3& begin, const glm::ivec3& end){
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+				for (int x = begin.x; x < end.x; ++x)
+					if (mFluid(x, y - 1, z) || mFluid(x, y, z))
+						mV(x, y, z) += dt * GRAVITY;
+	});
+}
+
+glm::vec3 CFDSimulation::velocityAt(const glm::vec3& position) const{
+	glm::vec3 velocity;
+	velocityAt(&position.x, &position.y, &position.z, 1, &velocity.x, &velocity.y, &velocity.z);
+	return velocity;
+}
+
+void CFDSimulation::velocityAt(const float* x, const float* y, const float* z, int count, float* u, float* v, float* w) const{
+	sampleComponent(0, mU, x, y, z, count, u);
+	sampleComponent(1, mV, x, y, z, count, v);
+	sampleComponent(2, mW, x, y, z, count, w);
+}
+
+void CFDSimulation::sampleComponent(int axis, const Grid3D<float>& q, const float* x, const float* y, const float* z, int count, float* out) const{
+	withBoundaryPolicy(mBoundaryCondition, [&](auto policy){ sampler::sampleVelocity<decltype(policy)>(q, axis, x, y, z, count, out); });
 }
 
+void CFDSimulation::backtrace(float* x, float* y, float* z, int count, float dt) const{
+	//(previous position) = (current position) - velocity * dt
+	float u[SAMPLE_BATCH], v[SAMPLE_BATCH], w[SAMPLE_BATCH];
+	velocityAt(x, y, z, count, u, v, w);
+	for (int i = 0; i < count; ++i)
+	{
+		x[i] -= u[i] * dt;
+		y[i] -= v[i] * dt;
+		z[i] -= w[i] * dt;
+	}
+}
@@ -1,45 +1,237 @@
 #ifndef _CFDSIMULATION_H_
 #define _CFDSIMULATION_H_
 
+#include <future>
+#include <string>
 #include <vector>
 #include <math.h>
 #include <glm/glm.hpp>
+#include "ActiveBlocks.h"
+#include "BoundaryConditions.h"
+#include "Grid3D.h"
+#include "Multigrid.h"
+#include "ParticleStore.h"
+#include "PCGSolver.h"
+#include "ThreadPool.h"
+#include "TrilinearSampler.h"
+#include "TripleBuffer.h"
 
 const int DEFAULT_FLUID_WIDTH = 25;
 const int DEFAULT_FLUID_HEIGHT = 25;
 const int DEFAULT_FLUID_DEPTH = 25;
 const unsigned int DEFAULT_FLUID_VOLUME = DEFAULT_FLUID_WIDTH * DEFAULT_FLUID_HEIGHT * DEFAULT_FLUID_DEPTH;
 
+//Pressure solves that support it stop once the residual is this small relative to the divergence
+const float DEFAULT_PRESSURE_TOLERANCE = 1e-4f;
+//Maximum number of multigrid V-cycles per pressure solve
+const int MAX_MULTIGRID_CYCLES = 20;
+//Maximum number of conjugate gradient iterations per pressure solve
+const int MAX_PCG_ITERATIONS = 200;
+
+//Kinematic viscosity of the fluid in cells squared per second. Water's is too small to matter at these resolutions,
+//so diffusion is skipped unless a viscosity is set.
+const float DEFAULT_VISCOSITY = 0.0f;
+//The viscosity solve stops once the residual is this small relative to the velocity it started from
+const float VISCOSITY_TOLERANCE = 1e-4f;
+//Maximum number of conjugate gradient iterations per velocity component per viscosity solve
+const int MAX_VISCOSITY_ITERATIONS = 100;
+
+//Acceleration due to gravity along y, in cells per second squared
+const float GRAVITY = -9.8f;
+//Substeps are sized so the fastest fluid moves at most this many cells per substep
+const float DEFAULT_CFL_NUMBER = 1.0f;
+//Limits on the size of a substep in seconds. The upper limit keeps calm scenes from taking steps too large
+//for the pressure solve and diffusion, the lower one keeps a blow up from stalling the simulation.
+const float DEFAULT_MIN_TIMESTEP = 1e-4f;
+const float DEFAULT_MAX_TIMESTEP = 1.0f / 120.0f;
+
+//Methods that can be used to solve for pressure in CFDSimulation::project()
+enum class PressureSolver{
+	GAUSS_SEIDEL, //fixed number of red-black relaxation sweeps
+	MULTIGRID, //multigrid V-cycles until the residual drops below the pressure tolerance
+	PCG //preconditioned conjugate gradient over fluid cells only, air cells have 0 pressure
+};
+
+//How velocity is carried along by the fluid
+enum class AdvectionScheme{
+	SEMI_LAGRANGIAN, //velocity lives on the grid, each face traces back through the velocity field
+	FLIP //velocity lives on the marker particles, the grid only applies forces and the pressure projection
+};
+
+//Share of the grid's change in velocity that FLIP particles add to their own velocity, the rest of their velocity
+//is replaced with the grid's (PIC). 1 is pure FLIP, lively but noisy, 0 is pure PIC, smooth but viscous.
+const float DEFAULT_FLIP_RATIO = 0.95f;
+//Layers of faces around the particles that FLIP carries their velocity out into
+const int VELOCITY_EXTRAPOLATION_LAYERS = 2;
+
+//State of the simulation at the end of a call to CFDSimulation::update, for other threads to read while it carries on.
+struct SimulationFrame{
+	//Number of frames published before this one. Readers can compare it to tell whether a frame is new.
+	unsigned long long epoch;
+	//Marker particle positions, interleaved ready to upload as a texture
+	std::vector<glm::vec3> particles;
+	//Copies of the fields added with addScalarField and addVectorField, if enabled with setSnapshotFields
+	std::vector<Grid3D<float>> fields;
+	//Copies of the velocity components and pressure, if enabled with setSnapshotVelocity. Empty grids otherwise.
+	Grid3D<float> u, v, w, pressure;
+
+	SimulationFrame() :epoch(0){}
+};
+
 class CFDSimulation{
-	
+	//Times the stages of a step one at a time, see Benchmark.cpp
+	friend class StageBenchmark;
 
 public:
 	CFDSimulation();
-	CFDSimulation(int width, int height, int depth);
-	void update(float dt);
+	CFDSimulation(int width, int height, int depth, PressureSolver pressureSolver = PressureSolver::GAUSS_SEIDEL,
+		AdvectionScheme advectionScheme = AdvectionScheme::SEMI_LAGRANGIAN);
+	//Fills the cells in [begin, end) with fluid, one marker particle at the center of each, moving with the grid velocity there.
+	//The range is clipped to the interior of the grid.
+	void addFluidBlock(const glm::ivec3& begin, const glm::ivec3& end);
+	//Advances the simulation by frameTime seconds in as many substeps as the fluid's speed requires.
+	//Returns the number of substeps taken.
+	int update(float frameTime);
 	void resize(int width, int height, int depth);
-	const std::vector<glm::vec3>& markerParticles() const { return mMarkerParticles; }
+	//Size of the grid in cells, boundary layer included
+	int width() const { return mWidth; }
+	int height() const { return mHeight; }
+	int depth() const { return mDepth; }
+	void setPressureSolver(PressureSolver pressureSolver) { mPressureSolver = pressureSolver; }
+	void setPressureTolerance(float tolerance) { mPressureTolerance = tolerance; }
+	void setViscosity(float viscosity) { mViscosity = viscosity; }
+	void setBoundaryCondition(BoundaryCondition condition);
+	void setCFLNumber(float cflNumber) { mCFLNumber = cflNumber; }
+	void setTimestepLimits(float minTimestep, float maxTimestep) { mMinTimestep = minTimestep; mMaxTimestep = maxTimestep; }
+	//Every stage of the simulation is split into slabs that run on the given pool. Runs on the calling thread if null.
+	void setThreadPool(ThreadPool* pool);
+	//When enabled, stages only visit the blocks of the grid that contain fluid or are next to a block that does.
+	//Everything further away is still air. This only skips work: every grid is still allocated over the whole domain,
+	//and the multigrid pressure solve still covers all of it (PCG only ever visits fluid).
+	void setActiveBlocksOnly(bool activeBlocksOnly);
+	//Sorts the marker particles by cell every given number of substeps, 0 to never sort. Keeps particles that are
+	//close in space close in memory, and gives per cell particle ranges (see ParticleStore::sortByCell).
+	void setParticleSortInterval(int substeps) { mParticleSortInterval = substeps; }
+	//Switching to FLIP gives every particle the grid's velocity where it is
+	void setAdvectionScheme(AdvectionScheme advectionScheme);
+	void setFlipRatio(float flipRatio) { mFlipRatio = flipRatio; }
+	//Not safe to call while update() is running on another thread, use latestFrame() there instead.
+	const ParticleStore& markerParticles() const { return mParticles; }
+	//Latest frame published by the constructor or update(). Can be called from one other thread while update() runs,
+	//without locking. The frame returned isn't modified until the next call.
+	const SimulationFrame& latestFrame();
+	//Whether published frames include the fields as well as the particles
+	void setSnapshotFields(bool snapshotFields) { mSnapshotFields = snapshotFields; }
+	//Whether published frames include the velocity and pressure
+	void setSnapshotVelocity(bool snapshotVelocity) { mSnapshotVelocity = snapshotVelocity; }
+
+	//Saves the grid size, velocity, pressure, fluid cells, fields and marker particles to path (see Checkpoint.h).
+	//The state is copied before returning and the file is written on a background thread, so the simulation can carry on.
+	//The future becomes true once the file is complete, destroying it waits for the write to finish. It is written under a temporary name and renamed when done,
+	//so a crash while saving leaves the previous checkpoint at path intact.
+	std::future<bool> saveCheckpoint(const std::string& path) const;
+	//Replaces the state with a checkpoint written by saveCheckpoint, resizing the grid and the fields to match.
+	//Settings such as the solver or viscosity are left as they are. Returns false and leaves the state alone
+	//if the file can't be read or isn't a checkpoint of this version.
+	bool loadCheckpoint(const std::string& path);
+
+	//Adds a quantity stored at the center of every cell (density, temperature, dye...) that is carried along by the fluid
+	//and returns its id. Vector quantities take 3 consecutive ids, the one returned is for the x component.
+	//Resizing the simulation resets fields to 0.
+	int addScalarField(float value = 0.0f);
+	int addVectorField(const glm::vec3& value = glm::vec3(0.0f));
+	//Grid of a field. Adding fields can move the grids, so references don't survive adding another field.
+	Grid3D<float>& field(int id) { return mFields[id]; }
+	const Grid3D<float>& field(int id) const { return mFields[id]; }
 private:
-	std::vector<glm::vec3> mVelocity, mVelocityBuffer;
-	std::vector<float> mPressure, mBuffer, mBuffer2;
-	std::vector<glm::vec3> mMarkerParticles;
-	std::vector<bool> mFluid;
+	//Velocity on a staggered (MAC) grid. mU holds the x component on the faces between neighboring cells along x,
+	//so mU(x, y, z) is the velocity between cells x - 1 and x. mV and mW do the same for y and z.
+	Grid3D<float> mU, mV, mW, mUBuffer, mVBuffer, mWBuffer;
+	Grid3D<float> mPressure, mBuffer, mBuffer2;
+	ParticleStore mParticles;
+	//Quantities added with addScalarField and addVectorField, and the buffers they are advected into
+	std::vector<Grid3D<float>> mFields, mFieldBuffers;
+	//Nonzero for cells that contain at least one marker particle
+	Grid3D<unsigned char> mFluid;
+	//Faces given a velocity by the current extrapolation layer. One larger than the grid along every axis,
+	//so it covers the faces of every velocity component.
+	Grid3D<unsigned char> mFaceFlags;
+	//Residual, search vector and the matrix applied to the search vector for the viscosity solve.
+	//Sized like mFaceFlags to fit any velocity component.
+	Grid3D<float> mResidual, mSearch, mProduct;
 	int mWidth, mHeight, mDepth;
+	PressureSolver mPressureSolver;
+	BoundaryCondition mBoundaryCondition;
+	AdvectionScheme mAdvectionScheme;
+	float mFlipRatio;
+	float mPressureTolerance;
+	float mViscosity;
+	float mCFLNumber, mMinTimestep, mMaxTimestep;
+	Multigrid mMultigrid;
+	PCGSolver mPCGSolver;
+	ThreadPool* mPool;
+	ActiveBlocks mBlocks;
+	bool mActiveBlocksOnly;
+	int mParticleSortInterval, mStepsSinceSort;
+	TripleBuffer<SimulationFrame> mFrames;
+	unsigned long long mFrameEpoch;
+	bool mSnapshotFields, mSnapshotVelocity;
 
 	//void resize(int width, int height, int depth);
+	void step(float dt);
+	void publishFrame();
+	float computeTimestep();
 	void updateParticles(float dt);
+	//FLIP transfers. particlesToGrid leaves the velocity it builds in the velocity buffers as well,
+	//gridToParticles blends the change since then (FLIP) with the new velocity itself (PIC).
+	void particlesToGrid();
+	void splatComponent(const float* values, int axis, Grid3D<float>& q, Grid3D<float>& weights);
+	void extrapolateComponent(int axis, Grid3D<float>& q, Grid3D<float>& weights);
+	void gridToParticles(float flipRatio);
 	void advectVelocity(float dt);
-	void diffuseVelocity();
+	void advectComponent(int axis, const Grid3D<float>& q, Grid3D<float>& out, float dt);
+	void diffuseVelocity(float dt);
+	int diffuseComponent(int axis, Grid3D<float>& q, float dt);
+	template <typename Policy>
+	int diffuseComponent(int axis, Grid3D<float>& q, float dt);
 	void project();
-	void setBoundariesVelocity(std::vector<glm::vec3>& velocity);
-	void setBoundariesPressure(std::vector<float>& pressure);
-	void advectQuantity(std::vector<float>& q, float dt);
-	void diffuseQuantity(std::vector<float>& q);
+	//Kernels templated on a boundary condition policy (see BoundaryConditions.h) apply it as they go instead of
+	//reading the boundary layer, so no stage writes the boundary layer of velocity or pressure.
+	template <typename Policy>
+	void relaxPressure(int iterations);
+	template <typename Policy>
+	void subtractPressureGradient();
+	//Whether the walls are solid, so velocity normal to them is 0 on the faces on the walls
+	bool solidWalls() const;
+	//Faces of velocity component axis in q that the stages update: every face inside the boundary layer,
+	//except the ones on solid walls
+	void velocityFaces(int axis, const Grid3D<float>& q, glm::ivec3& begin, glm::ivec3& end) const;
+	//No stage writes the faces on solid walls, which keep velocity 0. This sets them to 0 when the walls become solid
+	//or velocity is loaded, in the velocity grids and their buffers.
+	void clearWallFaces();
+	//Boundary cells of a cell centered field copy the interior cell next to them
+	void setBoundariesField(Grid3D<float>& q);
+	void advectFields(float dt);
 	void determineFluidCells();
 	void applyForces(float dt);
-	inline unsigned int Index(int x, int y, int z){
-		return x + y * mDepth + z * mWidth * mHeight;
-	}
+	void deactivateBlock(const glm::ivec3& origin);
+	//Runs body(begin, end) in parallel over the cells in [begin, end), split into regions. With setActiveBlocksOnly
+	//the regions are the parts of the range inside active blocks, otherwise they are slabs of the whole range.
+	template <typename Body>
+	void forEachRegion(const glm::ivec3& begin, const glm::ivec3& end, const Body& body);
+	//Same as forEachRegion, but adds up the values body returns for each region
+	template <typename Body>
+	double sumOverRegions(const glm::ivec3& begin, const glm::ivec3& end, const Body& body);
+	//Same as forEachRegion, but returns the largest value body returns for a region, or 0 if there are none
+	template <typename Body>
+	float maxOverRegions(const glm::ivec3& begin, const glm::ivec3& end, const Body& body);
+	glm::vec3 velocityAt(const glm::vec3& position) const;
+	//Batched versions of the above. count can be at most SAMPLE_BATCH for backtrace.
+	void velocityAt(const float* x, const float* y, const float* z, int count, float* u, float* v, float* w) const;
+	//Samples velocity component axis held in q at count points (at most SAMPLE_BATCH), with its boundary layer
+	//taken from the boundary condition policy (see sampler::sampleVelocity)
+	void sampleComponent(int axis, const Grid3D<float>& q, const float* x, const float* y, const float* z, int count, float* out) const;
+	void backtrace(float* x, float* y, float* z, int count, float dt) const;
 
 };
 
@@ -0,0 +1,373 @@
+/*
+Checks run by ctest (see CMakeLists.txt). Each one compares a fast path against the code it replaced or the data it
+was made from, and prints what differs. Built by the CMake project as fluidsim_check; run it with the names of the
+checks to run, or with none to run them all. Exits with 1 if any of them fails.
+*/
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "CFDSimulation.h"
+#include "DensitySplatter.h"
+#include "FrameCache.h"
+#include "MarchingCubes.h"
+
+//Simulated time per frame, same as the viewer and the headless runner
+const float FRAME_TIME = 1.0f / 60.0f;
+//Same as the headless mesher
+const float MESH_RADIUS = 1.0f;
+const double MESH_ISOLEVEL = 0.0001;
+//genField works in double and the extractor in float, so their vertices and gradients differ in the last bits
+const float MESH_TOLERANCE = 1e-4f;
+
+//Small deterministic generator, so every run checks the same positions
+class Random{
+public:
+	explicit Random(unsigned int seed) :mState(seed){}
+	//Uniform in [0, 1)
+	float next(){
+		mState = mState * 1664525u + 1013904223u;
+		return (mState >> 8) * (1.0f / 16777216.0f);
+	}
+
+private:
+	unsigned int mState;
+};
+
+//Whether two facets written by Polygonise, (v0, n0, v1) then (n1, v2, n2), are the same within tolerance
+static bool sameFacet(const TRIANGLE* a, const TRIANGLE* b, float tolerance){
+	for (int t = 0; t < 2; ++t)
+		for (int i = 0; i < 3; ++i)
+		{
+			const glm::vec3 difference = glm::abs(a[t].p[i] - b[t].p[i]);
+			if (std::max(difference.x, std::max(difference.y, difference.z)) > tolerance)
+				return false;
+		}
+	return true;
+}
+
+/*
+The surface SurfaceExtractor finds in the density of DensitySplatter has to be the one genField finds by itself.
+The particles are a block like addFluidBlock makes, one at the center of each cell, plus a few loose ones around it,
+all well inside the field so genField's box around the blobs fits in it. The two write the cells in different orders,
+so every facet of one is looked for among those of the other.
+*/
+static bool checkExtractor(){
+	const int size = 16;
+	std::vector<glm::vec3> particles;
+	for (int z = 5; z < 9; ++z)
+		for (int y = 4; y < 7; ++y)
+			for (int x = 5; x < 10; ++x)
+				particles.push_back(glm::vec3(x + 0.5f, y + 0.5f, z + 0.5f));
+	Random random(1);
+	for (int i = 0; i < 24; ++i)
+		particles.push_back(glm::vec3(3.0f + 10.0f * random.next(), 3.0f + 10.0f * random.next(), 3.0f + 10.0f * random.next()));
+
+	std::vector<TRIANGLE> reference;
+	genField(particles, MESH_RADIUS, reference);
+	Grid3D<float> density(size + 1, size + 1, size + 1);
+	DensitySplatter splatter;
+	splatter.splat(particles, MESH_RADIUS * MESH_RADIUS, density);
+	SurfaceExtractor extractor;
+	std::vector<TRIANGLE> triangles;
+	extractor.extract(density, MESH_ISOLEVEL, triangles);
+
+	if (reference.empty() || triangles.size() != reference.size())
+	{
+		std::printf("  %zu facets extracted, genField has %zu\n", triangles.size() / 2, reference.size() / 2);
+		return false;
+	}
+	//Facets are compared in order of their first vertex, and only with those whose first vertex is within the tolerance
+	auto sortFacets = [](std::vector<TRIANGLE>& facets){
+		std::vector<std::size_t> order(facets.size() / 2);
+		for (std::size_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b){ return facets[2 * a].p[0].x < facets[2 * b].p[0].x; });
+		std::vector<TRIANGLE> sorted;
+		sorted.reserve(facets.size());
+		for (std::size_t i : order)
+		{
+			sorted.push_back(facets[2 * i]);
+			sorted.push_back(facets[2 * i + 1]);
+		}
+		facets.swap(sorted);
+	};
+	sortFacets(reference);
+	sortFacets(triangles);
+	const std::size_t facets = reference.size() / 2;
+	std::vector<bool> matched(facets, false);
+	std::size_t first = 0, missing = 0;
+	for (std::size_t i = 0; i < facets; ++i)
+	{
+		const TRIANGLE* facet = &triangles[2 * i];
+		while (first < facets && reference[2 * first].p[0].x < facet[0].p[0].x - MESH_TOLERANCE)
+			++first;
+		bool found = false;
+		for (std::size_t j = first; j < facets && reference[2 * j].p[0].x <= facet[0].p[0].x + MESH_TOLERANCE; ++j)
+			if (!matched[j] && sameFacet(facet, &reference[2 * j], MESH_TOLERANCE))
+			{
+				matched[j] = found = true;
+				break;
+			}
+		if (!found)
+		{
+			if (missing == 0)
+				std::printf("  facet (%g %g %g) (%g %g %g) (%g %g %g) isn't in genField's surface\n",
+					facet[0].p[0].x, facet[0].p[0].y, facet[0].p[0].z, facet[0].p[2].x, facet[0].p[2].y, facet[0].p[2].z,
+					facet[1].p[1].x, facet[1].p[1].y, facet[1].p[1].z);
+			++missing;
+		}
+	}
+	if (missing > 0)
+	{
+		std::printf("  %zu of %zu facets differ\n", missing, facets);
+		return false;
+	}
+	std::printf("  %zu facets match\n", facets);
+	return true;
+}
+
+//Sets up a dam break like the headless runner's, with a dye field so fields are carried along too
+static void addDamBreak(CFDSimulation& sim){
+	sim.addFluidBlock(glm::ivec3(1), glm::ivec3(sim.width() / 2, sim.height() * 3 / 5, sim.depth() - 1));
+	const int dye = sim.addScalarField();
+	Grid3D<float>& field = sim.field(dye);
+	for (int z = 1; z < sim.depth() - 1; ++z)
+		for (int y = 1; y < sim.height() / 2; ++y)
+			for (int x = 1; x < sim.width() / 3; ++x)
+				field(x, y, z) = 1.0f;
+}
+
+//Number of points where two grids differ, or -1 if their sizes differ
+static long long gridDifferences(const Grid3D<float>& a, const Grid3D<float>& b){
+	if (a.width() != b.width() || a.height() != b.height() || a.depth() != b.depth())
+		return -1;
+	long long differences = 0;
+	for (int z = 0; z < a.depth(); ++z)
+		for (int y = 0; y < a.height(); ++y)
+			for (int x = 0; x < a.width(); ++x)
+				differences += a(x, y, z) != b(x, y, z);
+	return differences;
+}
+
+//Prints and returns false if the grids differ
+static bool sameGrid(const char* name, const Grid3D<float>& a, const Grid3D<float>& b){
+	const long long differences = gridDifferences(a, b);
+	if (differences < 0)
+		std::printf("  %s is %dx%dx%d instead of %dx%dx%d\n", name, b.width(), b.height(), b.depth(), a.width(), a.height(), a.depth());
+	else if (differences > 0)
+		std::printf("  %s differs at %lld points\n", name, differences);
+	return differences == 0;
+}
+
+//Compares everything a frame holds, exactly
+static bool sameFrame(const SimulationFrame& a, const SimulationFrame& b){
+	bool same = a.particles.size() == b.particles.size()
+		&& std::equal(a.particles.begin(), a.particles.end(), b.particles.begin());
+	if (!same)
+		std::printf("  particles differ\n");
+	same = sameGrid("u", a.u, b.u) && same;
+	same = sameGrid("v", a.v, b.v) && same;
+	same = sameGrid("w", a.w, b.w) && same;
+	same = sameGrid("pressure", a.pressure, b.pressure) && same;
+	if (a.fields.size() != b.fields.size())
+	{
+		std::printf("  %zu fields instead of %zu\n", b.fields.size(), a.fields.size());
+		return false;
+	}
+	for (std::size_t i = 0; i < a.fields.size(); ++i)
+		same = sameGrid("field", a.fields[i], b.fields[i]) && same;
+	return same;
+}
+
+/*
+A simulation restarted from a checkpoint has to carry on exactly like the one that saved it. FLIP is used so the
+particle velocities matter too. The checkpoint is loaded into a simulation of another size, then both run a frame
+and publish everything they have.
+*/
+static bool checkCheckpoint(){
+	const char* path = "fluidsim_check.ckp";
+	CFDSimulation original(20, 16, 12, PressureSolver::PCG, AdvectionScheme::FLIP);
+	addDamBreak(original);
+	for (int frame = 0; frame < 10; ++frame)
+		original.update(FRAME_TIME);
+	if (!original.saveCheckpoint(path).get())
+	{
+		std::printf("  could not write %s\n", path);
+		return false;
+	}
+	CFDSimulation restarted(8, 8, 8, PressureSolver::PCG, AdvectionScheme::FLIP);
+	const bool loaded = restarted.loadCheckpoint(path);
+	std::remove(path);
+	if (!loaded)
+	{
+		std::printf("  could not load %s\n", path);
+		return false;
+	}
+	if (restarted.width() != original.width() || restarted.height() != original.height() || restarted.depth() != original.depth())
+	{
+		std::printf("  restarted as %dx%dx%d\n", restarted.width(), restarted.height(), restarted.depth());
+		return false;
+	}
+
+	const ParticleStore& a = original.markerParticles();
+	const ParticleStore& b = restarted.markerParticles();
+	bool same = a.size() == b.size();
+	for (std::size_t i = 0; same && i < a.size(); ++i)
+		same = a.position(i) == b.position(i) && a.velocity(i) == b.velocity(i);
+	if (!same)
+		std::printf("  particles differ after loading\n");
+
+	for (CFDSimulation* sim : { &original, &restarted })
+	{
+		sim->setSnapshotFields(true);
+		sim->setSnapshotVelocity(true);
+		sim->update(FRAME_TIME);
+	}
+	if (!sameFrame(original.latestFrame(), restarted.latestFrame()))
+	{
+		std::printf("  the frame after the restart differs\n");
+		return false;
+	}
+	std::printf("  %zu particles restarted\n", a.size());
+	return same;
+}
+
+/*
+Frames read back from a cache have to be the ones written: particles within half a quantization step of where they
+were, velocity and pressure exactly. The keyframe interval is short, so the frames are a mix of keyframes and
+differences, and they are read forwards then backwards so most reads start over from a keyframe.
+*/
+static bool checkFrameCache(){
+	const char* path = "fluidsim_check.fcache";
+	const int width = 20, height = 16, depth = 12;
+	const int frames = 10;
+	CFDSimulation sim(width, height, depth, PressureSolver::PCG);
+	sim.setSnapshotVelocity(true);
+	FrameCacheWriter writer;
+	if (!writer.open(path, width, height, depth, framecache::CACHE_VELOCITY | framecache::CACHE_PRESSURE, 4))
+	{
+		std::printf("  could not create %s\n", path);
+		return false;
+	}
+	std::vector<SimulationFrame> written;
+	addDamBreak(sim);
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		sim.update(FRAME_TIME);
+		written.push_back(sim.latestFrame());
+		writer.append(written.back());
+	}
+	if (!writer.close())
+	{
+		std::printf("  could not write %s\n", path);
+		std::remove(path);
+		return false;
+	}
+
+	FrameCacheReader reader;
+	if (!reader.open(path) || reader.frameCount() != frames)
+	{
+		std::printf("  could not read back %d frames from %s\n", frames, path);
+		std::remove(path);
+		return false;
+	}
+	const float dimensions[] = { static_cast<float>(width), static_cast<float>(height), static_cast<float>(depth) };
+	//Half a step, plus a few float roundings of coordinates the size of the grid from scaling to steps and back
+	float tolerance[3];
+	for (int axis = 0; axis < 3; ++axis)
+		tolerance[axis] = 0.5f * dimensions[axis] / framecache::POSITION_STEPS + 4.0f * dimensions[axis] * FLT_EPSILON;
+	std::vector<int> order;
+	for (int frame = 0; frame < frames; ++frame)
+		order.push_back(frame);
+	for (int frame = frames - 1; frame >= 0; --frame)
+		order.push_back(frame);
+	bool same = true;
+	SimulationFrame frame;
+	for (int index : order)
+	{
+		if (!reader.readFrame(index, frame))
+		{
+			std::printf("  could not decode frame %d\n", index);
+			same = false;
+			continue;
+		}
+		const SimulationFrame& expected = written[index];
+		if (frame.particles.size() != expected.particles.size())
+		{
+			std::printf("  frame %d has %zu particles instead of %zu\n", index, frame.particles.size(), expected.particles.size());
+			same = false;
+			continue;
+		}
+		float largest[3] = { 0.0f, 0.0f, 0.0f };
+		for (std::size_t i = 0; i < frame.particles.size(); ++i)
+			for (int axis = 0; axis < 3; ++axis)
+				largest[axis] = std::max(largest[axis], std::abs(frame.particles[i][axis] - expected.particles[i][axis]));
+		for (int axis = 0; axis < 3; ++axis)
+			if (largest[axis] > tolerance[axis])
+			{
+				std::printf("  frame %d has a particle %g away along axis %d, more than %g\n", index, largest[axis], axis, tolerance[axis]);
+				same = false;
+			}
+		const bool sameGrids = sameGrid("u", expected.u, frame.u) & sameGrid("v", expected.v, frame.v)
+			& sameGrid("w", expected.w, frame.w) & sameGrid("pressure", expected.pressure, frame.pressure);
+		if (!sameGrids)
+		{
+			std::printf("  in frame %d\n", index);
+			same = false;
+		}
+	}
+	reader.close();
+	std::remove(path);
+	if (same)
+		std::printf("  %d frames of %zu particles decoded %zu times\n", frames, written.back().particles.size(), order.size());
+	return same;
+}
+
+struct Check{
+	const char* name;
+	bool (*run)();
+};
+
+const Check CHECKS[] = {
+	{ "checkpoint", checkCheckpoint },
+	{ "framecache", checkFrameCache },
+	{ "extractor", checkExtractor }
+};
+
+int main(int argc, char** argv){
+	std::vector<const Check*> selected;
+	for (int i = 1; i < argc; ++i)
+	{
+		const Check* check = nullptr;
+		for (const Check& c : CHECKS)
+			if (std::strcmp(c.name, argv[i]) == 0)
+				check = &c;
+		if (!check)
+		{
+			std::printf("usage: %s [check...]\nchecks:", argv[0]);
+			for (const Check& c : CHECKS)
+				std::printf(" %s", c.name);
+			std::printf("\n");
+			return 1;
+		}
+		selected.push_back(check);
+	}
+	if (selected.empty())
+		for (const Check& c : CHECKS)
+			selected.push_back(&c);
+
+	int failed = 0;
+	for (const Check* check : selected)
+	{
+		std::printf("%s\n", check->name);
+		const bool passed = check->run();
+		std::printf("%s %s\n", check->name, passed ? "passed" : "FAILED");
+		failed += passed ? 0 : 1;
+	}
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+File format of CFDSimulation::saveCheckpoint. A header followed by sections of raw little endian data, each starting
+on a multiple of SECTION_ALIGNMENT bytes so they can be read in place from a mapped file:
+	velocity u, v and w, pressure (float), fluid flags (unsigned char) - every cell of the grid, boundary layer included,
+		x first, then y, then z, without the padding or layout of the grid in memory
+	particle x, y, z, u, v, w (float) - particleCount values each
+	fields (float) - fieldCount grids the size of the pressure, in the order of their ids
+Files written by another version are rejected, bump VERSION whenever the format changes.
+*/
+namespace checkpoint{
+
+	const char MAGIC[8] = { 'F', 'L', 'U', 'I', 'D', 'C', 'K', 'P' };
+	const std::uint32_t VERSION = 1;
+	const std::size_t SECTION_ALIGNMENT = 64;
+	//Number of particle arrays, positions then velocities
+	const int PARTICLE_ARRAYS = 6;
+
+	struct Header{
+		char magic[8];
+		std::uint32_t version;
+		std::int32_t width, height, depth;
+		std::uint32_t fieldCount;
+		std::uint32_t reserved;
+		std::uint64_t particleCount;
+	};
+
+	//Byte offsets of each section from the start of the file
+	struct Sections{
+		std::size_t u, v, w, pressure, fluid;
+		std::size_t particles[PARTICLE_ARRAYS];
+		//Offset of the first field, fields are fieldStride bytes apart
+		std::size_t fields, fieldStride;
+		//Size of the whole file
+		std::size_t end;
+	};
+
+	inline std::size_t alignSection(std::size_t offset){
+		return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+	}
+
+	inline Sections sections(const Header& header){
+		const std::size_t width = header.width, height = header.height, depth = header.depth;
+		const std::size_t cells = width * height * depth;
+		Sections s;
+		s.u = alignSection(sizeof(Header));
+		s.v = alignSection(s.u + (width + 1) * height * depth * sizeof(float));
+		s.w = alignSection(s.v + width * (height + 1) * depth * sizeof(float));
+		s.pressure = alignSection(s.w + width * height * (depth + 1) * sizeof(float));
+		s.fluid = alignSection(s.pressure + cells * sizeof(float));
+		std::size_t offset = alignSection(s.fluid + cells * sizeof(unsigned char));
+		for (int i = 0; i < PARTICLE_ARRAYS; ++i)
+		{
+			s.particles[i] = offset;
+			offset = alignSection(offset + header.particleCount * sizeof(float));
+		}
+		s.fields = offset;
+		s.fieldStride = alignSection(cells * sizeof(float));
+		s.end = s.fields + s.fieldStride * header.fieldCount;
+		return s;
+	}
+}
+
+#endif
@@ -0,0 +1,210 @@
+#include "DensitySplatter.h"
+#include <algorithm>
+#include <cmath>
+#include "Profiler.h"
+#include "ThreadPool.h"
+#include "TrilinearSampler.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SPLATTER_X86
+#include <immintrin.h>
+#endif
+
+//GCC and Clang only emit AVX instructions in functions that ask for them. MSVC emits them anywhere.
+#if defined(SPLATTER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+namespace{
+
+	//Points of a row the kernels work on at once, one AVX2 register of floats
+	const int SPLAT_LANES = 8;
+
+	//Everything a kernel needs to fill one row of points
+	struct Row{
+		const float *x, *y, *z;
+		//Start of bin (0, by, bz) for each bin row within the radius of the points, the bins of a row are consecutive
+		const int* const* binRows;
+		int binRowCount;
+		//Bins along x, and points in the row
+		int width;
+		//Position of the row's points along y and z
+		float y0, z0;
+		float radius, radiusSquared;
+	};
+
+	//Range of bins along x holding the particles within the radius of points first to last
+	inline void binRange(const Row& row, int first, int last, int& begin, int& end){
+		begin = std::max(static_cast<int>(std::floor(first - row.radius)), 0);
+		end = std::min(static_cast<int>(std::floor(last + row.radius)), row.width - 1) + 1;
+	}
+
+	void splatRowScalar(const Row& row, float* out){
+		for (int first = 0; first < row.width; first += SPLAT_LANES)
+		{
+			float sum[SPLAT_LANES] = {};
+			int begin, end;
+			binRange(row, first, first + SPLAT_LANES - 1, begin, end);
+			for (int r = 0; r < row.binRowCount && begin < end; ++r)
+				for (int p = row.binRows[r][begin]; p < row.binRows[r][end]; ++p)
+				{
+					const float dy = row.y0 - row.y[p], dz = row.z0 - row.z[p];
+					const float dy2 = dy * dy, dz2 = dz * dz;
+					//Every point of the row is further away than this
+					if (dy2 + dz2 > row.radiusSquared)
+						continue;
+					for (int lane = 0; lane < SPLAT_LANES; ++lane)
+					{
+						const float dx = static_cast<float>(first + lane) - row.x[p];
+						const float distanceSquared = dx * dx + dy2 + dz2;
+						const float w = 1.0f - distanceSquared;
+						if (distanceSquared <= row.radiusSquared)
+							sum[lane] += w * w;
+					}
+				}
+			std::copy(sum, sum + SPLAT_LANES, out + first);
+		}
+	}
+
+#ifdef SPLATTER_X86
+	TARGET_AVX2 void splatRowAVX2(const Row& row, float* out){
+		const __m256 lanes = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 radiusSquared = _mm256_set1_ps(row.radiusSquared);
+		for (int first = 0; first < row.width; first += SPLAT_LANES)
+		{
+			const __m256 points = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(first)), lanes);
+			__m256 sum = _mm256_setzero_ps();
+			int begin, end;
+			binRange(row, first, first + SPLAT_LANES - 1, begin, end);
+			for (int r = 0; r < row.binRowCount && begin < end; ++r)
+				for (int p = row.binRows[r][begin]; p < row.binRows[r][end]; ++p)
+				{
+					const float dy = row.y0 - row.y[p], dz = row.z0 - row.z[p];
+					const float dy2 = dy * dy, dz2 = dz * dz;
+					if (dy2 + dz2 > row.radiusSquared)
+						continue;
+					//Same operations in the same order as the scalar kernel. Points outside the radius add 0.
+					const __m256 dx = _mm256_sub_ps(points, _mm256_set1_ps(row.x[p]));
+					const __m256 distanceSquared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_set1_ps(dy2)), _mm256_set1_ps(dz2));
+					const __m256 w = _mm256_sub_ps(one, distanceSquared);
+					const __m256 inside = _mm256_cmp_ps(distanceSquared, radiusSquared, _CMP_LE_OQ);
+					sum = _mm256_add_ps(sum, _mm256_and_ps(inside, _mm256_mul_ps(w, w)));
+				}
+			_mm256_storeu_ps(out + first, sum);
+		}
+	}
+#endif
+}
+
+DensitySplatter::DensitySplatter() :mPool(nullptr){}
+
+void DensitySplatter::setThreadPool(ThreadPool* pool){
+	mPool = pool;
+}
+
+void DensitySplatter::splat(const float* x, const float* y, const float* z, std::size_t count, float radiusSquared, Grid3D<float>& field){
+	PROFILE_ZONE("splatDensity");
+	bin(count, [&](std::size_t i){ return glm::vec3(x[i], y[i], z[i]); }, field.width(), field.height(), field.depth());
+	splatBinned(radiusSquared, field);
+}
+
+void DensitySplatter::splat(const std::vector<glm::vec3>& particles, float radiusSquared, Grid3D<float>& field){
+	PROFILE_ZONE("splatDensity");
+	bin(particles.size(), [&](std::size_t i){ return particles[i]; }, field.width(), field.height(), field.depth());
+	splatBinned(radiusSquared, field);
+}
+
+template <typename Position>
+void DensitySplatter::bin(std::size_t count, const Position& position, int width, int height, int depth){
+	const int bins = width * height * depth;
+	mBinStart.assign(bins + 1, 0);
+	mBin.resize(count);
+	mX.resize(count);
+	mY.resize(count);
+	mZ.resize(count);
+	if (bins == 0)
+		return;
+	//Particles outside the field go to the bin at its edge, which is searched for every point they can reach
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		const glm::vec3 p = position(i);
+		const int x = static_cast<int>(std::min(std::max(p.x, 0.0f), width - 1.0f));
+		const int y = static_cast<int>(std::min(std::max(p.y, 0.0f), height - 1.0f));
+		const int z = static_cast<int>(std::min(std::max(p.z, 0.0f), depth - 1.0f));
+		mBin[i] = x + width * (y + height * z);
+		++mBinStart[mBin[i]];
+	}
+	//Ends of the bins, which placing the particles from last to first moves back to the starts.
+	//Particles in the same bin keep their order.
+	for (int b = 1; b < bins; ++b)
+		mBinStart[b] += mBinStart[b - 1];
+	mBinStart[bins] = static_cast<int>(count);
+	for (std::size_t i = count; i-- > 0;)
+	{
+		const glm::vec3 p = position(i);
+		const int destination = --mBinStart[mBin[i]];
+		mX[destination] = p.x;
+		mY[destination] = p.y;
+		mZ[destination] = p.z;
+	}
+}
+
+void DensitySplatter::splatBinned(float radiusSquared, Grid3D<float>& field){
+	const int width = field.width(), height = field.height(), depth = field.depth();
+	if (width == 0 || height == 0 || depth == 0)
+		return;
+	const float radius = std::sqrt(std::max(radiusSquared, 0.0f));
+	const bool simd = sampler::kernel() != sampler::Kernel::SCALAR;
+	util::parallelFor(mPool, 0, depth, [&](int begin, int end){
+		//Whole vectors are written, so the row is padded up to the next one
+		std::vector<float> out((width + SPLAT_LANES - 1) / SPLAT_LANES * SPLAT_LANES);
+		std::vector<const int*> binRows;
+		Row row;
+		row.x = mX.data();
+		row.y = mY.data();
+		row.z = mZ.data();
+		row.width = width;
+		row.radius = radius;
+		row.radiusSquared = radiusSquared;
+		for (int z = begin; z < end; ++z)
+		{
+			const int zBegin = std::max(static_cast<int>(std::floor(z - radius)), 0);
+			const int zEnd = std::min(static_cast<int>(std::floor(z + radius)), depth - 1);
+			for (int y = 0; y < height; ++y)
+			{
+				const int yBegin = std::max(static_cast<int>(std::floor(y - radius)), 0);
+				const int yEnd = std::min(static_cast<int>(std::floor(y + radius)), height - 1);
+				//Only bin rows holding particles are looked at, rows of points without any are left at 0
+				binRows.clear();
+				for (int bz = zBegin; bz <= zEnd; ++bz)
+					for (int by = yBegin; by <= yEnd; ++by)
+					{
+						const int* binRow = mBinStart.data() + width * (by + height * bz);
+						if (binRow[0] != binRow[width])
+							binRows.push_back(binRow);
+					}
+				if (binRows.empty())
+				{
+					for (int x = 0; x < width; ++x)
+						field(x, y, z) = 0.0f;
+					continue;
+				}
+				row.binRows = binRows.data();
+				row.binRowCount = static_cast<int>(binRows.size());
+				row.y0 = static_cast<float>(y);
+				row.z0 = static_cast<float>(z);
+#ifdef SPLATTER_X86
+				if (simd)
+					splatRowAVX2(row, out.data());
+				else
+#endif
+					splatRowScalar(row, out.data());
+				for (int x = 0; x < width; ++x)
+					field(x, y, z) = out[x];
+			}
+		}
+	});
+}
@@ -0,0 +1,52 @@
+#ifndef _DENSITYSPLATTER_H_
+#define _DENSITYSPLATTER_H_
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+#include "Grid3D.h"
+
+class ThreadPool;
+
+/*
+CPU version of the viewer's density pass (shaders/density.glslf). Every point of the field gets
+	sum of (1 - d^2)^2 over the particles at squared distance d^2 <= radiusSquared from it
+with field point (x, y, z) sitting at (x, y, z) in simulation coordinates, so a simulation of size W x H x D
+fills a field of (W + 1) x (H + 1) x (D + 1) points like the viewer's texture.
+
+The shader adds up every particle for every point. Here particles are first sorted into bins, one per cell of the
+field, and each row of points only looks at the bins within the radius of it, so the cost grows with the number of
+particles rather than points times particles. Layers of the field are split over the thread pool, every point is
+written by the thread that owns its layer. Points of a row are done 8 at a time by an AVX2 kernel whenever the sampler
+uses a SIMD kernel (see sampler::kernel), which gives the same results as the scalar one.
+Particles are added in bin order rather than the shader's, so sums can differ from the shader's in the last bits.
+*/
+class DensitySplatter{
+public:
+	DensitySplatter();
+
+	//Splits the work over pool, or runs it all on the calling thread if it is null
+	void setThreadPool(ThreadPool* pool);
+
+	/*
+	Sets every point of field, which keeps its size, to the density of count particles at (x[i], y[i], z[i]).
+	Particles outside the field still count for the points within the radius of them.
+	*/
+	void splat(const float* x, const float* y, const float* z, std::size_t count, float radiusSquared, Grid3D<float>& field);
+	//Same for interleaved positions, e.g. SimulationFrame::particles
+	void splat(const std::vector<glm::vec3>& particles, float radiusSquared, Grid3D<float>& field);
+
+private:
+	ThreadPool* mPool;
+	//Positions sorted by bin, bins in the order of a linear layout of the field
+	std::vector<float> mX, mY, mZ;
+	//Particles in bin b are mBinStart[b] up to mBinStart[b + 1]
+	std::vector<int> mBinStart;
+	std::vector<int> mBin;
+
+	template <typename Position>
+	void bin(std::size_t count, const Position& position, int width, int height, int depth);
+	void splatBinned(float radiusSquared, Grid3D<float>& field);
+};
+
+#endif
@@ -3,22 +3,30 @@
 #include "OpenGLException.h"
 #include "Utility.h"
 #include "LUTs.h"
+#include "Profiler.h"
 #include <GL/GLU.h>
 #include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <ostream>
 #include <iterator>
-#include <thread>
 
 
 //Constants for default window width and height
 const int DEFAULT_WINDOW_WIDTH = 640;
 const int DEFAULT_WINDOW_HEIGHT = 480;
 
-//timestep
-const float TIMESTEP = 0.0025f;
+//Simulated time per rendered frame. The simulation splits it into as many substeps as it needs.
+const float FRAME_TIME = 1.0f / 60.0f;
+
+//Marker particles are sorted by cell every this many substeps to keep them cache friendly
+const int PARTICLE_SORT_INTERVAL = 16;
+
+//Most particles the particle texture holds
+const int PARTICLE_TEXTURE_WIDTH = 10000;
 
 //constants for fluid simulation dimensions
 const int SIM_WIDTH = 25;
@@ -44,6 +52,9 @@ const char* GEN_VERTICES_GEOMETRY_SHADER_PATH = "shaders/gen_vertices.glslg";
 const char* TEXTURE_PATH = "floor_diamond_tileIII.png";
 const char* TEXTURE_WALL_PATH = "stone wall 3.png";
 
+//Where the zones recorded while the viewer ran are written on exit, when built with FLUIDSIM_PROFILE
+const char* TRACE_PATH = "fluidsim_trace.json";
+
 
 
 const GLfloat STATIC_VERTICES[] = {
@@ -84,9 +95,14 @@ const glm::vec3 CAMERA_POS(10.0f, 15.0f, -30.0f);
 FluidSim::FluidSim(){
 	mWidth = DEFAULT_WINDOW_WIDTH;
 	mHeight = DEFAULT_WINDOW_HEIGHT;
+	mFieldEpoch = 0;
 }
 
 FluidSim::~FluidSim(){
+	//Let any step still in flight finish before tearing down
+	if (mSimStep.valid())
+		mSimStep.wait();
+
 	//delete context and window
 	SDL_GL_DeleteContext(mContext);
 	SDL_DestroyWindow(mWindow);
@@ -151,9 +167,11 @@ void FluidSim::init(){
 	SDL_EventState(SDL_MOUSEMOTION, SDL_IGNORE);
 
 	//Perform steps necessary to populate the VBO used to hold fluid vertices so we can render the fluid.
+	mSim.setThreadPool(&mPool);
+	mSim.setParticleSortInterval(PARTICLE_SORT_INTERVAL);
 	genScalarField();
-	mThreadSimRunning = true;
-	mThreadSim = std::thread(&CFDSimulation::update, &mSim, TIMESTEP);
+	if (!mReplay.isOpen())
+		startSimStep();
 	GLuint nPrimitives = genTriangleList();
 	nVertices = genVertices(nPrimitives);
 	mAutoRun = false;
@@ -296,7 +314,7 @@ void FluidSim::initGLTextures(){
 
 	//Initialize texture to store particle positions
 	glBindTexture(GL_TEXTURE_2D, mTextures[Textures::PARTICLES]);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F_ARB, 10000, 1, 0, GL_RGB, GL_FLOAT, nullptr);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F_ARB, PARTICLE_TEXTURE_WIDTH, 1, 0, GL_RGB, GL_FLOAT, nullptr);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
@@ -325,6 +343,7 @@ void FluidSim::getAllUniformLocations(){
 }
 
 void FluidSim::render(){
+	PROFILE_ZONE("render");
 
 	//Generate MVP matrix for the room.
 	glm::mat4 translation = glm::translate(glm::mat4(), glm::vec3(0.0f, 0.0f, 0.0f));
@@ -397,6 +416,7 @@ void FluidSim::render(){
 }
 
 void FluidSim::genScalarField(){
+	PROFILE_ZONE("genScalarField");
 	//Render to framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, mFrameBuffer);
 	glViewport(0, 0, SIM_WIDTH + 1, SIM_HEIGHT + 1);
@@ -410,9 +430,14 @@ void FluidSim::genScalarField(){
 	//set uniforms
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, mTextures[Textures::PARTICLES]);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mSim.markerParticles().size(), 1, GL_RGB, GL_FLOAT, &mSim.markerParticles()[0]);
+	//The latest frame is safe to read while the simulation works on the next one
+	const SimulationFrame& frame = latestFrame();
+	mFieldEpoch = frame.epoch;
+	//Recordings can hold more particles than the texture, the rest are left out
+	const GLsizei particleCount = std::min<GLsizei>(frame.particles.size(), PARTICLE_TEXTURE_WIDTH);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, particleCount, 1, GL_RGB, GL_FLOAT, frame.particles.data());
 	glUniform1i(mUniforms[Uniforms::SFIELD_PARTICLES], 0);
-	glUniform1i(mUniforms[Uniforms::SFIELD_NUM_PARTICLES], mSim.markerParticles().size());
+	glUniform1i(mUniforms[Uniforms::SFIELD_NUM_PARTICLES], particleCount);
 	glUniform1f(mUniforms[Uniforms::SFIELD_RADIUS_SQUARED], 1.0f);
 
 	//draw
@@ -424,7 +449,29 @@ void FluidSim::genScalarField(){
 
 }
 
+const SimulationFrame& FluidSim::latestFrame(){
+	return mReplay.isOpen() ? mReplay.latestFrame() : mSim.latestFrame();
+}
+
+bool FluidSim::openReplay(const std::string& path){
+	if (!mReplay.open(path))
+		return false;
+	//The GPU mesher's textures are sized for the simulation grid
+	if (mReplay.width() != SIM_WIDTH || mReplay.height() != SIM_HEIGHT || mReplay.depth() != SIM_DEPTH)
+	{
+		mReplay.close();
+		return false;
+	}
+	mReplay.setLoop(true);
+	return true;
+}
+
+void FluidSim::startSimStep(){
+	mSimStep = mPool.submit([this](){ mSim.update(FRAME_TIME); });
+}
+
 GLuint FluidSim::genTriangleList(){
+	PROFILE_ZONE("genTriangleList");
 	//disable rasterizer
 	glEnable(GL_RASTERIZER_DISCARD);
 
@@ -468,6 +515,7 @@ GLuint FluidSim::genTriangleList(){
 }
 
 GLuint FluidSim::genVertices(GLuint in_nPrimitives){
+	PROFILE_ZONE("genVertices");
 	//disable rasterizer
 	glEnable(GL_RASTERIZER_DISCARD);
 
@@ -533,21 +581,36 @@ void FluidSim::handleKeyDownEvent(SDL_Keycode key){
 		}
 		break;
 	case SDLK_n:   //update simulation
-		if(!mAutoRun && !mThreadSimRunning){
-			mThreadSimRunning = true;
-			mThreadSim = std::thread(&CFDSimulation::update, &mSim, TIMESTEP);
-			GLuint nPrimitives = genTriangleList();
-			nVertices = genVertices(nPrimitives);
-		}
+		//The main loop meshes the frame once the step publishes it
+		if (mReplay.isOpen())
+			mReplay.seek(mReplay.currentFrame() + 1);
+		else if(!mAutoRun && !mSimStep.valid())
+			startSimStep();
+		break;
+	case SDLK_b: //previous frame of a replay
+		if (mReplay.isOpen())
+			mReplay.seek(mReplay.currentFrame() - 1);
+		break;
+	case SDLK_r: //back to the start of a replay
+		if (mReplay.isOpen())
+			mReplay.seek(0);
+		break;
+	case SDLK_l: //toggle looping of a replay
+		mReplay.setLoop(!mReplay.loop());
 		break;
 	case SDLK_m:
 		mAutoRun = !mAutoRun;
+		if (mReplay.isOpen())
+		{
+			if (mAutoRun)
+				mReplay.play();
+			else
+				mReplay.pause();
+		}
 		if (!mAutoRun) std::cout << counter << std::endl;
 	
 	case SDLK_q:
-		glBindTexture(GL_TEXTURE_2D, mTextures[Textures::PARTICLES]);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mSim.markerParticles().size(), 1, GL_RGB, GL_FLOAT, &mSim.markerParticles()[0]);
-
+		//genScalarField uploads the particles
 		genScalarField();
 		SDL_GL_SwapWindow(mWindow);
 		break;
@@ -602,6 +665,7 @@ void FluidSim::runSim(){
 	//While application is running
 	while (!quit)
 	{
+		PROFILE_ZONE("frame");
 		//Handle events on queue
 		while (SDL_PollEvent(&e) != 0)
 		{
@@ -628,23 +692,36 @@ void FluidSim::runSim(){
 		//Render
 		render();
 		//Swap buffers
-		SDL_GL_SwapWindow(mWindow);
-		if (mAutoRun && !mThreadSimRunning) {
-			mThreadSimRunning = true;
-			mThreadSim = std::thread(&CFDSimulation::update, &mSim, TIMESTEP);
-			GLuint nPrimitives = genTriangleList();
-			nVertices = genVertices(nPrimitives);
+		{
+			PROFILE_ZONE("swapWindow");
+			SDL_GL_SwapWindow(mWindow);
 		}
-		//Check if our simulation has finished updating. Join the thread if it is. 
-		if (mThreadSim.joinable()){
-
-			mThreadSim.join();
+		//Collect a finished step without waiting for one still running
+		if (mSimStep.valid() && mSimStep.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		{
+			mSimStep.get();
 			counter++;
-			mThreadSimRunning = false;
+		}
+		if (mReplay.isOpen())
+			mReplay.update();
+		else if (mAutoRun && !mSimStep.valid())
+			startSimStep();
+		//Mesh the latest frame the simulation published while it works on the next one
+		if (latestFrame().epoch != mFieldEpoch)
+		{
 			genScalarField();
-
+			GLuint nPrimitives = genTriangleList();
+			nVertices = genVertices(nPrimitives);
 		}
 	}
+	if (profiler::ENABLED)
+	{
+		//The step in flight records zones too, it has to finish before they are written
+		if (mSimStep.valid())
+			mSimStep.wait();
+		if (!profiler::writeChromeTrace(TRACE_PATH))
+			std::cerr << "Could not write " << TRACE_PATH << std::endl;
+	}
 }
 
 
@@ -11,9 +11,11 @@
 #include <glm/gtc/quaternion.hpp>
 #include <vector>
 #include <array>
-#include <thread>
+#include <future>
 #include "MarchingCubes.h"
 #include "CFDSimulation.h"
+#include "FrameReplay.h"
+#include "ThreadPool.h"
 
 //Number of VBOs we need. Other constants are in the source file.
 
@@ -25,6 +27,9 @@ public:
 
 	//initializes and runs the main loop of the simulation. Returns once it is finished.
 	void runSim();
+	//Shows a recorded frame cache instead of running the simulation. Call before runSim.
+	//Returns false if the cache can't be opened or wasn't recorded at the size the viewer meshes.
+	bool openReplay(const std::string& path);
 private:
 
 	//The following enums act as array indices for the std::arrays containing the buffer objects, programs, uniforms,
@@ -101,6 +106,13 @@ private:
 	//Main render loop
 	void render();
 
+	//Queues the next simulation step on the thread pool
+	void startSimStep();
+
+	//Latest frame of the replay if one is open, of the simulation otherwise
+	const SimulationFrame& latestFrame();
+
+	//Builds the scalar field from the latest frame the simulation published
 	void genScalarField();
 	GLuint genTriangleList();
 	GLuint genVertices(GLuint in_nPrimitives);
@@ -177,16 +189,21 @@ private:
 	//number of triangles in fluid vbo
 	GLuint nVertices;
 
+	//Worker threads shared by everything that runs in parallel. Declared before the simulation so it outlives it.
+	ThreadPool mPool;
+
 	//Simulation
 	CFDSimulation mSim;
+	//Recording shown instead of the simulation, if open
+	FrameReplay mReplay;
 
 	//Width and Height of window
 	int mWidth, mHeight;
 
-	std::thread mThreadSim;
-
-	//true if the above thread is currently running.
-	bool mThreadSimRunning;
+	//Simulation step running on the thread pool. Valid while a step is in flight.
+	std::future<void> mSimStep;
+	//Epoch of the simulation frame the scalar field was last built from
+	unsigned long long mFieldEpoch;
 
 	//true if simulation should run automatically
 	bool mAutoRun;
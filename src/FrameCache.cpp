@@ -0,0 +1,369 @@
+#include "FrameCache.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <libpng/zlib.h>
+#include "Profiler.h"
+
+using namespace framecache;
+
+//Grids stored in a record for the given header flags, in the order they are stored
+static std::vector<glm::ivec3> cachedGrids(const Header& header){
+	const int width = header.width, height = header.height, depth = header.depth;
+	std::vector<glm::ivec3> grids;
+	if (header.flags & CACHE_VELOCITY)
+	{
+		grids.push_back(glm::ivec3(width + 1, height, depth));
+		grids.push_back(glm::ivec3(width, height + 1, depth));
+		grids.push_back(glm::ivec3(width, height, depth + 1));
+	}
+	if (header.flags & CACHE_PRESSURE)
+		grids.push_back(glm::ivec3(width, height, depth));
+	return grids;
+}
+
+static std::size_t cellCount(const glm::ivec3& size){
+	return static_cast<std::size_t>(size.x) * size.y * size.z;
+}
+
+//Splits the bytes of every cell of q into 4 planes, x first, then y, then z
+static void storePlanes(const Grid3D<float>& q, unsigned char* out){
+	const std::size_t count = cellCount(glm::ivec3(q.width(), q.height(), q.depth()));
+	std::size_t i = 0;
+	for (int z = 0; z < q.depth(); ++z)
+		for (int y = 0; y < q.height(); ++y)
+			for (int x = 0; x < q.width(); ++x, ++i)
+			{
+				std::uint32_t bits;
+				std::memcpy(&bits, &q(x, y, z), sizeof(bits));
+				for (int b = 0; b < 4; ++b)
+					out[b * count + i] = static_cast<unsigned char>(bits >> (8 * b));
+			}
+}
+
+//Reverse of storePlanes, q has to have the size of the grid that was stored
+static void loadPlanes(const unsigned char* in, Grid3D<float>& q){
+	const std::size_t count = cellCount(glm::ivec3(q.width(), q.height(), q.depth()));
+	std::size_t i = 0;
+	for (int z = 0; z < q.depth(); ++z)
+		for (int y = 0; y < q.height(); ++y)
+			for (int x = 0; x < q.width(); ++x, ++i)
+			{
+				std::uint32_t bits = 0;
+				for (int b = 0; b < 4; ++b)
+					bits |= static_cast<std::uint32_t>(in[b * count + i]) << (8 * b);
+				std::memcpy(&q(x, y, z), &bits, sizeof(bits));
+			}
+}
+
+//Decompresses the first size bytes of a zlib stream into out. The rest of the stream isn't decompressed.
+static bool inflatePrefix(const unsigned char* in, std::size_t inSize, unsigned char* out, std::size_t size){
+	if (size == 0)
+		return true;
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK)
+		return false;
+	//zlib counts in 32 bits, large buffers are fed to it a piece at a time
+	const std::size_t piece = 1u << 30;
+	stream.next_in = const_cast<unsigned char*>(in);
+	stream.next_out = out;
+	std::size_t inLeft = inSize, outLeft = size;
+	int result = Z_OK;
+	while (outLeft > 0 && result == Z_OK)
+	{
+		if (stream.avail_in == 0)
+		{
+			stream.avail_in = static_cast<uInt>(std::min(inLeft, piece));
+			inLeft -= stream.avail_in;
+		}
+		const uInt avail = static_cast<uInt>(std::min(outLeft, piece));
+		stream.avail_out = avail;
+		result = inflate(&stream, Z_NO_FLUSH);
+		outLeft -= avail - stream.avail_out;
+		//Out of input without the stream ending
+		if (result == Z_BUF_ERROR && stream.avail_in == 0 && inLeft == 0)
+			break;
+		if (result == Z_BUF_ERROR)
+			result = Z_OK;
+	}
+	inflateEnd(&stream);
+	return outLeft == 0;
+}
+
+FrameCacheWriter::FrameCacheWriter() :mFile(nullptr), mCompressionLevel(DEFAULT_COMPRESSION_LEVEL), mOffset(0){}
+
+FrameCacheWriter::~FrameCacheWriter(){
+	close();
+}
+
+bool FrameCacheWriter::open(const std::string& path, int width, int height, int depth, std::uint32_t flags,
+	std::uint32_t keyframeInterval, int compressionLevel){
+	close();
+	mFile = std::fopen(path.c_str(), "wb");
+	if (!mFile)
+		return false;
+	std::memcpy(mHeader.magic, MAGIC, sizeof(mHeader.magic));
+	mHeader.version = VERSION;
+	mHeader.width = width;
+	mHeader.height = height;
+	mHeader.depth = depth;
+	mHeader.flags = flags;
+	mHeader.keyframeInterval = std::max(keyframeInterval, 1u);
+	mHeader.reserved = 0;
+	mCompressionLevel = compressionLevel;
+	mOffset = 0;
+	mOffsets.clear();
+	mPrevious.clear();
+	return write(&mHeader, sizeof(mHeader));
+}
+
+bool FrameCacheWriter::append(const SimulationFrame& frame){
+	PROFILE_ZONE("FrameCacheWriter::append");
+	if (!mFile)
+		return false;
+	const std::size_t n = frame.particles.size();
+	const bool keyframe = mOffsets.size() % mHeader.keyframeInterval == 0 || mPrevious.size() != 3 * n;
+	const std::vector<glm::ivec3> grids = cachedGrids(mHeader);
+	const Grid3D<float>* frameGrids[] = { &frame.u, &frame.v, &frame.w, &frame.pressure };
+	//Velocity comes first when it is cached, pressure is then the 4th grid instead of the 1st
+	const int firstGrid = mHeader.flags & CACHE_VELOCITY ? 0 : 3;
+	std::size_t rawSize = 3 * n * sizeof(std::uint16_t);
+	for (unsigned int g = 0; g < grids.size(); ++g)
+	{
+		const Grid3D<float>& q = *frameGrids[firstGrid + g];
+		if (glm::ivec3(q.width(), q.height(), q.depth()) != grids[g])
+		{
+			close();
+			return false;
+		}
+		rawSize += cellCount(grids[g]) * sizeof(float);
+	}
+	if (rawSize > std::numeric_limits<uLong>::max())
+	{
+		close();
+		return false;
+	}
+
+	//Positions go from 0 at the lower wall to POSITION_STEPS at the upper one, x for every particle, then y, then z.
+	//Differences wrap around, so adding them back up gives the exact quantized positions.
+	mRaw.resize(rawSize);
+	mQuantized.resize(3 * n);
+	const float dimensions[] = { static_cast<float>(mHeader.width), static_cast<float>(mHeader.height), static_cast<float>(mHeader.depth) };
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float scale = POSITION_STEPS / dimensions[axis];
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			const std::size_t j = axis * n + i;
+			const float q = glm::clamp(std::round(frame.particles[i][axis] * scale), 0.0f, POSITION_STEPS);
+			mQuantized[j] = static_cast<std::uint16_t>(q);
+			const std::uint16_t delta = keyframe ? mQuantized[j] : static_cast<std::uint16_t>(mQuantized[j] - mPrevious[j]);
+			mRaw[j] = static_cast<unsigned char>(delta);
+			mRaw[3 * n + j] = static_cast<unsigned char>(delta >> 8);
+		}
+	}
+	std::size_t offset = 3 * n * sizeof(std::uint16_t);
+	for (unsigned int g = 0; g < grids.size(); ++g)
+	{
+		storePlanes(*frameGrids[firstGrid + g], &mRaw[offset]);
+		offset += cellCount(grids[g]) * sizeof(float);
+	}
+	mPrevious.swap(mQuantized);
+
+	uLongf compressedSize = compressBound(static_cast<uLong>(rawSize));
+	mCompressed.resize(compressedSize);
+	if (compress2(mCompressed.data(), &compressedSize, mRaw.data(), static_cast<uLong>(rawSize), mCompressionLevel) != Z_OK)
+	{
+		close();
+		return false;
+	}
+	RecordHeader record;
+	record.magic = RECORD_MAGIC;
+	record.flags = keyframe ? KEYFRAME : 0;
+	record.particleCount = static_cast<std::uint32_t>(n);
+	record.reserved = 0;
+	record.rawSize = rawSize;
+	record.compressedSize = compressedSize;
+	const std::uint64_t recordOffset = mOffset;
+	if (!write(&record, sizeof(record)) || !write(mCompressed.data(), compressedSize))
+	{
+		close();
+		return false;
+	}
+	mOffsets.push_back(recordOffset);
+	return true;
+}
+
+bool FrameCacheWriter::close(){
+	if (!mFile)
+		return false;
+	Footer footer;
+	footer.indexOffset = mOffset;
+	footer.frameCount = mOffsets.size();
+	std::memcpy(footer.magic, FOOTER_MAGIC, sizeof(footer.magic));
+	bool written = write(mOffsets.data(), mOffsets.size() * sizeof(std::uint64_t)) && write(&footer, sizeof(footer));
+	//write closes the file if it fails
+	if (mFile)
+		written = std::fclose(mFile) == 0 && written;
+	mFile = nullptr;
+	return written;
+}
+
+bool FrameCacheWriter::write(const void* data, std::size_t size){
+	if (size > 0 && std::fwrite(data, 1, size, mFile) != size)
+	{
+		std::fclose(mFile);
+		mFile = nullptr;
+		return false;
+	}
+	mOffset += size;
+	return true;
+}
+
+FrameCacheReader::FrameCacheReader() :mDecoded(-1){
+	std::memset(&mHeader, 0, sizeof(mHeader));
+}
+
+bool FrameCacheReader::open(const std::string& path){
+	close();
+	if (!mFile.open(path) || mFile.size() < sizeof(Header))
+	{
+		close();
+		return false;
+	}
+	const unsigned char* data = mFile.data();
+	const std::size_t size = mFile.size();
+	std::memcpy(&mHeader, data, sizeof(mHeader));
+	//Same limits as a simulation, so replaying can size its grids from the header
+	auto validSize = [](std::int32_t size){ return size >= 3 && size <= MAX_GRID_SIZE; };
+	if (std::memcmp(mHeader.magic, MAGIC, sizeof(mHeader.magic)) != 0 || mHeader.version != VERSION
+		|| !validSize(mHeader.width) || !validSize(mHeader.height) || !validSize(mHeader.depth) || mHeader.keyframeInterval == 0)
+	{
+		close();
+		return false;
+	}
+
+	Footer footer;
+	bool indexed = false;
+	if (size >= sizeof(Header) + sizeof(Footer))
+	{
+		std::memcpy(&footer, data + size - sizeof(Footer), sizeof(footer));
+		indexed = std::memcmp(footer.magic, FOOTER_MAGIC, sizeof(footer.magic)) == 0 && footer.indexOffset <= size - sizeof(Footer)
+			&& footer.frameCount <= (size - sizeof(Footer) - footer.indexOffset) / sizeof(std::uint64_t);
+	}
+	if (indexed)
+	{
+		mOffsets.resize(footer.frameCount);
+		if (!mOffsets.empty())
+			std::memcpy(mOffsets.data(), data + footer.indexOffset, mOffsets.size() * sizeof(std::uint64_t));
+	}
+	else
+	{
+		//No index, the writer never finished. Take every record that was written completely.
+		std::uint64_t offset = sizeof(Header);
+		RecordHeader record;
+		while (offset + sizeof(RecordHeader) <= size)
+		{
+			std::memcpy(&record, data + offset, sizeof(record));
+			if (record.magic != RECORD_MAGIC || record.compressedSize > size - offset - sizeof(RecordHeader))
+				break;
+			mOffsets.push_back(offset);
+			offset += sizeof(RecordHeader) + record.compressedSize;
+		}
+	}
+	return true;
+}
+
+void FrameCacheReader::close(){
+	mFile.close();
+	mOffsets.clear();
+	mPrevious.clear();
+	mDecoded = -1;
+}
+
+bool FrameCacheReader::readFrame(int index, SimulationFrame& frame){
+	PROFILE_ZONE("FrameCacheReader::readFrame");
+	if (index < 0 || index >= frameCount())
+		return false;
+	//Frames build on the ones before them back to a keyframe. Carry on from the last frame decoded if it is on the way.
+	int start = index;
+	while (start > 0 && start != mDecoded + 1 && !isKeyframe(start))
+		--start;
+	for (int i = start; i < index; ++i)
+		if (!decode(i, nullptr))
+			return false;
+	if (!decode(index, &frame))
+		return false;
+
+	const std::size_t n = mPrevious.size() / 3;
+	const float dimensions[] = { static_cast<float>(mHeader.width), static_cast<float>(mHeader.height), static_cast<float>(mHeader.depth) };
+	frame.epoch = index;
+	frame.particles.resize(n);
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float scale = dimensions[axis] / POSITION_STEPS;
+		for (std::size_t i = 0; i < n; ++i)
+			frame.particles[i][axis] = mPrevious[axis * n + i] * scale;
+	}
+	frame.fields.clear();
+	return true;
+}
+
+bool FrameCacheReader::isKeyframe(int index) const{
+	RecordHeader record;
+	if (mOffsets[index] + sizeof(RecordHeader) > mFile.size())
+		return false;
+	std::memcpy(&record, mFile.data() + mOffsets[index], sizeof(record));
+	return (record.flags & KEYFRAME) != 0;
+}
+
+bool FrameCacheReader::decode(int index, SimulationFrame* frame){
+	const std::uint64_t offset = mOffsets[index];
+	RecordHeader record;
+	if (offset + sizeof(RecordHeader) > mFile.size())
+		return false;
+	std::memcpy(&record, mFile.data() + offset, sizeof(record));
+	if (record.magic != RECORD_MAGIC || record.compressedSize > mFile.size() - offset - sizeof(RecordHeader))
+		return false;
+	const std::size_t n = record.particleCount;
+	const std::size_t positionBytes = 3 * n * sizeof(std::uint16_t);
+	const std::vector<glm::ivec3> grids = cachedGrids(mHeader);
+	std::size_t gridBytes = 0;
+	for (const glm::ivec3& size : grids)
+		gridBytes += cellCount(size) * sizeof(float);
+	if (record.rawSize != positionBytes + gridBytes)
+		return false;
+	if (record.flags & KEYFRAME)
+		mPrevious.assign(3 * n, 0);
+	else if (mPrevious.size() != 3 * n || mDecoded != index - 1)
+		return false;
+
+	//Frames on the way to the one asked for only need their positions, which come first in the stream
+	const std::size_t needed = frame ? positionBytes + gridBytes : positionBytes;
+	mRaw.resize(needed);
+	mDecoded = -1;
+	if (!inflatePrefix(mFile.data() + offset + sizeof(RecordHeader), record.compressedSize, mRaw.data(), needed))
+		return false;
+	for (std::size_t j = 0; j < 3 * n; ++j)
+		mPrevious[j] += static_cast<std::uint16_t>(mRaw[j] | (mRaw[3 * n + j] << 8));
+	mDecoded = index;
+
+	if (frame)
+	{
+		Grid3D<float>* frameGrids[] = { &frame->u, &frame->v, &frame->w, &frame->pressure };
+		for (Grid3D<float>* q : frameGrids)
+			*q = Grid3D<float>();
+		const int firstGrid = mHeader.flags & CACHE_VELOCITY ? 0 : 3;
+		std::size_t gridOffset = positionBytes;
+		for (unsigned int g = 0; g < grids.size(); ++g)
+		{
+			Grid3D<float>& q = *frameGrids[firstGrid + g];
+			q.resize(grids[g].x, grids[g].y, grids[g].z);
+			loadPlanes(&mRaw[gridOffset], q);
+			gridOffset += cellCount(grids[g]) * sizeof(float);
+		}
+	}
+	return true;
+}
@@ -0,0 +1,161 @@
+#ifndef _FRAMECACHE_H_
+#define _FRAMECACHE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "CFDSimulation.h"
+#include "MappedFile.h"
+
+/*
+Streaming cache of simulation frames, written once by a simulation run and read back any number of times
+to replay or re-mesh it.
+
+The file starts with a header, followed by one record per frame and, once the writer is closed, an index of
+where each record starts and a footer pointing to it. Each record is a small header and a zlib stream holding
+	marker particle positions, quantized to 16 bits per axis across the grid and stored as the difference from the
+		position of the same particle in the previous frame. Keyframes store the positions themselves.
+	velocity u, v, w, if the cache was written with CACHE_VELOCITY
+	pressure, if the cache was written with CACHE_PRESSURE
+Every array has its bytes split into planes (all the first bytes, then all the second bytes...) before compressing,
+which puts the mostly zero high bytes of small differences together. Positions are lossy, grids are stored exactly.
+
+A frame depends on the frames back to the last keyframe. Keyframes come every keyframeInterval frames and whenever
+the number of particles changes, so reading any frame decodes at most keyframeInterval records.
+Differences are smallest when particles keep their order between frames. Particles sorted every step (FLIP) still
+work, but compress less well.
+A cache whose writer didn't get to close it (e.g. a crashed run) has no index. The reader then finds the records
+by walking them from the start, up to the last one that was written completely.
+*/
+namespace framecache{
+
+	const char MAGIC[8] = { 'F', 'L', 'U', 'I', 'D', 'F', 'C', 'H' };
+	const char FOOTER_MAGIC[8] = { 'F', 'L', 'U', 'I', 'D', 'I', 'D', 'X' };
+	const std::uint32_t RECORD_MAGIC = 0x44524346; //"FCRD"
+	const std::uint32_t VERSION = 1;
+
+	//Flags of the header
+	const std::uint32_t CACHE_VELOCITY = 1;
+	const std::uint32_t CACHE_PRESSURE = 2;
+	//Flags of a record
+	const std::uint32_t KEYFRAME = 1;
+
+	//Largest quantized coordinate, 0 is the lower wall of the grid and this the upper one
+	const float POSITION_STEPS = 65535.0f;
+	const std::uint32_t DEFAULT_KEYFRAME_INTERVAL = 30;
+	//zlib level from 1 (fastest) to 9 (smallest)
+	const int DEFAULT_COMPRESSION_LEVEL = 6;
+
+	struct Header{
+		char magic[8];
+		std::uint32_t version;
+		std::int32_t width, height, depth;
+		std::uint32_t flags;
+		std::uint32_t keyframeInterval;
+		std::uint32_t reserved;
+	};
+
+	struct RecordHeader{
+		std::uint32_t magic;
+		std::uint32_t flags;
+		std::uint32_t particleCount;
+		std::uint32_t reserved;
+		//Size of the record's data once decompressed
+		std::uint64_t rawSize;
+		//Size of the zlib stream following the header
+		std::uint64_t compressedSize;
+	};
+
+	struct Footer{
+		//Position of the index, an array of frameCount 64 bit offsets of the records
+		std::uint64_t indexOffset;
+		std::uint64_t frameCount;
+		char magic[8];
+	};
+}
+
+class FrameCacheWriter{
+public:
+	FrameCacheWriter();
+	//Closes the cache if it is still open
+	~FrameCacheWriter();
+	FrameCacheWriter(const FrameCacheWriter&) = delete;
+	FrameCacheWriter& operator=(const FrameCacheWriter&) = delete;
+
+	/*
+	Starts a cache for a simulation of the given grid size, replacing any file at path.
+	flags is a combination of framecache::CACHE_VELOCITY and framecache::CACHE_PRESSURE.
+	@return false if the file can't be created
+	*/
+	bool open(const std::string& path, int width, int height, int depth, std::uint32_t flags = 0,
+		std::uint32_t keyframeInterval = framecache::DEFAULT_KEYFRAME_INTERVAL, int compressionLevel = framecache::DEFAULT_COMPRESSION_LEVEL);
+	/*
+	Appends a frame. Frames cached with velocity or pressure have to come from a simulation publishing them,
+	see CFDSimulation::setSnapshotVelocity.
+	@return false if it can't be written, the cache is closed then
+	*/
+	bool append(const SimulationFrame& frame);
+	//Writes the index and closes the file. Returns false if they can't be written.
+	bool close();
+
+	bool isOpen() const { return mFile != nullptr; }
+	std::uint32_t frameCount() const { return static_cast<std::uint32_t>(mOffsets.size()); }
+	//Bytes written so far
+	std::uint64_t bytesWritten() const { return mOffset; }
+
+private:
+	FILE* mFile;
+	framecache::Header mHeader;
+	int mCompressionLevel;
+	std::uint64_t mOffset;
+	std::vector<std::uint64_t> mOffsets;
+	//Quantized positions of the previous frame, x then y then z, that the next one is stored as a difference from
+	std::vector<std::uint16_t> mPrevious;
+	//Scratch space kept between frames
+	std::vector<std::uint16_t> mQuantized;
+	std::vector<unsigned char> mRaw, mCompressed;
+
+	bool write(const void* data, std::size_t size);
+};
+
+class FrameCacheReader{
+public:
+	FrameCacheReader();
+	FrameCacheReader(const FrameCacheReader&) = delete;
+	FrameCacheReader& operator=(const FrameCacheReader&) = delete;
+
+	//Maps the cache at path. Returns false if it can't be mapped or isn't a frame cache of this version.
+	bool open(const std::string& path);
+	void close();
+
+	bool isOpen() const { return mFile.isOpen(); }
+	int frameCount() const { return static_cast<int>(mOffsets.size()); }
+	int width() const { return mHeader.width; }
+	int height() const { return mHeader.height; }
+	int depth() const { return mHeader.depth; }
+	std::uint32_t flags() const { return mHeader.flags; }
+
+	/*
+	Decodes frame index into frame. Its epoch is set to the index, velocity and pressure are filled if the cache
+	has them and emptied otherwise. Reading the frame after the last one read only decodes that frame,
+	anything else decodes from the keyframe before it.
+	@return false if the frame is corrupt or index is out of range
+	*/
+	bool readFrame(int index, SimulationFrame& frame);
+
+private:
+	MappedFile mFile;
+	framecache::Header mHeader;
+	std::vector<std::uint64_t> mOffsets;
+	//Index of the frame mPrevious holds the quantized positions of, -1 if none
+	int mDecoded;
+	std::vector<std::uint16_t> mPrevious;
+	std::vector<unsigned char> mRaw;
+
+	bool isKeyframe(int index) const;
+	//Decodes a record into mPrevious, and the grids into frame if it isn't null
+	bool decode(int index, SimulationFrame* frame);
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include "FrameReplay.h"
+#include <algorithm>
+#include "Profiler.h"
+
+FrameReplay::FrameReplay() :mShownIndex(-1), mShownCount(1), mNext(-1), mSeeking(false), mPlaying(false), mLoop(false), mStop(false){}
+
+FrameReplay::~FrameReplay(){
+	close();
+}
+
+bool FrameReplay::open(const std::string& path, int prefetchFrames){
+	close();
+	if (!mReader.open(path) || mReader.frameCount() == 0)
+	{
+		mReader.close();
+		return false;
+	}
+	Slot empty;
+	empty.index = -1;
+	empty.busy = false;
+	empty.valid = false;
+	mSlots.assign(std::max(prefetchFrames, 1), empty);
+	mShown = SimulationFrame();
+	mShownIndex = -1;
+	mShownCount = 1;
+	mNext = 0;
+	mSeeking = true;
+	mPlaying = false;
+	mStop = false;
+	mWorker = std::thread(&FrameReplay::decodeLoop, this);
+	return true;
+}
+
+void FrameReplay::close(){
+	if (mWorker.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStop = true;
+		}
+		mWake.notify_all();
+		mWorker.join();
+	}
+	mReader.close();
+	mSlots.clear();
+	mNext = -1;
+	mPlaying = false;
+}
+
+void FrameReplay::play(){
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mNext < 0)
+			mNext = 0;
+		mPlaying = true;
+	}
+	mWake.notify_all();
+}
+
+void FrameReplay::pause(){
+	std::lock_guard<std::mutex> lock(mMutex);
+	mPlaying = false;
+}
+
+void FrameReplay::setLoop(bool loop){
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mLoop = loop;
+		//Paused at the end, the first frame is next again
+		if (loop && mNext < 0)
+			mNext = 0;
+	}
+	mWake.notify_all();
+}
+
+void FrameReplay::seek(int frame){
+	if (!isOpen())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mNext = glm::clamp(frame, 0, frameCount() - 1);
+		mSeeking = true;
+	}
+	mWake.notify_all();
+}
+
+bool FrameReplay::update(){
+	bool shown = false;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if ((!mPlaying && !mSeeking) || mNext < 0)
+			return false;
+		auto slot = std::find_if(mSlots.begin(), mSlots.end(), [&](const Slot& s){ return !s.busy && s.index == mNext; });
+		if (slot == mSlots.end())
+			return false;
+		if (slot->valid)
+		{
+			//The slot gets the old frame's storage to decode into
+			std::swap(slot->frame, mShown);
+			mShown.epoch = mShownCount++;
+			mShownIndex = mNext;
+			shown = true;
+		}
+		slot->index = -1;
+		mSeeking = false;
+		if (mNext + 1 < frameCount())
+			++mNext;
+		else if (mLoop)
+			mNext = 0;
+		else
+		{
+			mNext = -1;
+			mPlaying = false;
+		}
+	}
+	mWake.notify_all();
+	return shown;
+}
+
+int FrameReplay::windowFrame(int n) const{
+	if (mNext < 0 || n >= frameCount())
+		return -1;
+	const int frame = mNext + n;
+	if (frame < frameCount())
+		return frame;
+	return mLoop ? frame - frameCount() : -1;
+}
+
+bool FrameReplay::inWindow(int index) const{
+	for (int n = 0; n < static_cast<int>(mSlots.size()); ++n)
+		if (windowFrame(n) == index)
+			return true;
+	return false;
+}
+
+void FrameReplay::decodeLoop(){
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (!mStop)
+	{
+		//Earliest frame of the window that no slot holds, and a slot holding nothing the window needs to decode it into
+		Slot* slot = nullptr;
+		int frame = -1;
+		for (int n = 0; n < static_cast<int>(mSlots.size()) && frame < 0; ++n)
+		{
+			const int candidate = windowFrame(n);
+			if (candidate < 0)
+				break;
+			if (std::none_of(mSlots.begin(), mSlots.end(), [&](const Slot& s){ return s.index == candidate; }))
+				frame = candidate;
+		}
+		if (frame >= 0)
+			for (Slot& s : mSlots)
+				if (!s.busy && (s.index < 0 || !inWindow(s.index)))
+				{
+					slot = &s;
+					break;
+				}
+		if (!slot)
+		{
+			mWake.wait(lock);
+			continue;
+		}
+
+		slot->index = frame;
+		slot->busy = true;
+		lock.unlock();
+		bool valid;
+		{
+			PROFILE_ZONE("FrameReplay::decode");
+			valid = mReader.readFrame(frame, slot->frame);
+		}
+		lock.lock();
+		slot->busy = false;
+		slot->valid = valid;
+	}
+}
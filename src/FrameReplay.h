@@ -0,0 +1,94 @@
+#ifndef _FRAMEREPLAY_H_
+#define _FRAMEREPLAY_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FrameCache.h"
+
+//Frames decoded ahead of the one shown
+const int DEFAULT_PREFETCH_FRAMES = 8;
+
+/*
+Plays back a frame cache (see FrameCache.h) in place of a running simulation. latestFrame() works like
+CFDSimulation::latestFrame, so whatever shows or meshes a simulation can show a recording instead.
+
+The cache is memory mapped, and a background thread decodes the frames about to be shown into a small window
+of slots, in the order they will be played. update() moves on to the next frame once it is decoded, so playback
+runs as fast as frames can be read and decoded, without a solver. Seeking restarts the window at the new frame.
+Everything but the background thread is meant to be used from one thread.
+*/
+class FrameReplay{
+public:
+	FrameReplay();
+	~FrameReplay();
+	FrameReplay(const FrameReplay&) = delete;
+	FrameReplay& operator=(const FrameReplay&) = delete;
+
+	//Opens a cache, paused at its first frame. Returns false if it can't be read or holds no frames.
+	bool open(const std::string& path, int prefetchFrames = DEFAULT_PREFETCH_FRAMES);
+	void close();
+	bool isOpen() const { return mReader.isOpen(); }
+
+	int frameCount() const { return mReader.frameCount(); }
+	int width() const { return mReader.width(); }
+	int height() const { return mReader.height(); }
+	int depth() const { return mReader.depth(); }
+
+	//Playing from the last frame without looping starts over from the first
+	void play();
+	void pause();
+	bool playing() const { return mPlaying; }
+	//When looping, the first frame follows the last, otherwise playback pauses on the last frame
+	void setLoop(bool loop);
+	bool loop() const { return mLoop; }
+	//Shows the given frame (clamped to the cache) on the next update that finds it decoded, playing or not
+	void seek(int frame);
+
+	//Call once per displayed frame. Moves to the next frame if playing, or to the frame sought to. Never waits,
+	//if the frame isn't decoded yet the current one stays. Returns true if the frame changed.
+	bool update();
+	//Frame last moved to by update. Its epoch counts the frames shown before it, starting at 1,
+	//so it differs from the empty frame shown before the first update.
+	const SimulationFrame& latestFrame() const { return mShown; }
+	//Index in the cache of the frame latestFrame() returns, -1 before the first
+	int currentFrame() const { return mShownIndex; }
+
+private:
+	struct Slot{
+		//Frame held or being decoded, -1 if none
+		int index;
+		//Being decoded by the background thread, which is the only one touching frame until it is done
+		bool busy;
+		//false if the frame couldn't be decoded. It is skipped when played.
+		bool valid;
+		SimulationFrame frame;
+	};
+
+	//Only read by the background thread once it is started
+	FrameCacheReader mReader;
+	std::vector<Slot> mSlots;
+	SimulationFrame mShown;
+	int mShownIndex;
+	unsigned long long mShownCount;
+	//Frame update() shows next, -1 once playback reached the end
+	int mNext;
+	//A seek that hasn't been shown yet
+	bool mSeeking;
+	bool mPlaying, mLoop;
+
+	std::thread mWorker;
+	//Guards everything above but mReader and the frames of busy slots
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	bool mStop;
+
+	//Frame n places after mNext in playback order, -1 if playback ends before then
+	int windowFrame(int n) const;
+	bool inWindow(int index) const;
+	void decodeLoop();
+};
+
+#endif
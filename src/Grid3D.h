@@ -0,0 +1,161 @@
+#ifndef _GRID3D_H_
+#define _GRID3D_H_
+
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "AlignedAllocator.h"
+
+//Alignment in bytes of the start of a grid and of each of its rows. 64 bytes is a cache line and an AVX-512 register.
+const std::size_t GRID_ALIGNMENT = 64;
+
+/*
+Layouts map a cell (x, y, z) to its position in the storage of a Grid3D. Each one is a small struct with
+	void resize(int width, int height, int depth, std::size_t elementSize) - sets up the mapping for a grid of that size
+	std::size_t size() const - number of elements of storage needed, padding included
+	int index(int x, int y, int z) const - position of the cell in storage
+	static const int MAX_SIZE - largest width, height or depth the mapping supports
+	static const bool CONTIGUOUS_ROWS - true if the cells of a row along x are next to each other in storage
+The layout is a template parameter of Grid3D, so the index math inlines into every access.
+*/
+
+//x first, then y, then z. Each row along x is padded to a multiple of GRID_ALIGNMENT bytes,
+//so every row starts on an aligned address and rows never share a cache line.
+struct LinearLayout{
+	static const int MAX_SIZE = 1 << 16;
+	static const bool CONTIGUOUS_ROWS = true;
+	int pitch, slice;
+	std::size_t count;
+
+	LinearLayout() :pitch(0), slice(0), count(0){}
+	void resize(int width, int height, int depth, std::size_t elementSize){
+		const int perAlignment = GRID_ALIGNMENT / elementSize > 0 ? static_cast<int>(GRID_ALIGNMENT / elementSize) : 1;
+		pitch = (width + perAlignment - 1) / perAlignment * perAlignment;
+		slice = pitch * height;
+		count = static_cast<std::size_t>(slice) * depth;
+	}
+	std::size_t size() const { return count; }
+	inline int index(int x, int y, int z) const { return x + pitch * y + slice * z; }
+};
+
+//The grid is split into bricks of Size^3 cells stored one after another, x first, then y, then z.
+//Cells within a brick are also stored x first. Every neighbor of a cell is close in memory,
+//not just the ones along x. Size must be a power of two.
+template <int Size>
+struct TiledLayout{
+	static_assert(Size > 0 && (Size & (Size - 1)) == 0, "Brick size must be a power of two");
+	static const int BRICK_VOLUME = Size * Size * Size;
+	static const int MAX_SIZE = 1 << 16;
+	static const bool CONTIGUOUS_ROWS = false;
+	int bricksX, bricksXY;
+	std::size_t count;
+
+	TiledLayout() :bricksX(0), bricksXY(0), count(0){}
+	void resize(int width, int height, int depth, std::size_t){
+		bricksX = (width + Size - 1) / Size;
+		bricksXY = bricksX * ((height + Size - 1) / Size);
+		count = static_cast<std::size_t>(bricksXY) * ((depth + Size - 1) / Size) * BRICK_VOLUME;
+	}
+	std::size_t size() const { return count; }
+	inline int index(int x, int y, int z) const {
+		const unsigned int ux = x, uy = y, uz = z;
+		const int brick = ux / Size + bricksX * (uy / Size) + bricksXY * (uz / Size);
+		return brick * BRICK_VOLUME + (ux % Size) + Size * ((uy % Size) + Size * (uz % Size));
+	}
+};
+
+//Z-order curve: the bits of x, y and z are interleaved, so cells close in 3D are close in memory at every scale.
+//Supports up to 1024 cells along each axis, larger coordinates would alias.
+struct MortonLayout{
+	static const int MAX_SIZE = 1024;
+	static const bool CONTIGUOUS_ROWS = false;
+	std::size_t count;
+
+	MortonLayout() :count(0){}
+	void resize(int width, int height, int depth, std::size_t){
+		if (width > MAX_SIZE || height > MAX_SIZE || depth > MAX_SIZE)
+			throw std::length_error("MortonLayout supports at most 1024 cells along each axis");
+		//The code grows with each coordinate, so the far corner has the largest one
+		count = width > 0 && height > 0 && depth > 0 ? static_cast<std::size_t>(index(width - 1, height - 1, depth - 1)) + 1 : 0;
+	}
+	std::size_t size() const { return count; }
+	inline int index(int x, int y, int z) const { return spread(x) | (spread(y) << 1) | (spread(z) << 2); }
+
+	//Moves the lower 10 bits of v so there are two 0 bits between each of them
+	static inline unsigned int spread(unsigned int v){
+		v &= 0x3ff;
+		v = (v | (v << 16)) & 0x030000ff;
+		v = (v | (v << 8)) & 0x0300f00f;
+		v = (v | (v << 4)) & 0x030c30c3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+};
+
+//Layout used by every grid that doesn't ask for one. Define GRID_LAYOUT when building (e.g. as MortonLayout or
+//TiledLayout<8>) to run the whole simulation on another layout.
+#ifndef GRID_LAYOUT
+#define GRID_LAYOUT LinearLayout
+#endif
+typedef GRID_LAYOUT DefaultLayout;
+
+//Largest width, height or depth of a simulation. Morton keys for sorting particles only cover 1024 cells per axis,
+//and the face velocity grids are one cell wider than the simulation, so they must still fit DefaultLayout.
+const int MAX_GRID_SIZE = DefaultLayout::MAX_SIZE - 1 < 1024 ? DefaultLayout::MAX_SIZE - 1 : 1024;
+
+/*
+3D array of values. The grid owns its size and storage, and Layout decides where each cell lives in that storage.
+The boundary layer of a field is part of the grid, (0, y, z) and (width - 1, y, z) are boundary cells.
+Storage is aligned to GRID_ALIGNMENT bytes.
+*/
+template <typename T, typename Layout = DefaultLayout>
+class Grid3D{
+public:
+	//Rows along x can be walked with a pointer from &q(0, y, z)
+	static const bool CONTIGUOUS_ROWS = Layout::CONTIGUOUS_ROWS;
+
+	Grid3D() :mWidth(0), mHeight(0), mDepth(0){}
+	Grid3D(int width, int height, int depth, const T& value = T()){ resize(width, height, depth, value); }
+
+	//Reallocates the grid, setting every value (padding included) to value.
+	void resize(int width, int height, int depth, const T& value = T()){
+		mWidth = width;
+		mHeight = height;
+		mDepth = depth;
+		mLayout.resize(width, height, depth, sizeof(T));
+		mData.assign(mLayout.size(), value);
+	}
+
+	void fill(const T& value){ mData.assign(mData.size(), value); }
+	void swap(Grid3D& other){
+		std::swap(mWidth, other.mWidth);
+		std::swap(mHeight, other.mHeight);
+		std::swap(mDepth, other.mDepth);
+		std::swap(mLayout, other.mLayout);
+		mData.swap(other.mData);
+	}
+
+	inline int index(int x, int y, int z) const { return mLayout.index(x, y, z); }
+	inline T& operator()(int x, int y, int z){ return mData[index(x, y, z)]; }
+	inline const T& operator()(int x, int y, int z) const { return mData[index(x, y, z)]; }
+	//Access by position in storage, as returned by index()
+	inline T& operator[](int i){ return mData[i]; }
+	inline const T& operator[](int i) const { return mData[i]; }
+
+	int width() const { return mWidth; }
+	int height() const { return mHeight; }
+	int depth() const { return mDepth; }
+	//Number of elements of storage, padding included
+	std::size_t size() const { return mData.size(); }
+	const Layout& layout() const { return mLayout; }
+	T* data(){ return mData.data(); }
+	const T* data() const { return mData.data(); }
+
+private:
+	int mWidth, mHeight, mDepth;
+	Layout mLayout;
+	std::vector<T, AlignedAllocator<T, GRID_ALIGNMENT>> mData;
+};
+
+#endif
@@ -0,0 +1,325 @@
+/*
+Runs the simulation without a window or OpenGL, for machines without a GPU.
+Sets up a dam break (a block of still water against one wall), advances it a number of frames and prints how long
+each one took. Built by the CMake project as fluidsim_headless, see --help for the options.
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CFDSimulation.h"
+#include "DensitySplatter.h"
+#include "FrameCache.h"
+#include "FrameReplay.h"
+#include "MarchingCubes.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+
+//Simulated time per frame, same as the interactive viewer
+const float FRAME_TIME = 1.0f / 60.0f;
+//Radius of each particle's contribution to the field meshed with --mesh
+const float MESH_RADIUS = 1.0f;
+//Density the surface is drawn at, same as the viewer's shaders
+const double MESH_ISOLEVEL = 0.0001;
+
+struct Options{
+	int width, height, depth;
+	int frames;
+	int threads;
+	PressureSolver solver;
+	AdvectionScheme scheme;
+	bool activeBlocksOnly;
+	bool mesh;
+	std::string tracePath;
+	std::string restartPath;
+	std::string checkpointPath;
+	int checkpointInterval;
+	std::string cachePath;
+	std::uint32_t cacheFlags;
+	std::string replayPath;
+
+	Options() :width(DEFAULT_FLUID_WIDTH), height(DEFAULT_FLUID_HEIGHT), depth(DEFAULT_FLUID_DEPTH), frames(100),
+		threads(1), solver(PressureSolver::PCG), scheme(AdvectionScheme::SEMI_LAGRANGIAN), activeBlocksOnly(false), mesh(false),
+		checkpointInterval(0), cacheFlags(0){}
+};
+
+static void printUsage(const char* program){
+	std::printf("usage: %s [options]\n"
+		"  --size N | WxHxD     grid size in cells, boundary layer included (default %dx%dx%d)\n"
+		"  --frames N           frames of 1/60 s to simulate (default 100)\n"
+		"  --threads N          threads to run on, 1 for the calling thread only (default 1)\n"
+		"  --solver gs|mg|pcg   pressure solver (default pcg)\n"
+		"  --flip               carry velocity on the particles (FLIP/PIC) instead of semi-Lagrangian advection\n"
+		"  --active-blocks      only simulate blocks of the grid near fluid, the grids still cover all of it\n"
+		"  --mesh               also mesh the particles on the CPU every frame, like the viewer does on the GPU\n"
+		"  --trace PATH         write the profiler zones to PATH as Chrome trace JSON (needs FLUIDSIM_PROFILE)\n"
+		"  --restart PATH       start from a checkpoint instead of the dam break, its grid size replaces --size\n"
+		"  --checkpoint PATH    save a checkpoint to PATH after the last frame\n"
+		"  --checkpoint-interval N  also save one every N frames\n"
+		"  --cache PATH         record every frame's particles to a compressed frame cache at PATH\n"
+		"  --cache-velocity     also record the velocity in the cache\n"
+		"  --cache-pressure     also record the pressure in the cache\n"
+		"  --replay PATH        play back a frame cache instead of simulating, meshing each frame with --mesh\n",
+		program, DEFAULT_FLUID_WIDTH, DEFAULT_FLUID_HEIGHT, DEFAULT_FLUID_DEPTH);
+}
+
+//Returns false if the arguments can't be parsed
+static bool parseOptions(int argc, char** argv, Options& options){
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (arg == "--size" && hasValue)
+		{
+			const char* value = argv[++i];
+			int w, h, d;
+			if (std::sscanf(value, "%dx%dx%d", &w, &h, &d) == 3)
+			{
+				options.width = w;
+				options.height = h;
+				options.depth = d;
+			}
+			else
+				options.width = options.height = options.depth = std::atoi(value);
+		}
+		else if (arg == "--frames" && hasValue)
+			options.frames = std::atoi(argv[++i]);
+		else if (arg == "--threads" && hasValue)
+			options.threads = std::atoi(argv[++i]);
+		else if (arg == "--solver" && hasValue)
+		{
+			const std::string value = argv[++i];
+			if (value == "gs")
+				options.solver = PressureSolver::GAUSS_SEIDEL;
+			else if (value == "mg")
+				options.solver = PressureSolver::MULTIGRID;
+			else if (value == "pcg")
+				options.solver = PressureSolver::PCG;
+			else
+				return false;
+		}
+		else if (arg == "--flip")
+			options.scheme = AdvectionScheme::FLIP;
+		else if (arg == "--active-blocks")
+			options.activeBlocksOnly = true;
+		else if (arg == "--mesh")
+			options.mesh = true;
+		else if (arg == "--trace" && hasValue)
+			options.tracePath = argv[++i];
+		else if (arg == "--restart" && hasValue)
+			options.restartPath = argv[++i];
+		else if (arg == "--checkpoint" && hasValue)
+			options.checkpointPath = argv[++i];
+		else if (arg == "--checkpoint-interval" && hasValue)
+			options.checkpointInterval = std::atoi(argv[++i]);
+		else if (arg == "--cache" && hasValue)
+			options.cachePath = argv[++i];
+		else if (arg == "--cache-velocity")
+			options.cacheFlags |= framecache::CACHE_VELOCITY;
+		else if (arg == "--cache-pressure")
+			options.cacheFlags |= framecache::CACHE_PRESSURE;
+		else if (arg == "--replay" && hasValue)
+			options.replayPath = argv[++i];
+		else
+			return false;
+	}
+	//Room for at least one interior cell, and no more than MAX_GRID_SIZE cells along any axis
+	const bool sizeValid = options.width >= 3 && options.height >= 3 && options.depth >= 3
+		&& options.width <= MAX_GRID_SIZE && options.height <= MAX_GRID_SIZE && options.depth <= MAX_GRID_SIZE;
+	return sizeValid && options.frames > 0 && options.threads > 0 && options.checkpointInterval >= 0;
+}
+
+//Meshes particles like the viewer does: their density on every cell corner of the grid, then marching cubes
+class Mesher{
+public:
+	explicit Mesher(ThreadPool* pool){
+		mSplatter.setThreadPool(pool);
+		mExtractor.setThreadPool(pool);
+	}
+
+	//Particles of a grid of width x height x depth cells
+	void mesh(const std::vector<glm::vec3>& particles, int width, int height, int depth, std::vector<TRIANGLE>& triangles){
+		PROFILE_ZONE("mesh");
+		if (mDensity.width() != width + 1 || mDensity.height() != height + 1 || mDensity.depth() != depth + 1)
+			mDensity.resize(width + 1, height + 1, depth + 1);
+		mSplatter.splat(particles, MESH_RADIUS * MESH_RADIUS, mDensity);
+		mExtractor.extract(mDensity, MESH_ISOLEVEL, triangles);
+	}
+
+private:
+	Grid3D<float> mDensity;
+	DensitySplatter mSplatter;
+	SurfaceExtractor mExtractor;
+};
+
+//Plays a frame cache back as fast as it decodes, optionally meshing every frame
+static int replay(const Options& options){
+	FrameReplay replay;
+	if (!replay.open(options.replayPath))
+	{
+		std::fprintf(stderr, "could not open frame cache %s\n", options.replayPath.c_str());
+		return 1;
+	}
+	std::printf("replaying %d frames of a %dx%dx%d grid\n", replay.frameCount(), replay.width(), replay.height(), replay.depth());
+	ThreadPool pool(options.threads - 1);
+	Mesher mesher(options.threads > 1 ? &pool : nullptr);
+	typedef std::chrono::steady_clock Clock;
+	std::vector<TRIANGLE> triangles;
+	std::size_t totalTriangles = 0;
+	const Clock::time_point start = Clock::now();
+	replay.play();
+	int shown = 0;
+	while (replay.playing())
+	{
+		if (!replay.update())
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		++shown;
+		if (options.mesh)
+		{
+			mesher.mesh(replay.latestFrame().particles, replay.width(), replay.height(), replay.depth(), triangles);
+			totalTriangles += triangles.size();
+		}
+	}
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	std::printf("%d frames in %.3f s, %.1f frames/s", shown, seconds, shown / seconds);
+	if (options.mesh)
+		std::printf(", %.0f triangles per frame", static_cast<double>(totalTriangles) / shown);
+	std::printf("\n");
+	return 0;
+}
+
+int main(int argc, char** argv){
+	Options options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (!options.replayPath.empty())
+		return replay(options);
+
+	//The calling thread takes part in parallel loops, so it counts as one of the threads
+	ThreadPool pool(options.threads - 1);
+	CFDSimulation sim(options.width, options.height, options.depth, options.solver, options.scheme);
+	if (options.threads > 1)
+		sim.setThreadPool(&pool);
+	sim.setActiveBlocksOnly(options.activeBlocksOnly);
+	if (options.restartPath.empty())
+	{
+		//Water fills the left half of the tank up to 60% of its height
+		sim.addFluidBlock(glm::ivec3(1), glm::ivec3(options.width / 2, options.height * 3 / 5, options.depth - 1));
+	}
+	else
+	{
+		if (!sim.loadCheckpoint(options.restartPath))
+		{
+			std::fprintf(stderr, "could not load checkpoint %s\n", options.restartPath.c_str());
+			return 1;
+		}
+		options.width = sim.width();
+		options.height = sim.height();
+		options.depth = sim.depth();
+	}
+
+	FrameCacheWriter cache;
+	if (!options.cachePath.empty())
+	{
+		sim.setSnapshotVelocity(options.cacheFlags != 0);
+		if (!cache.open(options.cachePath, options.width, options.height, options.depth, options.cacheFlags))
+		{
+			std::fprintf(stderr, "could not create frame cache %s\n", options.cachePath.c_str());
+			return 1;
+		}
+	}
+
+	const long long cells = static_cast<long long>(options.width) * options.height * options.depth;
+	const std::size_t particles = sim.markerParticles().size();
+	std::printf("grid %dx%dx%d (%lld cells), %zu particles, %d thread(s)\n",
+		options.width, options.height, options.depth, cells, particles, options.threads);
+	std::printf("%6s %9s %11s %14s %16s%s\n", "frame", "substeps", "ms", "Mcells/s", "Mparticles/s", options.mesh ? "  triangles  mesh ms" : "");
+
+	Mesher mesher(options.threads > 1 ? &pool : nullptr);
+	typedef std::chrono::steady_clock Clock;
+	std::vector<TRIANGLE> triangles;
+	double totalSeconds = 0.0;
+	long long totalSubsteps = 0;
+	//Checkpoints are written while the next frames run. Only one is in flight at a time, they all go to the same file.
+	std::future<bool> checkpoint;
+	auto finishCheckpoint = [&](){
+		if (checkpoint.valid() && !checkpoint.get())
+		{
+			std::fprintf(stderr, "could not write checkpoint %s\n", options.checkpointPath.c_str());
+			return false;
+		}
+		return true;
+	};
+	for (int frame = 0; frame < options.frames; ++frame)
+	{
+		PROFILE_ZONE("frame");
+		const Clock::time_point start = Clock::now();
+		const int substeps = sim.update(FRAME_TIME);
+		const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		totalSeconds += seconds;
+		totalSubsteps += substeps;
+		//Throughput counts every cell and particle once per substep
+		std::printf("%6d %9d %11.3f %14.2f %16.2f", frame, substeps, seconds * 1e3,
+			cells * substeps / seconds * 1e-6, particles * substeps / seconds * 1e-6);
+		if (options.mesh)
+		{
+			const Clock::time_point meshStart = Clock::now();
+			mesher.mesh(sim.latestFrame().particles, options.width, options.height, options.depth, triangles);
+			const double meshSeconds = std::chrono::duration<double>(Clock::now() - meshStart).count();
+			std::printf(" %10zu %9.3f", triangles.size(), meshSeconds * 1e3);
+		}
+		std::printf("\n");
+		if (cache.isOpen() && !cache.append(sim.latestFrame()))
+		{
+			std::fprintf(stderr, "could not write frame cache %s\n", options.cachePath.c_str());
+			return 1;
+		}
+		const bool lastFrame = frame + 1 == options.frames;
+		if (!options.checkpointPath.empty() && (lastFrame || (options.checkpointInterval > 0 && (frame + 1) % options.checkpointInterval == 0)))
+		{
+			if (!finishCheckpoint())
+				return 1;
+			checkpoint = sim.saveCheckpoint(options.checkpointPath);
+		}
+	}
+	if (!finishCheckpoint())
+		return 1;
+	std::printf("total %.3f s, %lld substeps, %.2f Mcells/s, %.2f Mparticles/s\n", totalSeconds, totalSubsteps,
+		cells * totalSubsteps / totalSeconds * 1e-6, particles * totalSubsteps / totalSeconds * 1e-6);
+	if (cache.isOpen())
+	{
+		const std::uint32_t cachedFrames = cache.frameCount();
+		if (!cache.close())
+		{
+			std::fprintf(stderr, "could not write frame cache %s\n", options.cachePath.c_str());
+			return 1;
+		}
+		//Compared to writing every position as 3 floats
+		const double rawBytes = static_cast<double>(particles) * 3 * sizeof(float) * cachedFrames;
+		std::printf("cache %u frames, %.2f MB, %.1f%% of raw positions\n", cachedFrames, cache.bytesWritten() * 1e-6,
+			cache.bytesWritten() * 100.0 / rawBytes);
+	}
+	if (!options.tracePath.empty())
+	{
+		if (!profiler::ENABLED)
+			std::fprintf(stderr, "profiling is compiled out, configure with -DFLUIDSIM_PROFILE=ON for --trace\n");
+		else if (!profiler::writeChromeTrace(options.tracePath))
+		{
+			std::fprintf(stderr, "could not write %s\n", options.tracePath.c_str());
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -1,10 +1,12 @@
 #ifndef _LUTS_H_
 #define _LUTS_H_
-#include <GL/glew.h>
-
 
+//Marching cubes tables, used by the CPU mesher and uploaded for the shaders. Plain ints (GLint is an int)
+//so the CPU mesher builds without OpenGL.
 namespace LUTS{
-	extern const GLint triTable[4096];
-	extern const GLint edgeTable[256];
+	//16 entries per cube index: the edges cut by each of its triangles, three at a time, ended by -1
+	extern const int triTable[4096];
+	//Bit e set for each edge e cut by the surface, per cube index
+	extern const int edgeTable[256];
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "MappedFile.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile() :mData(nullptr), mSize(0), mFile(INVALID_HANDLE_VALUE), mMapping(nullptr){}
+#else
+MappedFile::MappedFile() :mData(nullptr), mSize(0){}
+#endif
+
+MappedFile::~MappedFile(){
+	close();
+}
+
+bool MappedFile::open(const std::string& path){
+	close();
+#ifdef _WIN32
+	mFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (mFile == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(mFile, &size) || size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	mMapping = CreateFileMappingA(mFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mMapping != nullptr)
+		mData = static_cast<const unsigned char*>(MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0));
+	if (mData == nullptr)
+	{
+		close();
+		return false;
+	}
+	mSize = static_cast<std::size_t>(size.QuadPart);
+#else
+	const int descriptor = ::open(path.c_str(), O_RDONLY);
+	if (descriptor < 0)
+		return false;
+	struct stat status;
+	//Empty files can't be mapped
+	if (fstat(descriptor, &status) != 0 || status.st_size == 0)
+	{
+		::close(descriptor);
+		return false;
+	}
+	void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	//The mapping keeps the file open on its own
+	::close(descriptor);
+	if (data == MAP_FAILED)
+		return false;
+	mData = static_cast<const unsigned char*>(data);
+	mSize = static_cast<std::size_t>(status.st_size);
+#endif
+	return true;
+}
+
+void MappedFile::close(){
+#ifdef _WIN32
+	if (mData != nullptr)
+		UnmapViewOfFile(mData);
+	if (mMapping != nullptr)
+		CloseHandle(mMapping);
+	if (mFile != INVALID_HANDLE_VALUE)
+		CloseHandle(mFile);
+	mMapping = nullptr;
+	mFile = INVALID_HANDLE_VALUE;
+#else
+	if (mData != nullptr)
+		munmap(const_cast<unsigned char*>(mData), mSize);
+#endif
+	mData = nullptr;
+	mSize = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+#include <cstddef>
+#include <string>
+
+/*
+A whole file mapped read-only into memory. Pages are read from disk as they are touched, and reading the mapping
+reads the page cache directly, without copying the file into a buffer first.
+*/
+class MappedFile{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	//Maps the file at path, unmapping whatever was mapped before. Returns false if it can't be opened or mapped.
+	bool open(const std::string& path);
+	void close();
+
+	bool isOpen() const { return mData != nullptr; }
+	const unsigned char* data() const { return mData; }
+	std::size_t size() const { return mSize; }
+
+private:
+	const unsigned char* mData;
+	std::size_t mSize;
+#ifdef _WIN32
+	void* mFile;
+	void* mMapping;
+#endif
+};
+
+#endif
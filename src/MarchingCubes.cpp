@@ -1,428 +1,96 @@
 #include "MarchingCubes.h"
 #include <cmath>
+#include <limits>
+#include "LUTs.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
 
-static const int edgeTable[256] = {
-	0x0, 0x109, 0x203, 0x30a, 0x406, 0x50f, 0x605, 0x70c,
-	0x80c, 0x905, 0xa0f, 0xb06, 0xc0a, 0xd03, 0xe09, 0xf00,
-	0x190, 0x99, 0x393, 0x29a, 0x596, 0x49f, 0x795, 0x69c,
-	0x99c, 0x895, 0xb9f, 0xa96, 0xd9a, 0xc93, 0xf99, 0xe90,
-	0x230, 0x339, 0x33, 0x13a, 0x636, 0x73f, 0x435, 0x53c,
-	0xa3c, 0xb35, 0x83f, 0x936, 0xe3a, 0xf33, 0xc39, 0xd30,
-	0x3a0, 0x2a9, 0x1a3, 0xaa, 0x7a6, 0x6af, 0x5a5, 0x4ac,
-	0xbac, 0xaa5, 0x9af, 0x8a6, 0xfaa, 0xea3, 0xda9, 0xca0,
-	0x460, 0x569, 0x663, 0x76a, 0x66, 0x16f, 0x265, 0x36c,
-	0xc6c, 0xd65, 0xe6f, 0xf66, 0x86a, 0x963, 0xa69, 0xb60,
-	0x5f0, 0x4f9, 0x7f3, 0x6fa, 0x1f6, 0xff, 0x3f5, 0x2fc,
-	0xdfc, 0xcf5, 0xfff, 0xef6, 0x9fa, 0x8f3, 0xbf9, 0xaf0,
-	0x650, 0x759, 0x453, 0x55a, 0x256, 0x35f, 0x55, 0x15c,
-	0xe5c, 0xf55, 0xc5f, 0xd56, 0xa5a, 0xb53, 0x859, 0x950,
-	0x7c0, 0x6c9, 0x5c3, 0x4ca, 0x3c6, 0x2cf, 0x1c5, 0xcc,
-	0xfcc, 0xec5, 0xdcf, 0xcc6, 0xbca, 0xac3, 0x9c9, 0x8c0,
-	0x8c0, 0x9c9, 0xac3, 0xbca, 0xcc6, 0xdcf, 0xec5, 0xfcc,
-	0xcc, 0x1c5, 0x2cf, 0x3c6, 0x4ca, 0x5c3, 0x6c9, 0x7c0,
-	0x950, 0x859, 0xb53, 0xa5a, 0xd56, 0xc5f, 0xf55, 0xe5c,
-	0x15c, 0x55, 0x35f, 0x256, 0x55a, 0x453, 0x759, 0x650,
-	0xaf0, 0xbf9, 0x8f3, 0x9fa, 0xef6, 0xfff, 0xcf5, 0xdfc,
-	0x2fc, 0x3f5, 0xff, 0x1f6, 0x6fa, 0x7f3, 0x4f9, 0x5f0,
-	0xb60, 0xa69, 0x963, 0x86a, 0xf66, 0xe6f, 0xd65, 0xc6c,
-	0x36c, 0x265, 0x16f, 0x66, 0x76a, 0x663, 0x569, 0x460,
-	0xca0, 0xda9, 0xea3, 0xfaa, 0x8a6, 0x9af, 0xaa5, 0xbac,
-	0x4ac, 0x5a5, 0x6af, 0x7a6, 0xaa, 0x1a3, 0x2a9, 0x3a0,
-	0xd30, 0xc39, 0xf33, 0xe3a, 0x936, 0x83f, 0xb35, 0xa3c,
-	0x53c, 0x435, 0x73f, 0x636, 0x13a, 0x33, 0x339, 0x230,
-	0xe90, 0xf99, 0xc93, 0xd9a, 0xa96, 0xb9f, 0x895, 0x99c,
-	0x69c, 0x795, 0x49f, 0x596, 0x29a, 0x393, 0x99, 0x190,
-	0xf00, 0xe09, 0xd03, 0xc0a, 0xb06, 0xa0f, 0x905, 0x80c,
-	0x70c, 0x605, 0x50f, 0x406, 0x30a, 0x203, 0x109, 0x0 };
-
-static const int triTable[256][16] =
-{ { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 8, 3, 9, 8, 1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 3, 1, 2, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 2, 10, 0, 2, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 8, 3, 2, 10, 8, 10, 9, 8, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 11, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 11, 2, 8, 11, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 9, 0, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 11, 2, 1, 9, 11, 9, 8, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 10, 1, 11, 10, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 10, 1, 0, 8, 10, 8, 11, 10, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 9, 0, 3, 11, 9, 11, 10, 9, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 8, 10, 10, 8, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 7, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 3, 0, 7, 3, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 1, 9, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 1, 9, 4, 7, 1, 7, 3, 1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 10, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 4, 7, 3, 0, 4, 1, 2, 10, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 2, 10, 9, 0, 2, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 10, 9, 2, 9, 7, 2, 7, 3, 7, 9, 4, -1, -1, -1, -1 },
-{ 8, 4, 7, 3, 11, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 11, 4, 7, 11, 2, 4, 2, 0, 4, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 0, 1, 8, 4, 7, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 7, 11, 9, 4, 11, 9, 11, 2, 9, 2, 1, -1, -1, -1, -1 },
-{ 3, 10, 1, 3, 11, 10, 7, 8, 4, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 11, 10, 1, 4, 11, 1, 0, 4, 7, 11, 4, -1, -1, -1, -1 },
-{ 4, 7, 8, 9, 0, 11, 9, 11, 10, 11, 0, 3, -1, -1, -1, -1 },
-{ 4, 7, 11, 4, 11, 9, 9, 11, 10, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 5, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 5, 4, 0, 8, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 5, 4, 1, 5, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 5, 4, 8, 3, 5, 3, 1, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 10, 9, 5, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 0, 8, 1, 2, 10, 4, 9, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 2, 10, 5, 4, 2, 4, 0, 2, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 10, 5, 3, 2, 5, 3, 5, 4, 3, 4, 8, -1, -1, -1, -1 },
-{ 9, 5, 4, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 11, 2, 0, 8, 11, 4, 9, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 5, 4, 0, 1, 5, 2, 3, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 1, 5, 2, 5, 8, 2, 8, 11, 4, 8, 5, -1, -1, -1, -1 },
-{ 10, 3, 11, 10, 1, 3, 9, 5, 4, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 9, 5, 0, 8, 1, 8, 10, 1, 8, 11, 10, -1, -1, -1, -1 },
-{ 5, 4, 0, 5, 0, 11, 5, 11, 10, 11, 0, 3, -1, -1, -1, -1 },
-{ 5, 4, 8, 5, 8, 10, 10, 8, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 7, 8, 5, 7, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 3, 0, 9, 5, 3, 5, 7, 3, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 7, 8, 0, 1, 7, 1, 5, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 5, 3, 3, 5, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 7, 8, 9, 5, 7, 10, 1, 2, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 1, 2, 9, 5, 0, 5, 3, 0, 5, 7, 3, -1, -1, -1, -1 },
-{ 8, 0, 2, 8, 2, 5, 8, 5, 7, 10, 5, 2, -1, -1, -1, -1 },
-{ 2, 10, 5, 2, 5, 3, 3, 5, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 7, 9, 5, 7, 8, 9, 3, 11, 2, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 5, 7, 9, 7, 2, 9, 2, 0, 2, 7, 11, -1, -1, -1, -1 },
-{ 2, 3, 11, 0, 1, 8, 1, 7, 8, 1, 5, 7, -1, -1, -1, -1 },
-{ 11, 2, 1, 11, 1, 7, 7, 1, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 5, 8, 8, 5, 7, 10, 1, 3, 10, 3, 11, -1, -1, -1, -1 },
-{ 5, 7, 0, 5, 0, 9, 7, 11, 0, 1, 0, 10, 11, 10, 0, -1 },
-{ 11, 10, 0, 11, 0, 3, 10, 5, 0, 8, 0, 7, 5, 7, 0, -1 },
-{ 11, 10, 5, 7, 11, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 6, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 3, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 0, 1, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 8, 3, 1, 9, 8, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 6, 5, 2, 6, 1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 6, 5, 1, 2, 6, 3, 0, 8, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 6, 5, 9, 0, 6, 0, 2, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 9, 8, 5, 8, 2, 5, 2, 6, 3, 2, 8, -1, -1, -1, -1 },
-{ 2, 3, 11, 10, 6, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 11, 0, 8, 11, 2, 0, 10, 6, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 1, 9, 2, 3, 11, 5, 10, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 10, 6, 1, 9, 2, 9, 11, 2, 9, 8, 11, -1, -1, -1, -1 },
-{ 6, 3, 11, 6, 5, 3, 5, 1, 3, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 11, 0, 11, 5, 0, 5, 1, 5, 11, 6, -1, -1, -1, -1 },
-{ 3, 11, 6, 0, 3, 6, 0, 6, 5, 0, 5, 9, -1, -1, -1, -1 },
-{ 6, 5, 9, 6, 9, 11, 11, 9, 8, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 10, 6, 4, 7, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 3, 0, 4, 7, 3, 6, 5, 10, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 9, 0, 5, 10, 6, 8, 4, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 6, 5, 1, 9, 7, 1, 7, 3, 7, 9, 4, -1, -1, -1, -1 },
-{ 6, 1, 2, 6, 5, 1, 4, 7, 8, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 5, 5, 2, 6, 3, 0, 4, 3, 4, 7, -1, -1, -1, -1 },
-{ 8, 4, 7, 9, 0, 5, 0, 6, 5, 0, 2, 6, -1, -1, -1, -1 },
-{ 7, 3, 9, 7, 9, 4, 3, 2, 9, 5, 9, 6, 2, 6, 9, -1 },
-{ 3, 11, 2, 7, 8, 4, 10, 6, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 10, 6, 4, 7, 2, 4, 2, 0, 2, 7, 11, -1, -1, -1, -1 },
-{ 0, 1, 9, 4, 7, 8, 2, 3, 11, 5, 10, 6, -1, -1, -1, -1 },
-{ 9, 2, 1, 9, 11, 2, 9, 4, 11, 7, 11, 4, 5, 10, 6, -1 },
-{ 8, 4, 7, 3, 11, 5, 3, 5, 1, 5, 11, 6, -1, -1, -1, -1 },
-{ 5, 1, 11, 5, 11, 6, 1, 0, 11, 7, 11, 4, 0, 4, 11, -1 },
-{ 0, 5, 9, 0, 6, 5, 0, 3, 6, 11, 6, 3, 8, 4, 7, -1 },
-{ 6, 5, 9, 6, 9, 11, 4, 7, 9, 7, 11, 9, -1, -1, -1, -1 },
-{ 10, 4, 9, 6, 4, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 10, 6, 4, 9, 10, 0, 8, 3, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 0, 1, 10, 6, 0, 6, 4, 0, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 3, 1, 8, 1, 6, 8, 6, 4, 6, 1, 10, -1, -1, -1, -1 },
-{ 1, 4, 9, 1, 2, 4, 2, 6, 4, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 0, 8, 1, 2, 9, 2, 4, 9, 2, 6, 4, -1, -1, -1, -1 },
-{ 0, 2, 4, 4, 2, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 3, 2, 8, 2, 4, 4, 2, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 4, 9, 10, 6, 4, 11, 2, 3, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 2, 2, 8, 11, 4, 9, 10, 4, 10, 6, -1, -1, -1, -1 },
-{ 3, 11, 2, 0, 1, 6, 0, 6, 4, 6, 1, 10, -1, -1, -1, -1 },
-{ 6, 4, 1, 6, 1, 10, 4, 8, 1, 2, 1, 11, 8, 11, 1, -1 },
-{ 9, 6, 4, 9, 3, 6, 9, 1, 3, 11, 6, 3, -1, -1, -1, -1 },
-{ 8, 11, 1, 8, 1, 0, 11, 6, 1, 9, 1, 4, 6, 4, 1, -1 },
-{ 3, 11, 6, 3, 6, 0, 0, 6, 4, -1, -1, -1, -1, -1, -1, -1 },
-{ 6, 4, 8, 11, 6, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 7, 10, 6, 7, 8, 10, 8, 9, 10, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 7, 3, 0, 10, 7, 0, 9, 10, 6, 7, 10, -1, -1, -1, -1 },
-{ 10, 6, 7, 1, 10, 7, 1, 7, 8, 1, 8, 0, -1, -1, -1, -1 },
-{ 10, 6, 7, 10, 7, 1, 1, 7, 3, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 6, 1, 6, 8, 1, 8, 9, 8, 6, 7, -1, -1, -1, -1 },
-{ 2, 6, 9, 2, 9, 1, 6, 7, 9, 0, 9, 3, 7, 3, 9, -1 },
-{ 7, 8, 0, 7, 0, 6, 6, 0, 2, -1, -1, -1, -1, -1, -1, -1 },
-{ 7, 3, 2, 6, 7, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 3, 11, 10, 6, 8, 10, 8, 9, 8, 6, 7, -1, -1, -1, -1 },
-{ 2, 0, 7, 2, 7, 11, 0, 9, 7, 6, 7, 10, 9, 10, 7, -1 },
-{ 1, 8, 0, 1, 7, 8, 1, 10, 7, 6, 7, 10, 2, 3, 11, -1 },
-{ 11, 2, 1, 11, 1, 7, 10, 6, 1, 6, 7, 1, -1, -1, -1, -1 },
-{ 8, 9, 6, 8, 6, 7, 9, 1, 6, 11, 6, 3, 1, 3, 6, -1 },
-{ 0, 9, 1, 11, 6, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 7, 8, 0, 7, 0, 6, 3, 11, 0, 11, 6, 0, -1, -1, -1, -1 },
-{ 7, 11, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 7, 6, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 0, 8, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 1, 9, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 1, 9, 8, 3, 1, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 1, 2, 6, 11, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 10, 3, 0, 8, 6, 11, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 9, 0, 2, 10, 9, 6, 11, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 6, 11, 7, 2, 10, 3, 10, 8, 3, 10, 9, 8, -1, -1, -1, -1 },
-{ 7, 2, 3, 6, 2, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 7, 0, 8, 7, 6, 0, 6, 2, 0, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 7, 6, 2, 3, 7, 0, 1, 9, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 6, 2, 1, 8, 6, 1, 9, 8, 8, 7, 6, -1, -1, -1, -1 },
-{ 10, 7, 6, 10, 1, 7, 1, 3, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 7, 6, 1, 7, 10, 1, 8, 7, 1, 0, 8, -1, -1, -1, -1 },
-{ 0, 3, 7, 0, 7, 10, 0, 10, 9, 6, 10, 7, -1, -1, -1, -1 },
-{ 7, 6, 10, 7, 10, 8, 8, 10, 9, -1, -1, -1, -1, -1, -1, -1 },
-{ 6, 8, 4, 11, 8, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 6, 11, 3, 0, 6, 0, 4, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 6, 11, 8, 4, 6, 9, 0, 1, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 4, 6, 9, 6, 3, 9, 3, 1, 11, 3, 6, -1, -1, -1, -1 },
-{ 6, 8, 4, 6, 11, 8, 2, 10, 1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 10, 3, 0, 11, 0, 6, 11, 0, 4, 6, -1, -1, -1, -1 },
-{ 4, 11, 8, 4, 6, 11, 0, 2, 9, 2, 10, 9, -1, -1, -1, -1 },
-{ 10, 9, 3, 10, 3, 2, 9, 4, 3, 11, 3, 6, 4, 6, 3, -1 },
-{ 8, 2, 3, 8, 4, 2, 4, 6, 2, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 4, 2, 4, 6, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 9, 0, 2, 3, 4, 2, 4, 6, 4, 3, 8, -1, -1, -1, -1 },
-{ 1, 9, 4, 1, 4, 2, 2, 4, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 1, 3, 8, 6, 1, 8, 4, 6, 6, 10, 1, -1, -1, -1, -1 },
-{ 10, 1, 0, 10, 0, 6, 6, 0, 4, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 6, 3, 4, 3, 8, 6, 10, 3, 0, 3, 9, 10, 9, 3, -1 },
-{ 10, 9, 4, 6, 10, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 9, 5, 7, 6, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 3, 4, 9, 5, 11, 7, 6, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 0, 1, 5, 4, 0, 7, 6, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 11, 7, 6, 8, 3, 4, 3, 5, 4, 3, 1, 5, -1, -1, -1, -1 },
-{ 9, 5, 4, 10, 1, 2, 7, 6, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 6, 11, 7, 1, 2, 10, 0, 8, 3, 4, 9, 5, -1, -1, -1, -1 },
-{ 7, 6, 11, 5, 4, 10, 4, 2, 10, 4, 0, 2, -1, -1, -1, -1 },
-{ 3, 4, 8, 3, 5, 4, 3, 2, 5, 10, 5, 2, 11, 7, 6, -1 },
-{ 7, 2, 3, 7, 6, 2, 5, 4, 9, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 5, 4, 0, 8, 6, 0, 6, 2, 6, 8, 7, -1, -1, -1, -1 },
-{ 3, 6, 2, 3, 7, 6, 1, 5, 0, 5, 4, 0, -1, -1, -1, -1 },
-{ 6, 2, 8, 6, 8, 7, 2, 1, 8, 4, 8, 5, 1, 5, 8, -1 },
-{ 9, 5, 4, 10, 1, 6, 1, 7, 6, 1, 3, 7, -1, -1, -1, -1 },
-{ 1, 6, 10, 1, 7, 6, 1, 0, 7, 8, 7, 0, 9, 5, 4, -1 },
-{ 4, 0, 10, 4, 10, 5, 0, 3, 10, 6, 10, 7, 3, 7, 10, -1 },
-{ 7, 6, 10, 7, 10, 8, 5, 4, 10, 4, 8, 10, -1, -1, -1, -1 },
-{ 6, 9, 5, 6, 11, 9, 11, 8, 9, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 6, 11, 0, 6, 3, 0, 5, 6, 0, 9, 5, -1, -1, -1, -1 },
-{ 0, 11, 8, 0, 5, 11, 0, 1, 5, 5, 6, 11, -1, -1, -1, -1 },
-{ 6, 11, 3, 6, 3, 5, 5, 3, 1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 10, 9, 5, 11, 9, 11, 8, 11, 5, 6, -1, -1, -1, -1 },
-{ 0, 11, 3, 0, 6, 11, 0, 9, 6, 5, 6, 9, 1, 2, 10, -1 },
-{ 11, 8, 5, 11, 5, 6, 8, 0, 5, 10, 5, 2, 0, 2, 5, -1 },
-{ 6, 11, 3, 6, 3, 5, 2, 10, 3, 10, 5, 3, -1, -1, -1, -1 },
-{ 5, 8, 9, 5, 2, 8, 5, 6, 2, 3, 8, 2, -1, -1, -1, -1 },
-{ 9, 5, 6, 9, 6, 0, 0, 6, 2, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 5, 8, 1, 8, 0, 5, 6, 8, 3, 8, 2, 6, 2, 8, -1 },
-{ 1, 5, 6, 2, 1, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 3, 6, 1, 6, 10, 3, 8, 6, 5, 6, 9, 8, 9, 6, -1 },
-{ 10, 1, 0, 10, 0, 6, 9, 5, 0, 5, 6, 0, -1, -1, -1, -1 },
-{ 0, 3, 8, 5, 6, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 5, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 11, 5, 10, 7, 5, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 11, 5, 10, 11, 7, 5, 8, 3, 0, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 11, 7, 5, 10, 11, 1, 9, 0, -1, -1, -1, -1, -1, -1, -1 },
-{ 10, 7, 5, 10, 11, 7, 9, 8, 1, 8, 3, 1, -1, -1, -1, -1 },
-{ 11, 1, 2, 11, 7, 1, 7, 5, 1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 3, 1, 2, 7, 1, 7, 5, 7, 2, 11, -1, -1, -1, -1 },
-{ 9, 7, 5, 9, 2, 7, 9, 0, 2, 2, 11, 7, -1, -1, -1, -1 },
-{ 7, 5, 2, 7, 2, 11, 5, 9, 2, 3, 2, 8, 9, 8, 2, -1 },
-{ 2, 5, 10, 2, 3, 5, 3, 7, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 2, 0, 8, 5, 2, 8, 7, 5, 10, 2, 5, -1, -1, -1, -1 },
-{ 9, 0, 1, 5, 10, 3, 5, 3, 7, 3, 10, 2, -1, -1, -1, -1 },
-{ 9, 8, 2, 9, 2, 1, 8, 7, 2, 10, 2, 5, 7, 5, 2, -1 },
-{ 1, 3, 5, 3, 7, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 7, 0, 7, 1, 1, 7, 5, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 0, 3, 9, 3, 5, 5, 3, 7, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 8, 7, 5, 9, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 8, 4, 5, 10, 8, 10, 11, 8, -1, -1, -1, -1, -1, -1, -1 },
-{ 5, 0, 4, 5, 11, 0, 5, 10, 11, 11, 3, 0, -1, -1, -1, -1 },
-{ 0, 1, 9, 8, 4, 10, 8, 10, 11, 10, 4, 5, -1, -1, -1, -1 },
-{ 10, 11, 4, 10, 4, 5, 11, 3, 4, 9, 4, 1, 3, 1, 4, -1 },
-{ 2, 5, 1, 2, 8, 5, 2, 11, 8, 4, 5, 8, -1, -1, -1, -1 },
-{ 0, 4, 11, 0, 11, 3, 4, 5, 11, 2, 11, 1, 5, 1, 11, -1 },
-{ 0, 2, 5, 0, 5, 9, 2, 11, 5, 4, 5, 8, 11, 8, 5, -1 },
-{ 9, 4, 5, 2, 11, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 5, 10, 3, 5, 2, 3, 4, 5, 3, 8, 4, -1, -1, -1, -1 },
-{ 5, 10, 2, 5, 2, 4, 4, 2, 0, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 10, 2, 3, 5, 10, 3, 8, 5, 4, 5, 8, 0, 1, 9, -1 },
-{ 5, 10, 2, 5, 2, 4, 1, 9, 2, 9, 4, 2, -1, -1, -1, -1 },
-{ 8, 4, 5, 8, 5, 3, 3, 5, 1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 4, 5, 1, 0, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 8, 4, 5, 8, 5, 3, 9, 0, 5, 0, 3, 5, -1, -1, -1, -1 },
-{ 9, 4, 5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 11, 7, 4, 9, 11, 9, 10, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 8, 3, 4, 9, 7, 9, 11, 7, 9, 10, 11, -1, -1, -1, -1 },
-{ 1, 10, 11, 1, 11, 4, 1, 4, 0, 7, 4, 11, -1, -1, -1, -1 },
-{ 3, 1, 4, 3, 4, 8, 1, 10, 4, 7, 4, 11, 10, 11, 4, -1 },
-{ 4, 11, 7, 9, 11, 4, 9, 2, 11, 9, 1, 2, -1, -1, -1, -1 },
-{ 9, 7, 4, 9, 11, 7, 9, 1, 11, 2, 11, 1, 0, 8, 3, -1 },
-{ 11, 7, 4, 11, 4, 2, 2, 4, 0, -1, -1, -1, -1, -1, -1, -1 },
-{ 11, 7, 4, 11, 4, 2, 8, 3, 4, 3, 2, 4, -1, -1, -1, -1 },
-{ 2, 9, 10, 2, 7, 9, 2, 3, 7, 7, 4, 9, -1, -1, -1, -1 },
-{ 9, 10, 7, 9, 7, 4, 10, 2, 7, 8, 7, 0, 2, 0, 7, -1 },
-{ 3, 7, 10, 3, 10, 2, 7, 4, 10, 1, 10, 0, 4, 0, 10, -1 },
-{ 1, 10, 2, 8, 7, 4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 9, 1, 4, 1, 7, 7, 1, 3, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 9, 1, 4, 1, 7, 0, 8, 1, 8, 7, 1, -1, -1, -1, -1 },
-{ 4, 0, 3, 7, 4, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 4, 8, 7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 10, 8, 10, 11, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 0, 9, 3, 9, 11, 11, 9, 10, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 1, 10, 0, 10, 8, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 1, 10, 11, 3, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 2, 11, 1, 11, 9, 9, 11, 8, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 0, 9, 3, 9, 11, 1, 2, 9, 2, 11, 9, -1, -1, -1, -1 },
-{ 0, 2, 11, 8, 0, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 3, 2, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 3, 8, 2, 8, 10, 10, 8, 9, -1, -1, -1, -1, -1, -1, -1 },
-{ 9, 10, 2, 0, 9, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 2, 3, 8, 2, 8, 10, 0, 1, 8, 1, 10, 8, -1, -1, -1, -1 },
-{ 1, 10, 2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 1, 3, 8, 9, 1, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 9, 1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ 0, 3, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
-{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 } };
-
-const float BLOB_RADIUS = 1.0f;
-const float BLOB_RADIUS_SQUARED = 1.0f;
-const float VOXEL_SIZE = 1.0f;
 
+//Corners at the ends of each edge of a cell
+static const int EDGE_CORNERS[12][2] = {
+	{ 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 },
+	{ 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 4 },
+	{ 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 } };
+//Most triangles a cell can hold, each one is written as two TRIANGLEs
+const int MAX_CELL_FACETS = 5;
 
+/*
+Determine the index into the edge table which
+tells us which vertices are inside of the surface
+grid.val is the value of the scalar field for all 8 corners
+*/
+static inline int cubeIndex(const double* val, double isolevel){
+	int cubeindex = 0;
+	for (int corner = 0; corner < 8; ++corner)
+		if (val[corner] < isolevel) cubeindex |= 1 << corner;
+	return cubeindex;
+}
 
 /*
-Given a grid cell and an isolevel, calculate the triangular
-facets required to represent the isosurface through the cell.
-Return the number of triangular facets, the array "triangles"
-will be loaded up with the vertices at most 5 triangular facets.
-0 will be returned if the grid cell is either totally above
-of totally below the isolevel.
+Polygonises one cell. gradient(p) gives the gradient of the field at corner p, which is interpolated along the edges
+like the positions to give the normals. Writes two TRIANGLEs per facet to out, the first holding the first
+vertex, its normal and the second vertex, the second holding the second normal, the third vertex and its normal.
+Returns the number of facets, at most MAX_CELL_FACETS.
 */
-int Polygonise(std::unordered_map<glm::vec3, double, vec3Hash>& isoSurface, GRIDCELL& grid, double isolevel, std::vector<TRIANGLE> &triangles)
-{
-	int i, ntriang;
-	int cubeindex;
+template <typename Gradient>
+static int polygoniseCell(const GRIDCELL& grid, double isolevel, const Gradient& gradient, TRIANGLE* out){
 	glm::vec3 vertlist[12];
 	glm::vec3 normList[12];
-	
-
-	/*
-	Determine the index into the edge table which
-	tells us which vertices are inside of the surface
-	grid.val is the value of the scalar field for all 8 corners
-	*/
-	cubeindex = 0;
-	if (grid.val[0] < isolevel) cubeindex |= 1;
-	if (grid.val[1] < isolevel) cubeindex |= 2;
-	if (grid.val[2] < isolevel) cubeindex |= 4;
-	if (grid.val[3] < isolevel) cubeindex |= 8;
-	if (grid.val[4] < isolevel) cubeindex |= 16;
-	if (grid.val[5] < isolevel) cubeindex |= 32;
-	if (grid.val[6] < isolevel) cubeindex |= 64;
-	if (grid.val[7] < isolevel) cubeindex |= 128;
+	const int cubeindex = cubeIndex(grid.val, isolevel);
 
 	/* Cube is entirely in/out of the surface */
-	if (edgeTable[cubeindex] == 0)
+	const int edges = LUTS::edgeTable[cubeindex];
+	if (edges == 0)
 		return(0);
 
 	/* Find the vertices where the surface intersects the cube */
-	if (edgeTable[cubeindex] & 1)
-	{
-		vertlist[0] =
-			VertexInterp(isolevel, grid.p[0], grid.p[1], grid.val[0], grid.val[1]);
-		normList[0] = VertexInterp(isolevel, gradient(isoSurface, grid.p[0]), gradient(isoSurface, grid.p[1]), grid.val[0], grid.val[1]);
-	}
-	if (edgeTable[cubeindex] & 2)
-	{
-		vertlist[1] =
-			VertexInterp(isolevel, grid.p[1], grid.p[2], grid.val[1], grid.val[2]);
-		normList[1] = VertexInterp(isolevel, gradient(isoSurface, grid.p[1]), gradient(isoSurface, grid.p[2]), grid.val[1], grid.val[2]);
-	}
-	if (edgeTable[cubeindex] & 4)
-	{
-		vertlist[2] =
-			VertexInterp(isolevel, grid.p[2], grid.p[3], grid.val[2], grid.val[3]);
-		normList[2] = VertexInterp(isolevel, gradient(isoSurface, grid.p[2]), gradient(isoSurface, grid.p[3]), grid.val[2], grid.val[3]);
-	}
-	if (edgeTable[cubeindex] & 8)
-	{
-		vertlist[3] =
-			VertexInterp(isolevel, grid.p[3], grid.p[0], grid.val[3], grid.val[0]);
-		normList[3] = VertexInterp(isolevel, gradient(isoSurface, grid.p[3]), gradient(isoSurface, grid.p[0]), grid.val[3], grid.val[0]);
-	}
-	if (edgeTable[cubeindex] & 16)
-	{
-		vertlist[4] =
-			VertexInterp(isolevel, grid.p[4], grid.p[5], grid.val[4], grid.val[5]);
-		normList[4] = VertexInterp(isolevel, gradient(isoSurface, grid.p[4]), gradient(isoSurface, grid.p[5]), grid.val[4], grid.val[5]);
-	}
-	if (edgeTable[cubeindex] & 32)
-	{
-		vertlist[5] =
-			VertexInterp(isolevel, grid.p[5], grid.p[6], grid.val[5], grid.val[6]);
-		normList[5] = VertexInterp(isolevel, gradient(isoSurface, grid.p[5]), gradient(isoSurface, grid.p[6]), grid.val[5], grid.val[6]);
-	}
-	if (edgeTable[cubeindex] & 64)
-	{
-		vertlist[6] =
-			VertexInterp(isolevel, grid.p[6], grid.p[7], grid.val[6], grid.val[7]);
-		normList[6] = VertexInterp(isolevel, gradient(isoSurface, grid.p[6]), gradient(isoSurface, grid.p[7]), grid.val[6], grid.val[7]);
-	}
-	if (edgeTable[cubeindex] & 128)
-	{
-		vertlist[7] =
-			VertexInterp(isolevel, grid.p[7], grid.p[4], grid.val[7], grid.val[4]);
-		normList[7] = VertexInterp(isolevel, gradient(isoSurface, grid.p[7]), gradient(isoSurface, grid.p[4]), grid.val[7], grid.val[4]);
-	}
-	if (edgeTable[cubeindex] & 256)
-	{
-		vertlist[8] =
-			VertexInterp(isolevel, grid.p[0], grid.p[4], grid.val[0], grid.val[4]);
-		normList[8] = VertexInterp(isolevel, gradient(isoSurface, grid.p[0]), gradient(isoSurface, grid.p[4]), grid.val[0], grid.val[4]);
-	}
-	if (edgeTable[cubeindex] & 512)
-	{
-		vertlist[9] =
-			VertexInterp(isolevel, grid.p[1], grid.p[5], grid.val[1], grid.val[5]);
-		normList[9] = VertexInterp(isolevel, gradient(isoSurface, grid.p[1]), gradient(isoSurface, grid.p[5]), grid.val[1], grid.val[5]);
-	}
-	if (edgeTable[cubeindex] & 1024)
-	{
-		vertlist[10] =
-			VertexInterp(isolevel, grid.p[2], grid.p[6], grid.val[2], grid.val[6]);
-		normList[10] = VertexInterp(isolevel, gradient(isoSurface, grid.p[2]), gradient(isoSurface, grid.p[6]), grid.val[2], grid.val[6]);
-	}
-	if (edgeTable[cubeindex] & 2048)
-	{
-		vertlist[11] =
-			VertexInterp(isolevel, grid.p[3], grid.p[7], grid.val[3], grid.val[7]);
-		normList[11] = VertexInterp(isolevel, gradient(isoSurface, grid.p[3]), gradient(isoSurface, grid.p[7]), grid.val[3], grid.val[7]);
-	}
+	//Gradients are worked out once for each corner on a cut edge
+	glm::vec3 gradients[8];
+	int corners = 0;
+	for (int edge = 0; edge < 12; ++edge)
+		if (edges & (1 << edge))
+			corners |= (1 << EDGE_CORNERS[edge][0]) | (1 << EDGE_CORNERS[edge][1]);
+	for (int corner = 0; corner < 8; ++corner)
+		if (corners & (1 << corner))
+			gradients[corner] = gradient(grid.p[corner]);
+	for (int edge = 0; edge < 12; ++edge)
+		if (edges & (1 << edge))
+		{
+			const int a = EDGE_CORNERS[edge][0], b = EDGE_CORNERS[edge][1];
+			vertlist[edge] = VertexInterp(isolevel, grid.p[a], grid.p[b], grid.val[a], grid.val[b]);
+			normList[edge] = VertexInterp(isolevel, gradients[a], gradients[b], grid.val[a], grid.val[b]);
+		}
 
 	/* Create the triangle */
-	ntriang = 0;
-	for (i = 0; triTable[cubeindex][i] != -1; i += 3) {
-		TRIANGLE triangle, triangle2;
-		triangle.p[0] = vertlist[triTable[cubeindex][i]];
-		triangle.p[1] = normList[triTable[cubeindex][i]];
-		triangle.p[2] = vertlist[triTable[cubeindex][i + 1]];
-		triangle2.p[0] = normList[triTable[cubeindex][i + 1]];
-		triangle2.p[1] = vertlist[triTable[cubeindex][i + 2]];
-		triangle2.p[2] = normList[triTable[cubeindex][i + 2]];
-		triangles.push_back(triangle);
-		triangles.push_back(triangle2);
+	const int* facets = LUTS::triTable + 16 * cubeindex;
+	int ntriang = 0;
+	for (int i = 0; facets[i] != -1; i += 3) {
+		out->p[0] = vertlist[facets[i]];
+		out->p[1] = normList[facets[i]];
+		out->p[2] = vertlist[facets[i + 1]];
+		++out;
+		out->p[0] = normList[facets[i + 1]];
+		out->p[1] = vertlist[facets[i + 2]];
+		out->p[2] = normList[facets[i + 2]];
+		++out;
 		ntriang++;
 	}
+	return(ntriang);
+}
 
+/*
+Given a grid cell and an isolevel, calculate the triangular
+facets required to represent the isosurface through the cell.
+Return the number of triangular facets, the array "triangles"
+will be loaded up with the vertices at most 5 triangular facets.
+0 will be returned if the grid cell is either totally above
+of totally below the isolevel.
+*/
+int Polygonise(const DensityField& isoSurface, GRIDCELL& grid, double isolevel, std::vector<TRIANGLE> &triangles)
+{
+	TRIANGLE cellTriangles[2 * MAX_CELL_FACETS];
+	const int ntriang = polygoniseCell(grid, isolevel, [&](const glm::vec3& p){ return gradient(isoSurface, p); }, cellTriangles);
+	triangles.insert(triangles.end(), cellTriangles, cellTriangles + 2 * ntriang);
 	return(ntriang);
 }
 
@@ -449,102 +117,191 @@ glm::vec3 VertexInterp(double isolevel, glm::vec3 p1, glm::vec3 p2, double valp1
 	return(p);
 }
 
+//Adds the blob of particle to the density at integer point (x, y, z)
+static inline void setFieldValue(DensityField& field, const glm::vec3& particle, float radiusSquared, int x, int y, int z){
+	const glm::vec3 point(x, y, z);
+	double distance = (pow(point.x - particle.x, 2) + pow(point.y - particle.y, 2) + pow(point.z - particle.z, 2));
+	if (distance > radiusSquared) return;
+	field.values(x - field.origin.x, y - field.origin.y, z - field.origin.z) += pow(1 - distance, 2);
+}
+
+static inline void setGridCellValue(const DensityField& field, GRIDCELL& cell, int index, int x, int y, int z){
+	cell.p[index] = glm::vec3(x, y, z);
+	cell.val[index] = field.values(x - field.origin.x, y - field.origin.y, z - field.origin.z);
+}
+
+/*
+The density is sampled at integer points only, one voxel per unit. It lives in a dense grid over the bounding box
+of the blobs, so a point is found by indexing rather than hashing, and every cell of the box can be read directly.
+*/
 void genField(const std::vector<glm::vec3>& particles, float radius, std::vector<TRIANGLE>& triangles){
-	std::unordered_map<glm::vec3, double, vec3Hash> grid;
-	int lowestX = 100000, highestX = 0, lowestY = 100000, highestY = 0, lowestZ = 1000000, highestZ = 0;
-	for (auto it = particles.begin(); it != particles.end(); ++it){
-		glm::vec3 p = (*it);
-		int lowerX = floor(p.x - BLOB_RADIUS);
-		int higherX = ceil(p.x + BLOB_RADIUS);
-		int lowerY = floor(p.y - BLOB_RADIUS);
-		int higherY = ceil(p.y + BLOB_RADIUS);
-		int lowerZ = floor(p.z - BLOB_RADIUS);
-		int higherZ = ceil(p.z + BLOB_RADIUS);
-		glm::vec3 point;
-		for (float x = lowerX; x <= higherX; x += VOXEL_SIZE){
-			point.x = x;
-			for (float y = lowerY; y <= higherY; y += VOXEL_SIZE){
-				point.y = y;
-				for (float z = lowerZ; z <= higherZ; z += VOXEL_SIZE){
-					point.z = z;
-					setFieldValue(grid, p, point);
+	PROFILE_ZONE("genField");
+	if (particles.empty())
+		return;
+	const float radiusSquared = radius * radius;
+	glm::ivec3 lowest(std::numeric_limits<int>::max()), highest(std::numeric_limits<int>::min());
+	for (const glm::vec3& p : particles)
+	{
+		lowest = glm::min(lowest, glm::ivec3(glm::floor(p - radius)));
+		highest = glm::max(highest, glm::ivec3(glm::ceil(p + radius)));
+	}
+	DensityField field;
+	field.origin = lowest;
+	field.values.resize(highest.x - lowest.x + 1, highest.y - lowest.y + 1, highest.z - lowest.z + 1, 0.0);
 
-				}
-			}
-		}
-		if (lowerX < lowestX) lowestX = lowerX;
-		if (higherX > highestX) highestX = higherX;
-		if (lowerY < lowestY) lowestY = lowerY;
-		if (higherY > highestY) highestY = higherY;
-		if (lowerZ < lowestZ) lowestZ = lowerZ;
-		if (higherZ > highestZ) highestZ = higherZ;
+	//Blobs are added in particle order so the sums come out the same whatever the storage
+	for (const glm::vec3& p : particles)
+	{
+		const glm::ivec3 lower(glm::floor(p - radius));
+		const glm::ivec3 higher(glm::ceil(p + radius));
+		for (int x = lower.x; x <= higher.x; ++x)
+			for (int y = lower.y; y <= higher.y; ++y)
+				for (int z = lower.z; z <= higher.z; ++z)
+					setFieldValue(field, p, radiusSquared, x, y, z);
 	}
-	for (float x = lowestX; x < highestX; x += VOXEL_SIZE)
-		for (float y = lowestY; y < highestY; y += VOXEL_SIZE)
-			for (float z = lowestZ; z < highestZ; z += VOXEL_SIZE){
+
+	for (int x = lowest.x; x < highest.x; ++x)
+		for (int y = lowest.y; y < highest.y; ++y)
+			for (int z = lowest.z; z < highest.z; ++z){
 				GRIDCELL cell;
-				setGridCellValue(grid, cell, 0, x, y, z + VOXEL_SIZE);
-				setGridCellValue(grid, cell, 1, x + VOXEL_SIZE, y, z + VOXEL_SIZE);
-				setGridCellValue(grid, cell, 2, x + VOXEL_SIZE, y, z);
-				setGridCellValue(grid, cell, 3, x, y, z);
-				setGridCellValue(grid, cell, 4, x, y + VOXEL_SIZE, z + VOXEL_SIZE);
-				setGridCellValue(grid, cell, 5, x + VOXEL_SIZE, y + VOXEL_SIZE, z + VOXEL_SIZE);
-				setGridCellValue(grid, cell, 6, x + VOXEL_SIZE, y + VOXEL_SIZE, z);
-				setGridCellValue(grid, cell, 7, x, y + VOXEL_SIZE, z);
-				Polygonise(grid,cell, 0.0001, triangles);
+				setGridCellValue(field, cell, 0, x, y, z + 1);
+				setGridCellValue(field, cell, 1, x + 1, y, z + 1);
+				setGridCellValue(field, cell, 2, x + 1, y, z);
+				setGridCellValue(field, cell, 3, x, y, z);
+				setGridCellValue(field, cell, 4, x, y + 1, z + 1);
+				setGridCellValue(field, cell, 5, x + 1, y + 1, z + 1);
+				setGridCellValue(field, cell, 6, x + 1, y + 1, z);
+				setGridCellValue(field, cell, 7, x, y + 1, z);
+				Polygonise(field, cell, 0.0001, triangles);
 			}
-	int i = 0;
 }
 
-inline void setFieldValue(std::unordered_map<glm::vec3, double, vec3Hash>& grid, glm::vec3& particle, glm::vec3& point){
-	double distance = (pow(point.x - particle.x, 2) + pow(point.y - particle.y, 2) + pow(point.z - particle.z, 2));
-	if (distance > BLOB_RADIUS_SQUARED) return;
-	double value = pow(1 - distance, 2);
-	std::pair<std::unordered_map<glm::vec3, double, vec3Hash>::iterator, bool> ret = grid.insert(std::pair<glm::vec3, double>(point, value));
-	if (!ret.second)
-		(*ret.first).second += value;
-
+//Central difference of the density at grid point p, the same as sampling it half a voxel to either side
+glm::vec3 gradient(const DensityField& field, const glm::vec3& p){
+	const int x = static_cast<int>(p.x), y = static_cast<int>(p.y), z = static_cast<int>(p.z);
+	glm::vec3 grad;
+	grad.x = 0.5 * (field.at(x + 1, y, z) - field.at(x - 1, y, z));
+	grad.y = 0.5 * (field.at(x, y + 1, z) - field.at(x, y - 1, z));
+	grad.z = 0.5 * (field.at(x, y, z + 1) - field.at(x, y, z - 1));
+	return grad;
 }
 
+//Number of facets the triangle table holds for a cube index
+static inline int facetCount(int cubeindex){
+	int facets = 0;
+	for (const int* edge = LUTS::triTable + 16 * cubeindex; *edge != -1; edge += 3)
+		++facets;
+	return facets;
+}
 
+//Value at the corner of cell (x, y, z) numbered corner, in the order GRIDCELL uses
+static inline float cornerValue(const Grid3D<float>& field, int x, int y, int z, int corner){
+	static const int OFFSETS[8][3] = {
+		{ 0, 0, 1 }, { 1, 0, 1 }, { 1, 0, 0 }, { 0, 0, 0 },
+		{ 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 }, { 0, 1, 0 } };
+	return field(x + OFFSETS[corner][0], y + OFFSETS[corner][1], z + OFFSETS[corner][2]);
+}
 
+SurfaceExtractor::SurfaceExtractor() :mPool(nullptr){}
 
-inline void setGridCellValue(std::unordered_map<glm::vec3, double, vec3Hash>& grid, GRIDCELL& cell, int index, float x, float y, float z){
-	cell.p[index].x = x;
-	cell.p[index].y = y;
-	cell.p[index].z = z;
-	auto it = grid.find(cell.p[index]);
-	cell.val[index] = it != grid.end() ? (*it).second : 0.0;
+void SurfaceExtractor::setThreadPool(ThreadPool* pool){
+	mPool = pool;
 }
 
-glm::vec3 gradient(std::unordered_map<glm::vec3, double, vec3Hash>& grid, glm::vec3& p){
-	glm::vec3 grad; //our return value, the gradient of point p on the grid
-	//x component
-	auto it = grid.find(glm::vec3(p.x + 0.5f, p.y, p.z));
-	if (it != grid.end())
-		grad.x = (*it).second;
-	else
-		grad.x = 0.0f;
-	it = grid.find(glm::vec3(p.x - 0.5f, p.y, p.z));
-	if (it != grid.end())
-		grad.x -= (*it).second;
-	//y component
-	it = grid.find(glm::vec3(p.x, p.y + 0.5f, p.z));
-	if (it != grid.end())
-		grad.y = (*it).second;
-	else
-		grad.y = 0.0f;
-	it = grid.find(glm::vec3(p.x, p.y - 0.5f, p.z));
-	if (it != grid.end())
-		grad.y -= (*it).second;
-	//z component
-	it = grid.find(glm::vec3(p.x, p.y, p.z + 0.5f));
-	if (it != grid.end())
-		grad.z = (*it).second;
-	else
-		grad.z = 0.0f;
-	it = grid.find(glm::vec3(p.x, p.y, p.z - 0.5f));
-	if (it != grid.end())
-		grad.z -= (*it).second;
-	return grad; //divide by grid 0.5 / gridscale, for current case it would only result in 1
-}
\ No newline at end of file
+std::size_t SurfaceExtractor::extract(const Grid3D<float>& field, double isolevel, std::vector<TRIANGLE>& triangles){
+	PROFILE_ZONE("extractSurface");
+	triangles.clear();
+	//Cells lie between the points of the field
+	const int width = field.width() - 1, height = field.height() - 1, depth = field.depth() - 1;
+	if (width < 1 || height < 1 || depth < 1)
+		return 0;
+	mCubeIndex.resize(width, height, depth);
+	mLayerOffsets.assign(depth + 1, 0);
+
+	//Classify and count. Whether each point is below the isolevel is worked out once per layer of points,
+	//then the cube index of each cell is put together from the flags of its corners in the two layers around it.
+	util::parallelFor(mPool, 0, depth, [&](int begin, int end){
+		const int pitch = width + 1;
+		std::vector<unsigned char> layers[2];
+		auto classifyLayer = [&](std::vector<unsigned char>& flags, int z){
+			flags.resize(pitch * (height + 1));
+			unsigned char* out = flags.data();
+			for (int y = 0; y <= height; ++y)
+				for (int x = 0; x <= width; ++x)
+					*out++ = field(x, y, z) < isolevel;
+		};
+		classifyLayer(layers[1], begin);
+		for (int z = begin; z < end; ++z)
+		{
+			layers[0].swap(layers[1]);
+			classifyLayer(layers[1], z + 1);
+			std::size_t facets = 0;
+			for (int y = 0; y < height; ++y)
+			{
+				const unsigned char* low = layers[0].data() + pitch * y;
+				const unsigned char* high = layers[1].data() + pitch * y;
+				const unsigned char* lowUp = low + pitch;
+				const unsigned char* highUp = high + pitch;
+				unsigned char* cubes = &mCubeIndex(0, y, z);
+				for (int x = 0; x < width; ++x)
+				{
+					//Same corner order as GRIDCELL, see cornerValue
+					const int cubeindex = high[x] | high[x + 1] << 1 | low[x + 1] << 2 | low[x] << 3
+						| highUp[x] << 4 | highUp[x + 1] << 5 | lowUp[x + 1] << 6 | lowUp[x] << 7;
+					cubes[x] = static_cast<unsigned char>(cubeindex);
+					if (LUTS::edgeTable[cubeindex] != 0)
+						facets += facetCount(cubeindex);
+				}
+			}
+			mLayerOffsets[z] = facets;
+		}
+	});
+
+	//Scan the counts into offsets
+	std::size_t total = 0;
+	for (int z = 0; z < depth; ++z)
+	{
+		const std::size_t facets = mLayerOffsets[z];
+		mLayerOffsets[z] = total;
+		total += facets;
+	}
+	mLayerOffsets[depth] = total;
+	triangles.resize(2 * total);
+
+	//Write. Gradients are central differences like the viewer's, with points outside the field counting as 0.
+	auto value = [&](int x, int y, int z){
+		if (x < 0 || y < 0 || z < 0 || x >= field.width() || y >= field.height() || z >= field.depth())
+			return 0.0f;
+		return field(x, y, z);
+	};
+	auto gradientAt = [&](const glm::vec3& p){
+		const int x = static_cast<int>(p.x), y = static_cast<int>(p.y), z = static_cast<int>(p.z);
+		return glm::vec3(value(x + 1, y, z) - value(x - 1, y, z), value(x, y + 1, z) - value(x, y - 1, z),
+			value(x, y, z + 1) - value(x, y, z - 1)) * 0.5f;
+	};
+	util::parallelFor(mPool, 0, depth, [&](int begin, int end){
+		for (int z = begin; z < end; ++z)
+		{
+			TRIANGLE* out = triangles.data() + 2 * mLayerOffsets[z];
+			for (int y = 0; y < height; ++y)
+				for (int x = 0; x < width; ++x)
+				{
+					if (LUTS::edgeTable[mCubeIndex(x, y, z)] == 0)
+						continue;
+					GRIDCELL cell;
+					cell.p[0] = glm::vec3(x, y, z + 1);
+					cell.p[1] = glm::vec3(x + 1, y, z + 1);
+					cell.p[2] = glm::vec3(x + 1, y, z);
+					cell.p[3] = glm::vec3(x, y, z);
+					cell.p[4] = glm::vec3(x, y + 1, z + 1);
+					cell.p[5] = glm::vec3(x + 1, y + 1, z + 1);
+					cell.p[6] = glm::vec3(x + 1, y + 1, z);
+					cell.p[7] = glm::vec3(x, y + 1, z);
+					for (int corner = 0; corner < 8; ++corner)
+						cell.val[corner] = cornerValue(field, x, y, z, corner);
+					out += 2 * polygoniseCell(cell, isolevel, gradientAt, out);
+				}
+		}
+	});
+	return total;
+}
@@ -7,9 +7,10 @@ the particle positions to an isosurface.
 
 #ifndef _MARCHINGCUBES_H_
 #define _MARCHINGCUBES_H_
-#include <unordered_map>
+#include <cstddef>
 #include <vector>
 #include <glm/glm.hpp>
+#include "Grid3D.h"
 
 
 struct TRIANGLE {
@@ -21,22 +22,66 @@ struct GRIDCELL {
 	double val[8];
 };
 
-struct vec3Hash{
-	std::size_t operator()(const glm::vec3 key) const{
-		size_t ix = static_cast<int>(floorf(key.x) / 0.5f);
-		size_t iy = static_cast<int>(floorf(key.y) / 0.5f);
-		size_t iz = static_cast<int>(floorf(key.z) / 0.5f);
+/*
+Blobby density of a set of particles, sampled at every integer point of their bounding box (grown by the blob radius).
+values(0, 0, 0) is the point at origin. The density is 0 everywhere outside the box.
+*/
+struct DensityField{
+	glm::ivec3 origin;
+	Grid3D<double> values;
 
-		return ((ix * 11113) ^ (iy * 12979) ^ (iz * 13513)) % 15625;
+	//Density at integer point (x, y, z), 0 outside the box
+	double at(int x, int y, int z) const {
+		x -= origin.x;
+		y -= origin.y;
+		z -= origin.z;
+		if (x < 0 || y < 0 || z < 0 || x >= values.width() || y >= values.height() || z >= values.depth())
+			return 0.0;
+		return values(x, y, z);
 	}
 };
 
-int Polygonise(std::unordered_map<glm::vec3, double, vec3Hash>& isoSurface, GRIDCELL& grid, double isolevel, std::vector<TRIANGLE> &triangles);
+class ThreadPool;
+
+/*
+Multithreaded marching cubes over a whole density field, such as one filled by DensitySplatter. Cells, corner order,
+normals (central differences, 0 outside the field) and output match Polygonise and the viewer's shaders.
+Works on layers of cells along z, each pass split over the thread pool:
+	1. classifies every cell by its cube index and counts the facets of each layer
+	2. turns the counts into the offset each layer's facets start at (an exclusive scan)
+	3. writes the facets of each layer at its offset in the output, sized once after the scan
+Each layer writes its own part of the output, so no locks are needed and the output never grows while written.
+Triangles come out in the same order whatever the number of threads.
+*/
+class SurfaceExtractor{
+public:
+	SurfaceExtractor();
+
+	//Splits the work over pool, or runs it all on the calling thread if it is null
+	void setThreadPool(ThreadPool* pool);
+
+	//Replaces triangles with the surface of field at isolevel, two TRIANGLEs per facet as written by Polygonise.
+	//Field point (x, y, z) is at position (x, y, z). Returns the number of facets.
+	std::size_t extract(const Grid3D<float>& field, double isolevel, std::vector<TRIANGLE>& triangles);
+
+private:
+	ThreadPool* mPool;
+	//Cube index of each cell, kept between the passes. Rows are walked through a pointer, so the layout is linear.
+	Grid3D<unsigned char, LinearLayout> mCubeIndex;
+	//Facets in each layer of cells, then the first facet of each layer after the scan
+	std::vector<std::size_t> mLayerOffsets;
+};
+
+/*
+Original single threaded mesher, which builds its own DensityField from the particles and polygonises it cell by
+cell. Nothing calls it anymore, the headless mesher uses DensitySplatter and SurfaceExtractor instead. It is kept
+only as the reference SurfaceExtractor's output is checked against, see checkExtractor in Check.cpp.
+radius is the blob radius in cells, the viewer uses 1.
+*/
+int Polygonise(const DensityField& isoSurface, GRIDCELL& grid, double isolevel, std::vector<TRIANGLE> &triangles);
 glm::vec3 VertexInterp(double isolevel, glm::vec3 p1, glm::vec3 p2, double valp1, double valp2);
 void genField(const std::vector<glm::vec3>& particles, float radius, std::vector<TRIANGLE>& triangles);
-glm::vec3 gradient(std::unordered_map<glm::vec3, double, vec3Hash>& grid, glm::vec3& p);
-inline void setFieldValue(std::unordered_map<glm::vec3, double, vec3Hash>& grid, glm::vec3& particle, glm::vec3& point);
-inline void setGridCellValue(std::unordered_map<glm::vec3, double, vec3Hash>& grid, GRIDCELL& cell, int index, float x, float y, float z);
+glm::vec3 gradient(const DensityField& field, const glm::vec3& p);
 
 
 #endif
\ No newline at end of file
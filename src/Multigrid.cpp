@@ -0,0 +1,234 @@
+#include "Multigrid.h"
+#include <algorithm>
+#include <cmath>
+#include "PressureStencil.h"
+#include "Profiler.h"
+
+//Number of red-black Gauss-Seidel sweeps done before and after the coarse grid correction
+const int PRE_SMOOTHING_SWEEPS = 2;
+const int POST_SMOOTHING_SWEEPS = 2;
+
+//Number of sweeps used to solve the coarsest grid. It is tiny, so this is cheap.
+const int COARSEST_SWEEPS = 40;
+
+//Stop coarsening once the interior of a grid is this small along any axis
+const int MIN_COARSE_SIZE = 3;
+
+Multigrid::Multigrid() :mPool(nullptr), mBoundaryCondition(BoundaryCondition::NO_SLIP){
+}
+
+void Multigrid::resize(int width, int height, int depth){
+	mLevels.clear();
+	while (true)
+	{
+		Level level;
+		level.width = width;
+		level.height = height;
+		level.depth = depth;
+		level.u.resize(width, height, depth, 0.0f);
+		level.f.resize(width, height, depth, 0.0f);
+		level.r.resize(width, height, depth, 0.0f);
+		mLevels.push_back(level);
+
+		//Each coarse cell covers 2x2x2 fine interior cells. The last one along an axis covers a single layer
+		//of fine cells if the fine interior has an odd size.
+		int interiorWidth = width - 2, interiorHeight = height - 2, interiorDepth = depth - 2;
+		if (std::min(interiorWidth, std::min(interiorHeight, interiorDepth)) <= MIN_COARSE_SIZE)
+			break;
+		width = (interiorWidth + 1) / 2 + 2;
+		height = (interiorHeight + 1) / 2 + 2;
+		depth = (interiorDepth + 1) / 2 + 2;
+	}
+}
+
+int Multigrid::solve(Grid3D<float>& pressure, const Grid3D<float>& rhs, float tolerance, int maxCycles){
+	PROFILE_ZONE("Multigrid::solve");
+	int cycles = 0;
+	withBoundaryPolicy(mBoundaryCondition, [&](auto policy){
+		cycles = this->solve<decltype(policy)>(pressure, rhs, tolerance, maxCycles);
+	});
+	return cycles;
+}
+
+template <typename Policy>
+int Multigrid::solve(Grid3D<float>& pressure, const Grid3D<float>& rhs, float tolerance, int maxCycles){
+	Level& fine = mLevels[0];
+	//Work on the pressure grid in place by swapping it into the finest level, it is swapped back at the end.
+	fine.u.swap(pressure);
+	fine.f = rhs;
+
+	//Solid walls make the system singular, so it only has a solution if the right hand side sums to 0.
+	if (Policy::SOLID)
+		removeMean(fine, fine.f);
+	float fMax = 0.0f;
+	for (int z = 1; z < fine.depth - 1; ++z)
+		for (int y = 1; y < fine.height - 1; ++y)
+			for (int x = 1; x < fine.width - 1; ++x)
+				fMax = std::max(fMax, std::abs(fine.f(x, y, z)));
+
+	int cycles = 0;
+	if (fMax == 0.0f)
+	{
+		fine.u.fill(0.0f);
+	}
+	else
+	{
+		//Full multigrid. Restrict the right hand side all the way down, solve the coarsest grid,
+		//then interpolate the solution up one level at a time doing one V-cycle on each level.
+		for (unsigned int l = 0; l + 1 < mLevels.size(); ++l)
+			restrictField(mLevels[l], mLevels[l].f, mLevels[l + 1]);
+		for (int l = mLevels.size() - 1; l >= 0; --l)
+		{
+			mLevels[l].u.fill(0.0f);
+			if (l + 1 < static_cast<int>(mLevels.size()))
+				prolongate<Policy>(mLevels[l + 1], mLevels[l]);
+			vCycle<Policy>(l);
+		}
+
+		//Then do V-cycles on the finest grid until the residual is small enough
+		while (cycles < maxCycles && computeResidual<Policy>(fine) > tolerance * fMax)
+		{
+			vCycle<Policy>(0);
+			++cycles;
+		}
+		//With solid walls pressure is only defined up to a constant, keep it centered around 0 so it doesn't drift.
+		if (Policy::SOLID)
+			removeMean(fine, fine.u);
+		setBoundaries<Policy>(fine, fine.u);
+	}
+
+	fine.u.swap(pressure);
+	return cycles;
+}
+
+template <typename Policy>
+void Multigrid::vCycle(unsigned int l){
+	Level& level = mLevels[l];
+	if (l + 1 == mLevels.size())
+	{
+		//Coarsest grid, just relax until it is solved
+		if (Policy::SOLID)
+			removeMean(level, level.f);
+		smooth<Policy>(level, COARSEST_SWEEPS);
+		return;
+	}
+	Level& coarse = mLevels[l + 1];
+	smooth<Policy>(level, PRE_SMOOTHING_SWEEPS);
+	computeResidual<Policy>(level);
+	restrictField(level, level.r, coarse);
+	coarse.u.fill(0.0f);
+	vCycle<Policy>(l + 1);
+	prolongate<Policy>(coarse, level);
+	smooth<Policy>(level, POST_SMOOTHING_SWEEPS);
+}
+
+template <typename Policy>
+void Multigrid::smooth(Level& level, int sweeps){
+	for (int it = sweeps; it > 0; --it)
+	{
+		//Update all cells where x + y + z is even, then all the cells where it is odd.
+		//Cells of one color only have neighbors of the other color.
+		for (int color = 0; color < 2; ++color)
+		{
+			util::parallelFor(mPool, 1, level.depth - 1, [&](int zBegin, int zEnd){
+				stencil::relaxRedBlack<Policy>(level.u, level.f, glm::ivec3(1, 1, zBegin), glm::ivec3(level.width - 1, level.height - 1, zEnd), color);
+			});
+		}
+	}
+}
+
+template <typename Policy>
+float Multigrid::computeResidual(Level& level){
+	return util::parallelMax(mPool, 1, level.depth - 1, [&](int zBegin, int zEnd){
+		return stencil::residual<Policy>(level.u, level.f, level.r, glm::ivec3(1, 1, zBegin), glm::ivec3(level.width - 1, level.height - 1, zEnd));
+	});
+}
+
+void Multigrid::restrictField(const Level& fine, const Grid3D<float>& src, Level& coarse){
+	//The fine equation is scaled by h^2 and the coarse one by (2h)^2, so the coarse right hand side
+	//is 4 times the average of the fine cells it covers.
+	util::parallelFor(mPool, 1, coarse.depth - 1, [&](int zBegin, int zEnd){
+		for (int z = zBegin; z < zEnd; ++z)
+			for (int y = 1; y < coarse.height - 1; ++y)
+				for (int x = 1; x < coarse.width - 1; ++x)
+				{
+					float sum = 0.0f;
+					int count = 0;
+					for (int fz = 2 * z - 1; fz <= 2 * z && fz < fine.depth - 1; ++fz)
+						for (int fy = 2 * y - 1; fy <= 2 * y && fy < fine.height - 1; ++fy)
+							for (int fx = 2 * x - 1; fx <= 2 * x && fx < fine.width - 1; ++fx)
+							{
+								sum += src(fx, fy, fz);
+								++count;
+							}
+					coarse.f(x, y, z) = 4.0f * sum / count;
+				}
+	});
+}
+
+template <typename Policy>
+void Multigrid::prolongate(Level& coarse, Level& fine){
+	//Trilinear interpolation of the coarse solution, added to the fine solution.
+	//A fine cell sits a quarter of a coarse cell away from the center of its parent, so it takes 3/4 of
+	//its parent and 1/4 of the parent's neighbor on the same side, along each axis.
+	//Neighbors can be in the boundary layer here, so it is filled in first.
+	setBoundaries<Policy>(coarse, coarse.u);
+	util::parallelFor(mPool, 1, fine.depth - 1, [&](int zBegin, int zEnd){
+		for (int z = zBegin; z < zEnd; ++z)
+		{
+			int cz = (z + 1) / 2, nz = (z & 1) ? cz - 1 : cz + 1;
+			for (int y = 1; y < fine.height - 1; ++y)
+			{
+				int cy = (y + 1) / 2, ny = (y & 1) ? cy - 1 : cy + 1;
+				for (int x = 1; x < fine.width - 1; ++x)
+				{
+					int cx = (x + 1) / 2, nx = (x & 1) ? cx - 1 : cx + 1;
+					const Grid3D<float>& e = coarse.u;
+					float value = 27.0f * e(cx, cy, cz)
+						+ 9.0f * (e(nx, cy, cz) + e(cx, ny, cz) + e(cx, cy, nz))
+						+ 3.0f * (e(nx, ny, cz) + e(nx, cy, nz) + e(cx, ny, nz))
+						+ e(nx, ny, nz);
+					fine.u(x, y, z) += value / 64.0f;
+				}
+			}
+		}
+	});
+}
+
+void Multigrid::removeMean(Level& level, Grid3D<float>& q){
+	double sum = 0.0;
+	for (int z = 1; z < level.depth - 1; ++z)
+		for (int y = 1; y < level.height - 1; ++y)
+			for (int x = 1; x < level.width - 1; ++x)
+				sum += q(x, y, z);
+	float mean = static_cast<float>(sum / ((level.width - 2) * (level.height - 2) * (level.depth - 2)));
+	for (int z = 1; z < level.depth - 1; ++z)
+		for (int y = 1; y < level.height - 1; ++y)
+			for (int x = 1; x < level.width - 1; ++x)
+				q(x, y, z) -= mean;
+}
+
+template <typename Policy>
+void Multigrid::setBoundaries(Level& level, Grid3D<float>& q){
+	//Each boundary cell gets the value the policy gives it from the interior cell next to it.
+	//Edges and corners are never read, so they are left alone.
+	const int w = level.width, h = level.height, d = level.depth;
+	for (int z = 1; z < d - 1; ++z)
+		for (int y = 1; y < h - 1; ++y)
+		{
+			q(0, y, z) = Policy::pressure(q(1, y, z));
+			q(w - 1, y, z) = Policy::pressure(q(w - 2, y, z));
+		}
+	for (int z = 1; z < d - 1; ++z)
+		for (int x = 1; x < w - 1; ++x)
+		{
+			q(x, 0, z) = Policy::pressure(q(x, 1, z));
+			q(x, h - 1, z) = Policy::pressure(q(x, h - 2, z));
+		}
+	for (int y = 1; y < h - 1; ++y)
+		for (int x = 1; x < w - 1; ++x)
+		{
+			q(x, y, 0) = Policy::pressure(q(x, y, 1));
+			q(x, y, d - 1) = Policy::pressure(q(x, y, d - 2));
+		}
+}
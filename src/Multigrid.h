@@ -0,0 +1,65 @@
+#ifndef _MULTIGRID_H_
+#define _MULTIGRID_H_
+
+#include <vector>
+#include "BoundaryConditions.h"
+#include "Grid3D.h"
+#include "ThreadPool.h"
+
+/*
+Geometric multigrid solver for the pressure equation used by CFDSimulation::project().
+Solves 6p - (sum of the 6 neighbors of p) = rhs over the interior cells of a grid surrounded by a
+one cell thick boundary layer. Stencils take the value of a boundary cell from the pressure boundary policy
+(see BoundaryConditions.h) instead of reading it, so every level sees the same boundary conditions
+without the boundary layer being written after every sweep.
+*/
+class Multigrid{
+public:
+	Multigrid();
+
+	//Builds the hierarchy of grids for a fine grid of the given size (boundary layer included).
+	void resize(int width, int height, int depth);
+
+	//Smoothing, residuals and transfers between levels are split into slabs that run on this pool. Null to run serially.
+	void setThreadPool(ThreadPool* pool) { mPool = pool; }
+	void setBoundaryCondition(BoundaryCondition condition) { mBoundaryCondition = condition; }
+
+	/*
+	Solves the pressure equation with a full multigrid pass followed by V-cycles.
+	@param pressure the solution. Must be the size given to resize. Its old values are discarded.
+	@param rhs the right hand side, usually the divergence of the velocity field
+	@param tolerance iteration stops once the largest residual is below tolerance times the largest value of rhs
+	@param maxCycles the maximum number of V-cycles done after the full multigrid pass
+	@return the number of V-cycles done after the full multigrid pass
+	*/
+	int solve(Grid3D<float>& pressure, const Grid3D<float>& rhs, float tolerance, int maxCycles);
+
+private:
+	//A single grid in the hierarchy. u is the solution, f the right hand side and r the residual.
+	struct Level{
+		int width, height, depth;
+		Grid3D<float> u, f, r;
+	};
+
+	//mLevels[0] is the finest grid, every grid after it has half the resolution of the one before it.
+	std::vector<Level> mLevels;
+	ThreadPool* mPool;
+	BoundaryCondition mBoundaryCondition;
+
+	template <typename Policy>
+	int solve(Grid3D<float>& pressure, const Grid3D<float>& rhs, float tolerance, int maxCycles);
+	template <typename Policy>
+	void vCycle(unsigned int level);
+	template <typename Policy>
+	void smooth(Level& level, int sweeps);
+	template <typename Policy>
+	float computeResidual(Level& level);
+	void restrictField(const Level& fine, const Grid3D<float>& src, Level& coarse);
+	template <typename Policy>
+	void prolongate(Level& coarse, Level& fine);
+	void removeMean(Level& level, Grid3D<float>& q);
+	template <typename Policy>
+	void setBoundaries(Level& level, Grid3D<float>& q);
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include "PCGSolver.h"
+#include <algorithm>
+#include <cmath>
+#include "Profiler.h"
+
+//Tuning constants for MIC(0). TAU blends between incomplete Cholesky (0) and modified incomplete Cholesky (1),
+//SIGMA guards against tiny pivots. Values from Bridson's "Fluid Simulation for Computer Graphics".
+const float MIC_TAU = 0.97f;
+const float MIC_SIGMA = 0.25f;
+
+PCGSolver::PCGSolver() :mWidth(0), mHeight(0), mDepth(0), mSingular(false), mPool(nullptr),
+	mBoundaryCondition(BoundaryCondition::NO_SLIP){
+}
+
+void PCGSolver::resize(int width, int height, int depth){
+	mWidth = width;
+	mHeight = height;
+	mDepth = depth;
+	mCompact = std::vector<int>(width * height * depth, -1);
+	mCells.clear();
+}
+
+int PCGSolver::solve(Grid3D<float>& pressure, const Grid3D<float>& rhs, const Grid3D<unsigned char>& fluid,
+	float tolerance, int maxIterations){
+	PROFILE_ZONE("PCGSolver::solve");
+	buildSystem(fluid, pressure);
+	const unsigned int n = mCells.size();
+	mP.assign(n, 0.0f);
+	mR.resize(n);
+	mZ.resize(n);
+	mS.resize(n);
+	mQ.resize(n);
+
+	//Start from p = 0, so the residual is just the right hand side
+	double mean = 0.0;
+	for (unsigned int k = 0; k < n; ++k)
+	{
+		mR[k] = rhs[mFieldCells[k]];
+		mean += mR[k];
+	}
+	//Without any air the right hand side has to sum to 0 for the system to have a solution
+	if (mSingular && n > 0)
+	{
+		float m = static_cast<float>(mean / n);
+		for (unsigned int k = 0; k < n; ++k)
+			mR[k] -= m;
+	}
+	float rMax = 0.0f;
+	for (unsigned int k = 0; k < n; ++k)
+		rMax = std::max(rMax, std::abs(mR[k]));
+
+	int iterations = 0;
+	if (rMax > 0.0f)
+	{
+		const float threshold = tolerance * rMax;
+		buildPreconditioner();
+		applyPreconditioner(mR, mZ);
+		mS = mZ;
+		double sigma = dot(mZ, mR);
+
+		while (iterations < maxIterations)
+		{
+			++iterations;
+			applyMatrix(mS, mQ);
+			double sq = dot(mS, mQ);
+			if (sq == 0.0)
+				break;
+			float alpha = static_cast<float>(sigma / sq);
+			float residual = util::parallelMax(mPool, 0, n, [&](int begin, int end){
+				float chunkMax = 0.0f;
+				for (int k = begin; k < end; ++k)
+				{
+					mP[k] += alpha * mS[k];
+					mR[k] -= alpha * mQ[k];
+					chunkMax = std::max(chunkMax, std::abs(mR[k]));
+				}
+				return chunkMax;
+			});
+			if (residual <= threshold)
+				break;
+
+			applyPreconditioner(mR, mZ);
+			double sigmaNew = dot(mZ, mR);
+			float beta = static_cast<float>(sigmaNew / sigma);
+			util::parallelFor(mPool, 0, n, [&](int begin, int end){
+				for (int k = begin; k < end; ++k)
+					mS[k] = mZ[k] + beta * mS[k];
+			});
+			sigma = sigmaNew;
+		}
+	}
+
+	//Write the solution back, air cells have 0 pressure
+	for (int z = 1; z < mDepth - 1; ++z)
+		for (int y = 1; y < mHeight - 1; ++y)
+			for (int x = 1; x < mWidth - 1; ++x)
+			{
+				int g = x + mWidth * (y + mHeight * z);
+				pressure(x, y, z) = mCompact[g] >= 0 ? mP[mCompact[g]] : 0.0f;
+			}
+	return iterations;
+}
+
+void PCGSolver::buildSystem(const Grid3D<unsigned char>& fluid, const Grid3D<float>& pressure){
+	mCells.clear();
+	mFieldCells.clear();
+	mDiagonal.clear();
+	std::fill(mCompact.begin(), mCompact.end(), -1);
+	bool solidWalls = true;
+	withBoundaryPolicy(mBoundaryCondition, [&](auto policy){ solidWalls = decltype(policy)::SOLID; });
+	//Only interior cells can be fluid, the boundary layer is always solid.
+	for (int z = 1; z < mDepth - 1; ++z)
+		for (int y = 1; y < mHeight - 1; ++y)
+			for (int x = 1; x < mWidth - 1; ++x)
+			{
+				int g = x + mWidth * (y + mHeight * z);
+				if (!fluid(x, y, z))
+					continue;
+				mCompact[g] = mCells.size();
+				mCells.push_back(g);
+				mFieldCells.push_back(pressure.index(x, y, z));
+				//Every neighbor that isn't solid adds 1 to the diagonal, fluid or air.
+				//Solid neighbors copy this cell's pressure, so they cancel out.
+				int nonSolid = solidWalls ? (x > 1) + (x < mWidth - 2) + (y > 1) + (y < mHeight - 2) + (z > 1) + (z < mDepth - 2) : 6;
+				mDiagonal.push_back(static_cast<float>(nonSolid));
+			}
+
+	//The system is singular if every non solid neighbor of every fluid cell is also fluid
+	const int sy = mWidth, sz = mWidth * mHeight;
+	mSingular = true;
+	for (unsigned int k = 0; k < mCells.size() && mSingular; ++k)
+	{
+		int g = mCells[k];
+		int fluidNeighbors = (mCompact[g - 1] >= 0) + (mCompact[g + 1] >= 0) + (mCompact[g - sy] >= 0)
+			+ (mCompact[g + sy] >= 0) + (mCompact[g - sz] >= 0) + (mCompact[g + sz] >= 0);
+		if (fluidNeighbors < mDiagonal[k])
+			mSingular = false;
+	}
+}
+
+void PCGSolver::buildPreconditioner(){
+	const int sy = mWidth, sz = mWidth * mHeight;
+	mPrecon.resize(mCells.size());
+	//Off diagonal entries are -1 between two fluid cells and 0 otherwise, so every product of them
+	//below comes down to counting fluid neighbors.
+	for (unsigned int k = 0; k < mCells.size(); ++k)
+	{
+		int g = mCells[k];
+		float e = mDiagonal[k];
+		int n = mCompact[g - 1];
+		if (n >= 0)
+		{
+			float p = mPrecon[n];
+			int couplings = (mCompact[g - 1 + sy] >= 0) + (mCompact[g - 1 + sz] >= 0);
+			e -= p * p * (1.0f + MIC_TAU * couplings);
+		}
+		n = mCompact[g - sy];
+		if (n >= 0)
+		{
+			float p = mPrecon[n];
+			int couplings = (mCompact[g - sy + 1] >= 0) + (mCompact[g - sy + sz] >= 0);
+			e -= p * p * (1.0f + MIC_TAU * couplings);
+		}
+		n = mCompact[g - sz];
+		if (n >= 0)
+		{
+			float p = mPrecon[n];
+			int couplings = (mCompact[g - sz + 1] >= 0) + (mCompact[g - sz + sy] >= 0);
+			e -= p * p * (1.0f + MIC_TAU * couplings);
+		}
+		if (e < MIC_SIGMA * mDiagonal[k])
+			e = mDiagonal[k];
+		mPrecon[k] = 1.0f / std::sqrt(e);
+	}
+}
+
+void PCGSolver::applyPreconditioner(const std::vector<float>& r, std::vector<float>& z){
+	const int sy = mWidth, sz = mWidth * mHeight;
+	const int n = mCells.size();
+	//Solve L q = r, storing q in z
+	for (int k = 0; k < n; ++k)
+	{
+		int g = mCells[k];
+		float t = r[k];
+		int m = mCompact[g - 1];
+		if (m >= 0) t += mPrecon[m] * z[m];
+		m = mCompact[g - sy];
+		if (m >= 0) t += mPrecon[m] * z[m];
+		m = mCompact[g - sz];
+		if (m >= 0) t += mPrecon[m] * z[m];
+		z[k] = t * mPrecon[k];
+	}
+	//Then solve L^T z = q in place, going backwards
+	for (int k = n - 1; k >= 0; --k)
+	{
+		int g = mCells[k];
+		float t = z[k];
+		int m = mCompact[g + 1];
+		if (m >= 0) t += mPrecon[k] * z[m];
+		m = mCompact[g + sy];
+		if (m >= 0) t += mPrecon[k] * z[m];
+		m = mCompact[g + sz];
+		if (m >= 0) t += mPrecon[k] * z[m];
+		z[k] = t * mPrecon[k];
+	}
+}
+
+void PCGSolver::applyMatrix(const std::vector<float>& s, std::vector<float>& q){
+	const int sy = mWidth, sz = mWidth * mHeight;
+	util::parallelFor(mPool, 0, mCells.size(), [&](int begin, int end){
+		for (int k = begin; k < end; ++k)
+		{
+			int g = mCells[k];
+			float t = mDiagonal[k] * s[k];
+			int m = mCompact[g - 1];
+			if (m >= 0) t -= s[m];
+			m = mCompact[g + 1];
+			if (m >= 0) t -= s[m];
+			m = mCompact[g - sy];
+			if (m >= 0) t -= s[m];
+			m = mCompact[g + sy];
+			if (m >= 0) t -= s[m];
+			m = mCompact[g - sz];
+			if (m >= 0) t -= s[m];
+			m = mCompact[g + sz];
+			if (m >= 0) t -= s[m];
+			q[k] = t;
+		}
+	});
+}
+
+double PCGSolver::dot(const std::vector<float>& a, const std::vector<float>& b){
+	return util::parallelSum(mPool, 0, mCells.size(), [&](int begin, int end){
+		double sum = 0.0;
+		for (int k = begin; k < end; ++k)
+			sum += a[k] * b[k];
+		return sum;
+	});
+}
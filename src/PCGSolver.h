@@ -0,0 +1,68 @@
+#ifndef _PCGSOLVER_H_
+#define _PCGSOLVER_H_
+
+#include <vector>
+#include "BoundaryConditions.h"
+#include "Grid3D.h"
+#include "ThreadPool.h"
+
+/*
+Conjugate gradient solver for the pressure equation, preconditioned with modified incomplete Cholesky, MIC(0).
+Only cells marked as fluid are part of the system. The boundary layer of the grid is solid wall, where the pressure
+copies the fluid cell next to it, or air for open boundaries, and every other non fluid cell is air, where the pressure is 0. The matrix is never stored, its entries are worked out from the fluid flags as needed.
+The fluid cells are gathered out of the grids into compact vectors, so the solve itself doesn't depend on their layout.
+*/
+class PCGSolver{
+public:
+	PCGSolver();
+
+	//Allocates the buffers needed for a grid of the given size (boundary layer included).
+	void resize(int width, int height, int depth);
+
+	//Matrix products and vector updates are split into chunks that run on this pool. Null to run serially.
+	//The preconditioner is inherently sequential and always runs on the calling thread.
+	void setThreadPool(ThreadPool* pool) { mPool = pool; }
+	void setBoundaryCondition(BoundaryCondition condition) { mBoundaryCondition = condition; }
+
+	/*
+	Solves 6p - (sum of the 6 neighbors of p) = rhs over the fluid cells.
+	@param pressure the solution. Must be the size given to resize. Fluid cells are overwritten, air cells are set to 0
+	and the boundary layer is left alone.
+	@param rhs the right hand side, usually the divergence of the velocity field
+	@param fluid nonzero for every cell that contains fluid
+	@param tolerance iteration stops once the largest residual is below tolerance times the largest value of rhs
+	@param maxIterations the maximum number of iterations
+	@return the number of iterations done
+	*/
+	int solve(Grid3D<float>& pressure, const Grid3D<float>& rhs, const Grid3D<unsigned char>& fluid,
+		float tolerance, int maxIterations);
+
+private:
+	int mWidth, mHeight, mDepth;
+
+	//Index of every fluid cell in mCompact, in the order the preconditioner walks them (x first, then y, then z)
+	std::vector<int> mCells;
+	//Index of every fluid cell in the pressure and right hand side grids
+	std::vector<int> mFieldCells;
+	//Position of each grid cell in mCells, or -1 if it is not fluid. Stored x first, then y, then z
+	//no matter the layout of the grids, so neighbors are always a fixed offset away.
+	std::vector<int> mCompact;
+	//Diagonal of the matrix, the number of non solid neighbors of each fluid cell.
+	std::vector<float> mDiagonal;
+	//Preconditioner, the reciprocal of the diagonal of the MIC(0) factor
+	std::vector<float> mPrecon;
+	//Solution, residual, auxiliary vector, search vector and the matrix applied to the search vector
+	std::vector<float> mP, mR, mZ, mS, mQ;
+	//True if no fluid cell touches air, in which case pressure is only defined up to a constant
+	bool mSingular;
+	ThreadPool* mPool;
+	BoundaryCondition mBoundaryCondition;
+
+	void buildSystem(const Grid3D<unsigned char>& fluid, const Grid3D<float>& pressure);
+	void buildPreconditioner();
+	void applyPreconditioner(const std::vector<float>& r, std::vector<float>& z);
+	void applyMatrix(const std::vector<float>& s, std::vector<float>& q);
+	double dot(const std::vector<float>& a, const std::vector<float>& b);
+};
+
+#endif
@@ -0,0 +1,113 @@
+#include "ParticleStore.h"
+#include <algorithm>
+#include "Profiler.h"
+
+//Bits of the key sorted on per radix sort pass
+const int RADIX_BITS = 8;
+const int RADIX_BUCKETS = 1 << RADIX_BITS;
+
+void ParticleStore::add(const glm::vec3& position, const glm::vec3& velocity){
+	mX.push_back(position.x);
+	mY.push_back(position.y);
+	mZ.push_back(position.z);
+	mU.push_back(velocity.x);
+	mV.push_back(velocity.y);
+	mW.push_back(velocity.z);
+}
+
+void ParticleStore::assign(std::size_t count, const float* x, const float* y, const float* z, const float* u, const float* v, const float* w){
+	mX.assign(x, x + count);
+	mY.assign(y, y + count);
+	mZ.assign(z, z + count);
+	mU.assign(u, u + count);
+	mV.assign(v, v + count);
+	mW.assign(w, w + count);
+}
+
+void ParticleStore::clear(){
+	mX.clear();
+	mY.clear();
+	mZ.clear();
+	mU.clear();
+	mV.clear();
+	mW.clear();
+}
+
+void ParticleStore::reserve(std::size_t count){
+	mX.reserve(count);
+	mY.reserve(count);
+	mZ.reserve(count);
+	mU.reserve(count);
+	mV.reserve(count);
+	mW.reserve(count);
+}
+
+void ParticleStore::copyTo(std::vector<glm::vec3>& out) const{
+	out.resize(size());
+	for (std::size_t i = 0; i < out.size(); ++i)
+		out[i] = position(i);
+}
+
+void ParticleStore::sortByCell(int width, int height, int depth){
+	PROFILE_ZONE("sortByCell");
+	const std::size_t n = size();
+	mKeys.resize(n);
+	mKeysScratch.resize(n);
+	mOrder.resize(n);
+	mOrderScratch.resize(n);
+	unsigned int maxKey = 0;
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const int x = static_cast<int>(mX[i]), y = static_cast<int>(mY[i]), z = static_cast<int>(mZ[i]);
+		mKeys[i] = MortonLayout::spread(x) | (MortonLayout::spread(y) << 1) | (MortonLayout::spread(z) << 2);
+		mOrder[i] = i;
+		maxKey = std::max(maxKey, mKeys[i]);
+	}
+
+	//Least significant digit radix sort. Every pass is a stable counting sort on the next digit,
+	//so after the last pass the particles are sorted by the whole key. Passes stop at the highest digit in use.
+	for (int shift = 0; shift < 32 && (maxKey >> shift) != 0; shift += RADIX_BITS)
+	{
+		std::size_t offsets[RADIX_BUCKETS] = {};
+		for (std::size_t i = 0; i < n; ++i)
+			++offsets[(mKeys[i] >> shift) & (RADIX_BUCKETS - 1)];
+		std::size_t sum = 0;
+		for (int b = 0; b < RADIX_BUCKETS; ++b)
+		{
+			std::size_t count = offsets[b];
+			offsets[b] = sum;
+			sum += count;
+		}
+		for (std::size_t i = 0; i < n; ++i)
+		{
+			std::size_t destination = offsets[(mKeys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+			mKeysScratch[destination] = mKeys[i];
+			mOrderScratch[destination] = mOrder[i];
+		}
+		mKeys.swap(mKeysScratch);
+		mOrder.swap(mOrderScratch);
+	}
+	permute(mX);
+	permute(mY);
+	permute(mZ);
+	permute(mU);
+	permute(mV);
+	permute(mW);
+
+	//Sorted particles of a cell are next to each other, so each cell is a single range
+	mCellStart.resize(width, height, depth, 0);
+	mCellCount.resize(width, height, depth, 0);
+	for (std::size_t i = 0; i < n; ++i)
+	{
+		const int x = static_cast<int>(mX[i]), y = static_cast<int>(mY[i]), z = static_cast<int>(mZ[i]);
+		if (mCellCount(x, y, z)++ == 0)
+			mCellStart(x, y, z) = i;
+	}
+}
+
+void ParticleStore::permute(Array& values){
+	mScratch.resize(values.size());
+	for (std::size_t i = 0; i < values.size(); ++i)
+		mScratch[i] = values[mOrder[i]];
+	values.swap(mScratch);
+}
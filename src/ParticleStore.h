@@ -0,0 +1,68 @@
+#ifndef _PARTICLESTORE_H_
+#define _PARTICLESTORE_H_
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+#include "AlignedAllocator.h"
+#include "Grid3D.h"
+
+/*
+Positions and velocities of a set of particles, stored as separate arrays per component. A run of particles is then
+a run of consecutive floats per axis, which batched and SIMD code can load directly without shuffling components around.
+Velocities are only used by schemes that carry velocity on the particles (see AdvectionScheme::FLIP).
+*/
+class ParticleStore{
+public:
+	typedef std::vector<float, AlignedAllocator<float, GRID_ALIGNMENT>> Array;
+
+	void add(const glm::vec3& position, const glm::vec3& velocity = glm::vec3(0.0f));
+	//Replaces every particle with count particles copied from the given arrays
+	void assign(std::size_t count, const float* x, const float* y, const float* z, const float* u, const float* v, const float* w);
+	void clear();
+	void reserve(std::size_t count);
+	std::size_t size() const { return mX.size(); }
+	bool empty() const { return mX.empty(); }
+
+	glm::vec3 position(std::size_t i) const { return glm::vec3(mX[i], mY[i], mZ[i]); }
+	float* x() { return mX.data(); }
+	float* y() { return mY.data(); }
+	float* z() { return mZ.data(); }
+	const float* x() const { return mX.data(); }
+	const float* y() const { return mY.data(); }
+	const float* z() const { return mZ.data(); }
+
+	glm::vec3 velocity(std::size_t i) const { return glm::vec3(mU[i], mV[i], mW[i]); }
+	float* u() { return mU.data(); }
+	float* v() { return mV.data(); }
+	float* w() { return mW.data(); }
+	const float* u() const { return mU.data(); }
+	const float* v() const { return mV.data(); }
+	const float* w() const { return mW.data(); }
+
+	//Interleaves the positions into out, e.g. to upload them as an RGB texture
+	void copyTo(std::vector<glm::vec3>& out) const;
+
+	/*
+	Reorders the particles by the Morton code of the cell they are in, so particles close in space are close in memory,
+	and records which particles are in each cell. Every particle has to be inside a grid of the given size.
+	Particles in the same cell keep their relative order.
+	*/
+	void sortByCell(int width, int height, int depth);
+	//Particles in cell (x, y, z) are cellStart(x, y, z) up to cellStart(x, y, z) + cellCount(x, y, z).
+	//Set by sortByCell and only valid until particles are moved or added.
+	const Grid3D<int>& cellStart() const { return mCellStart; }
+	const Grid3D<int>& cellCount() const { return mCellCount; }
+
+private:
+	Array mX, mY, mZ;
+	Array mU, mV, mW;
+	Grid3D<int> mCellStart, mCellCount;
+	//Scratch space for sorting, kept to avoid reallocating every sort
+	std::vector<unsigned int> mKeys, mKeysScratch, mOrder, mOrderScratch;
+	Array mScratch;
+
+	void permute(Array& values);
+};
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef _PRESSURESTENCIL_H_
+#define _PRESSURESTENCIL_H_
+
+#include <algorithm>
+#include <cmath>
+#include <glm/glm.hpp>
+#include "BoundaryConditions.h"
+#include "Grid3D.h"
+
+/*
+Kernels for the pressure equation 6p - (sum of the 6 neighbors of p) = rhs, shared by the Gauss-Seidel pressure solve
+in CFDSimulation and by Multigrid. Each works on a box [begin, end) of interior cells and splits it in two:
+	- the ring of cells next to a wall, which ask the boundary policy for their neighbors in the boundary layer
+	- every other cell, whose neighbors are all interior cells. These go through a loop along x without branches,
+	  walking rows with pointers when the layout stores them contiguously.
+Almost every cell is in the second part, so boundary conditions cost next to nothing in the sweeps.
+*/
+namespace stencil{
+
+	//Whether interior row (y, z) of a grid of the given size is next to a wall along y or z
+	inline bool isRingRow(int y, int z, int height, int depth){
+		return y == 1 || y == height - 2 || z == 1 || z == depth - 2;
+	}
+
+	//Cells of a row relaxed at once by relaxInteriorRow, small enough to keep the results on the stack
+	const int RELAX_CHUNK = 64;
+
+	/*
+	Gauss-Seidel update of the cells of one color in [begin, end) of row (y, z), the first of them being at first.
+	Every cell must have interior neighbors only.
+	With contiguous rows the new value of every cell of the chunk is worked out with unit stride, which the compiler
+	vectorizes, and only the ones of the right color are stored. That does twice the arithmetic of stepping by 2,
+	but in vector registers, and the other color's cells are only read, as they would be anyway.
+	*/
+	template <typename Grid>
+	inline void relaxInteriorRow(Grid& p, const Grid& rhs, int y, int z, int begin, int end, int first){
+		if (Grid::CONTIGUOUS_ROWS)
+		{
+			float* c = &p(0, y, z);
+			const float* yLow = &p(0, y - 1, z);
+			const float* yHigh = &p(0, y + 1, z);
+			const float* zLow = &p(0, y, z - 1);
+			const float* zHigh = &p(0, y, z + 1);
+			const float* b = &rhs(0, y, z);
+			float relaxed[RELAX_CHUNK];
+			for (int chunk = begin; chunk < end; chunk += RELAX_CHUNK)
+			{
+				const int count = std::min(RELAX_CHUNK, end - chunk);
+				for (int i = 0; i < count; ++i)
+				{
+					const int x = chunk + i;
+					relaxed[i] = (c[x + 1] + c[x - 1] + yHigh[x] + yLow[x] + zHigh[x] + zLow[x] + b[x]) / 6.0f;
+				}
+				for (int i = (chunk - first) & 1; i < count; i += 2)
+					c[chunk + i] = relaxed[i];
+			}
+		}
+		else
+		{
+			for (int x = first; x < end; x += 2)
+				p(x, y, z) = (p(x + 1, y, z) + p(x - 1, y, z) + p(x, y + 1, z) + p(x, y - 1, z)
+					+ p(x, y, z + 1) + p(x, y, z - 1) + rhs(x, y, z)) / 6.0f;
+		}
+	}
+
+	/*
+	Red-black Gauss-Seidel update of the cells of one color in [begin, end). Color 0 is the cells where x + y + z is
+	even, color 1 where it is odd. A cell only reads cells of the other color, so boxes can be done in parallel and
+	the result doesn't depend on the order. Same results as updating every cell with pressureNeighborSum.
+	*/
+	template <typename Policy, typename Grid>
+	inline void relaxRedBlack(Grid& p, const Grid& rhs, const glm::ivec3& begin, const glm::ivec3& end, int color){
+		const int w = p.width(), h = p.height(), d = p.depth();
+		auto relaxCell = [&](int x, int y, int z){
+			p(x, y, z) = (pressureNeighborSum<Policy>(p, x, y, z) + rhs(x, y, z)) / 6.0f;
+		};
+		const int xBegin = std::max(begin.x, 2), xEnd = std::min(end.x, w - 2);
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+			{
+				const int first = begin.x + ((begin.x + y + z + color) & 1);
+				if (isRingRow(y, z, h, d))
+				{
+					for (int x = first; x < end.x; x += 2)
+						relaxCell(x, y, z);
+					continue;
+				}
+				//Ends of the row next to the walls along x
+				if (first == 1)
+					relaxCell(1, y, z);
+				if (end.x == w - 1 && w - 2 > 1 && ((w - 2 + y + z + color) & 1) == 0)
+					relaxCell(w - 2, y, z);
+				relaxInteriorRow(p, rhs, y, z, xBegin, xEnd, xBegin + ((xBegin + y + z + color) & 1));
+			}
+	}
+
+	//Writes rhs - (6p - sum of the neighbors of p) for every cell in [begin, end) to r and returns the largest magnitude
+	template <typename Policy, typename Grid>
+	inline float residual(const Grid& p, const Grid& rhs, Grid& r, const glm::ivec3& begin, const glm::ivec3& end){
+		const int w = p.width(), h = p.height(), d = p.depth();
+		float rMax = 0.0f;
+		auto residualCell = [&](int x, int y, int z){
+			const float value = rhs(x, y, z) - (6.0f * p(x, y, z) - pressureNeighborSum<Policy>(p, x, y, z));
+			r(x, y, z) = value;
+			rMax = std::max(rMax, std::abs(value));
+		};
+		const int xBegin = std::max(begin.x, 2), xEnd = std::min(end.x, w - 2);
+		for (int z = begin.z; z < end.z; ++z)
+			for (int y = begin.y; y < end.y; ++y)
+			{
+				if (isRingRow(y, z, h, d))
+				{
+					for (int x = begin.x; x < end.x; ++x)
+						residualCell(x, y, z);
+					continue;
+				}
+				if (begin.x == 1)
+					residualCell(1, y, z);
+				if (end.x == w - 1 && w - 2 > 1)
+					residualCell(w - 2, y, z);
+				if (Grid::CONTIGUOUS_ROWS)
+				{
+					const float* c = &p(0, y, z);
+					const float* yLow = &p(0, y - 1, z);
+					const float* yHigh = &p(0, y + 1, z);
+					const float* zLow = &p(0, y, z - 1);
+					const float* zHigh = &p(0, y, z + 1);
+					const float* b = &rhs(0, y, z);
+					float* out = &r(0, y, z);
+					for (int x = xBegin; x < xEnd; ++x)
+					{
+						const float value = b[x] - (6.0f * c[x] - (c[x + 1] + c[x - 1] + yHigh[x] + yLow[x] + zHigh[x] + zLow[x]));
+						out[x] = value;
+						rMax = std::max(rMax, std::abs(value));
+					}
+				}
+				else
+				{
+					for (int x = xBegin; x < xEnd; ++x)
+					{
+						const float value = rhs(x, y, z) - (6.0f * p(x, y, z) - (p(x + 1, y, z) + p(x - 1, y, z)
+							+ p(x, y + 1, z) + p(x, y - 1, z) + p(x, y, z + 1) + p(x, y, z - 1)));
+						r(x, y, z) = value;
+						rMax = std::max(rMax, std::abs(value));
+					}
+				}
+			}
+		return rMax;
+	}
+}
+
+#endif
@@ -0,0 +1,125 @@
+#include "Profiler.h"
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace{
+
+	struct Event{
+		const char* name;
+		std::uint64_t start, end;
+	};
+
+	//Zones recorded by one thread. Only that thread writes to it.
+	struct ThreadBuffer{
+		unsigned int id;
+		std::string name;
+		std::vector<Event> events;
+		//Total number of zones recorded, the next one goes to count % RING_SIZE
+		std::atomic<std::size_t> count;
+
+		ThreadBuffer(unsigned int id, const std::string& name) :id(id), name(name), events(profiler::RING_SIZE), count(0){}
+	};
+
+	const std::chrono::steady_clock::time_point gStart = std::chrono::steady_clock::now();
+	//Static initialization runs on the thread the program started on
+	const std::thread::id gMainThread = std::this_thread::get_id();
+
+	//Buffers of every thread that recorded a zone. Kept until the program exits, even if the thread doesn't,
+	//so their zones can still be written out. The mutex is only taken when a thread records its first zone.
+	std::mutex gBuffersMutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> gBuffers;
+
+	thread_local ThreadBuffer* tBuffer = nullptr;
+	//Name given with setThreadName, used once the thread registers its buffer
+	thread_local std::string tName;
+
+	ThreadBuffer& threadBuffer(){
+		if (!tBuffer)
+		{
+			std::lock_guard<std::mutex> lock(gBuffersMutex);
+			const unsigned int id = gBuffers.size();
+			std::string name = tName;
+			if (name.empty())
+				name = std::this_thread::get_id() == gMainThread ? "main" : "thread " + std::to_string(id);
+			gBuffers.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer(id, name)));
+			tBuffer = gBuffers.back().get();
+		}
+		return *tBuffer;
+	}
+
+	//Writes s as a JSON string, escaping the characters that need it
+	void writeString(FILE* file, const char* s){
+		std::fputc('"', file);
+		for (; *s; ++s)
+		{
+			if (*s == '"' || *s == '\\')
+				std::fputc('\\', file);
+			if (static_cast<unsigned char>(*s) >= 0x20)
+				std::fputc(*s, file);
+		}
+		std::fputc('"', file);
+	}
+}
+
+std::uint64_t profiler::now(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gStart).count();
+}
+
+void profiler::record(const char* name, std::uint64_t start, std::uint64_t end){
+	ThreadBuffer& buffer = threadBuffer();
+	const std::size_t count = buffer.count.load(std::memory_order_relaxed);
+	Event& event = buffer.events[count % RING_SIZE];
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	buffer.count.store(count + 1, std::memory_order_release);
+}
+
+bool profiler::writeChromeTrace(const std::string& path){
+	FILE* file = std::fopen(path.c_str(), "w");
+	if (!file)
+		return false;
+	std::lock_guard<std::mutex> lock(gBuffersMutex);
+	std::fprintf(file, "{\"traceEvents\":[\n");
+	bool first = true;
+	for (const std::unique_ptr<ThreadBuffer>& buffer : gBuffers)
+	{
+		std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":",
+			first ? "" : ",\n", buffer->id);
+		writeString(file, buffer->name.c_str());
+		std::fprintf(file, "}}");
+		first = false;
+		//Oldest zone still in the ring first. Times are in microseconds, with the nanoseconds kept as decimals.
+		const std::size_t count = buffer->count.load(std::memory_order_acquire);
+		const std::size_t begin = count > RING_SIZE ? count - RING_SIZE : 0;
+		for (std::size_t i = begin; i < count; ++i)
+		{
+			const Event& event = buffer->events[i % RING_SIZE];
+			std::fprintf(file, ",\n{\"name\":");
+			writeString(file, event.name);
+			std::fprintf(file, ",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				buffer->id, event.start * 1e-3, (event.end - event.start) * 1e-3);
+		}
+	}
+	std::fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	return std::fclose(file) == 0;
+}
+
+void profiler::clear(){
+	std::lock_guard<std::mutex> lock(gBuffersMutex);
+	for (const std::unique_ptr<ThreadBuffer>& buffer : gBuffers)
+		buffer->count.store(0, std::memory_order_release);
+}
+
+void profiler::setThreadName(const std::string& name){
+	tName = name;
+	if (tBuffer)
+	{
+		std::lock_guard<std::mutex> lock(gBuffersMutex);
+		tBuffer->name = name;
+	}
+}
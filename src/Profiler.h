@@ -0,0 +1,68 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+Scoped timing zones for finding out where a frame goes. PROFILE_ZONE("name") times the rest of the enclosing scope
+and records it in a ring buffer owned by the calling thread, so recording never locks or allocates. Once a buffer is
+full the oldest zones are overwritten. writeChromeTrace saves what the buffers hold in the Chrome trace_event format,
+to open in chrome://tracing or Perfetto with one row per thread.
+
+Zones are only compiled in when FLUIDSIM_PROFILE is defined (the CMake option of the same name, Debug builds of the
+Visual Studio project). Otherwise PROFILE_ZONE expands to nothing and the buffers stay empty.
+*/
+namespace profiler{
+
+	//Zones kept per thread before the oldest are overwritten
+	const std::size_t RING_SIZE = 1 << 16;
+
+#ifdef FLUIDSIM_PROFILE
+	const bool ENABLED = true;
+#else
+	const bool ENABLED = false;
+#endif
+
+	//Nanoseconds on the steady clock since the profiler was loaded
+	std::uint64_t now();
+
+	//Adds a finished zone to the calling thread's buffer. name has to outlive the profiler, usually a string literal.
+	void record(const char* name, std::uint64_t start, std::uint64_t end);
+
+	/*
+	Writes every zone in the buffers to path as Chrome trace_event JSON. Threads must not be recording zones
+	at the same time, e.g. call it between frames or once the simulation is done.
+	@return false if the file couldn't be written
+	*/
+	bool writeChromeTrace(const std::string& path);
+
+	//Drops every recorded zone. Same restriction as writeChromeTrace.
+	void clear();
+
+	//Names the calling thread's row in the trace. Threads that don't set one are called "main" if they are the thread
+	//the program started on, "thread N" otherwise.
+	void setThreadName(const std::string& name);
+
+	class Zone{
+	public:
+		explicit Zone(const char* name) :mName(name), mStart(now()){}
+		~Zone(){ record(mName, mStart, now()); }
+		Zone(const Zone&) = delete;
+		Zone& operator=(const Zone&) = delete;
+	private:
+		const char* mName;
+		std::uint64_t mStart;
+	};
+}
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#ifdef FLUIDSIM_PROFILE
+#define PROFILE_ZONE(name) profiler::Zone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <exception>
+#include <string>
+#include "Profiler.h"
+
+//Chunks per thread for parallel loops. More than one lets idle threads steal work from slow ones.
+const int CHUNKS_PER_THREAD = 4;
+
+//Pool and worker number of the current thread, if it is a worker.
+static thread_local ThreadPool* tPool = nullptr;
+static thread_local unsigned int tWorkerIndex = 0;
+
+ThreadPool::ThreadPool(){
+	unsigned int hardwareThreads = std::thread::hardware_concurrency();
+	start(hardwareThreads > 1 ? hardwareThreads - 1 : 0);
+}
+
+ThreadPool::ThreadPool(unsigned int workerCount){
+	start(workerCount);
+}
+
+ThreadPool::~ThreadPool(){
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		mStop = true;
+	}
+	mSleep.notify_all();
+	for (auto &worker : mWorkers)
+		worker.join();
+}
+
+void ThreadPool::start(unsigned int workerCount){
+	mQueued = 0;
+	mNextQueue = 0;
+	mStop = false;
+	//Always keep at least one queue so tasks pushed by parallelChunks have somewhere to go
+	for (unsigned int i = 0; i < std::max(workerCount, 1u); ++i)
+		mQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+	for (unsigned int i = 0; i < workerCount; ++i)
+		mWorkers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task){
+	auto packaged = std::make_shared<std::packaged_task<void()>>(task);
+	std::future<void> future = packaged->get_future();
+	if (mWorkers.empty())
+		(*packaged)();
+	else
+		push([packaged](){ (*packaged)(); });
+	return future;
+}
+
+void ThreadPool::parallelChunks(int begin, int end, int chunks, const std::function<void(int, int, int)>& body){
+	int size = end - begin;
+	if (size <= 0)
+		return;
+	chunks = std::max(1, std::min(chunks, size));
+	if (chunks == 1 || mWorkers.empty())
+	{
+		for (int c = 0; c < chunks; ++c)
+			body(c, begin + size * c / chunks, begin + size * (c + 1) / chunks);
+		return;
+	}
+	//A chunk that throws still counts as done, so the wait below always ends. Queued chunks refer to this frame,
+	//so the first exception is only rethrown once every chunk is done.
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto run = [&](int c, int chunkBegin, int chunkEnd){
+		try
+		{
+			body(c, chunkBegin, chunkEnd);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error)
+				error = std::current_exception();
+		}
+	};
+	//Queue every chunk but the first, which the calling thread does right away.
+	std::atomic<int> remaining(chunks - 1);
+	for (int c = 1; c < chunks; ++c)
+	{
+		//Queued chunks get a zone to show which thread ran them. The first chunk is covered by the zone of whatever called this.
+		//The zone ends before the chunk counts as done, so nothing is still recording once parallelChunks returns.
+		push([&, c](){
+			{
+				PROFILE_ZONE("chunk");
+				run(c, begin + size * c / chunks, begin + size * (c + 1) / chunks);
+			}
+			--remaining;
+		});
+	}
+	run(0, begin, begin + size / chunks);
+	//Help out with queued tasks until the other chunks are done
+	while (remaining > 0)
+	{
+		if (!runPendingTask())
+			std::this_thread::yield();
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
+int ThreadPool::chunkCount(int size) const{
+	return std::max(1, std::min(size, CHUNKS_PER_THREAD * static_cast<int>(mWorkers.size() + 1)));
+}
+
+void ThreadPool::push(std::function<void()> task){
+	//Workers push onto their own queue, everyone else spreads tasks over all the queues
+	unsigned int index = tPool == this ? tWorkerIndex : mNextQueue++ % mQueues.size();
+	{
+		std::lock_guard<std::mutex> lock(mQueues[index]->mutex);
+		mQueues[index]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(mSleepMutex);
+		++mQueued;
+	}
+	mSleep.notify_one();
+}
+
+bool ThreadPool::runPendingTask(){
+	std::function<void()> task;
+	unsigned int own = tPool == this ? tWorkerIndex : 0;
+	//Newest task from our own queue first, it is the most likely to still be in cache
+	{
+		std::lock_guard<std::mutex> lock(mQueues[own]->mutex);
+		if (!mQueues[own]->tasks.empty())
+		{
+			task = std::move(mQueues[own]->tasks.back());
+			mQueues[own]->tasks.pop_back();
+		}
+	}
+	//Otherwise steal the oldest task from someone else
+	for (unsigned int i = 1; !task && i < mQueues.size(); ++i)
+	{
+		WorkQueue& queue = *mQueues[(own + i) % mQueues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty())
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+	}
+	if (!task)
+		return false;
+	--mQueued;
+	task();
+	return true;
+}
+
+void ThreadPool::workerLoop(unsigned int index){
+	tPool = this;
+	tWorkerIndex = index;
+	if (profiler::ENABLED)
+		profiler::setThreadName("worker " + std::to_string(index));
+	while (true)
+	{
+		if (runPendingTask())
+			continue;
+		std::unique_lock<std::mutex> lock(mSleepMutex);
+		mSleep.wait(lock, [this](){ return mStop || mQueued > 0; });
+		if (mStop && mQueued == 0)
+			return;
+	}
+}
+
+void util::parallelFor(ThreadPool* pool, int begin, int end, const std::function<void(int, int)>& body){
+	if (pool == nullptr)
+	{
+		if (begin < end)
+			body(begin, end);
+		return;
+	}
+	pool->parallelChunks(begin, end, pool->chunkCount(end - begin), [&](int, int chunkBegin, int chunkEnd){
+		body(chunkBegin, chunkEnd);
+	});
+}
+
+double util::parallelSum(ThreadPool* pool, int begin, int end, const std::function<double(int, int)>& body){
+	if (pool == nullptr)
+		return begin < end ? body(begin, end) : 0.0;
+	int chunks = pool->chunkCount(end - begin);
+	std::vector<double> partial(chunks, 0.0);
+	pool->parallelChunks(begin, end, chunks, [&](int chunk, int chunkBegin, int chunkEnd){
+		partial[chunk] = body(chunkBegin, chunkEnd);
+	});
+	double sum = 0.0;
+	for (double p : partial)
+		sum += p;
+	return sum;
+}
+
+float util::parallelMax(ThreadPool* pool, int begin, int end, const std::function<float(int, int)>& body){
+	if (pool == nullptr)
+		return begin < end ? body(begin, end) : 0.0f;
+	int chunks = pool->chunkCount(end - begin);
+	std::vector<float> partial(chunks, 0.0f);
+	pool->parallelChunks(begin, end, chunks, [&](int chunk, int chunkBegin, int chunkEnd){
+		partial[chunk] = body(chunkBegin, chunkEnd);
+	});
+	return *std::max_element(partial.begin(), partial.end());
+}
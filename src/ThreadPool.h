@@ -0,0 +1,86 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+Persistent pool of worker threads. Every worker has its own queue of tasks. Workers take the newest task from their
+own queue and, once that is empty, steal the oldest task from another worker's queue. A thread that waits on
+parallelChunks runs queued tasks while it waits, so parallel loops can be started from inside a task.
+*/
+class ThreadPool{
+public:
+	//Starts one worker per hardware thread, minus one for the thread that submits the work.
+	ThreadPool();
+	//Starts the given number of workers. With 0 workers every task runs on the thread that submits it.
+	explicit ThreadPool(unsigned int workerCount);
+	~ThreadPool();
+
+	//Queues a task, the returned future becomes ready once it has run.
+	std::future<void> submit(std::function<void()> task);
+
+	/*
+	Splits [begin, end) into chunks of (almost) equal size and runs body(chunk, chunkBegin, chunkEnd) for each one,
+	spread over the workers and the calling thread. Returns once every chunk is done. If any chunk throws, the other
+	chunks still run and the first exception caught is rethrown on the calling thread.
+	@param begin first index of the range
+	@param end one past the last index of the range
+	@param chunks number of chunks, clamped to the size of the range
+	@param body function called for each chunk with its number and bounds
+	*/
+	void parallelChunks(int begin, int end, int chunks, const std::function<void(int, int, int)>& body);
+
+	//Number of chunks parallel loops over a range of the given size are split into.
+	//Only depends on the size and the number of workers, so reductions over the chunks are repeatable.
+	int chunkCount(int size) const;
+
+	unsigned int workerCount() const { return mWorkers.size(); }
+
+private:
+	struct WorkQueue{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkQueue>> mQueues;
+	std::vector<std::thread> mWorkers;
+
+	//Workers sleep on this while every queue is empty
+	std::mutex mSleepMutex;
+	std::condition_variable mSleep;
+	//Number of tasks sitting in the queues
+	std::atomic<int> mQueued;
+	//Queue that the next task submitted from outside the pool goes to
+	std::atomic<unsigned int> mNextQueue;
+	bool mStop;
+
+	void start(unsigned int workerCount);
+	void push(std::function<void()> task);
+	bool runPendingTask();
+	void workerLoop(unsigned int index);
+};
+
+namespace util{
+
+	/*
+	Runs body(chunkBegin, chunkEnd) over chunks of [begin, end) on the pool, or once over the whole range
+	on the calling thread if pool is null.
+	*/
+	void parallelFor(ThreadPool* pool, int begin, int end, const std::function<void(int, int)>& body);
+
+	//Same as parallelFor, but adds up the values returned for each chunk. Chunks are added in order,
+	//so the result is the same on every run with the same number of workers.
+	double parallelSum(ThreadPool* pool, int begin, int end, const std::function<double(int, int)>& body);
+
+	//Same as parallelFor, but returns the largest value returned for a chunk, or 0 for an empty range.
+	float parallelMax(ThreadPool* pool, int begin, int end, const std::function<float(int, int)>& body);
+}
+#endif
@@ -0,0 +1,357 @@
+#include "TrilinearSampler.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SAMPLER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+//GCC and Clang only emit AVX instructions in functions that ask for them. MSVC emits them anywhere.
+//AVX-512 comes with fused multiply-adds, which they must not contract the interpolation into
+//or the results would no longer match the other kernels.
+#if defined(SAMPLER_X86) && defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#pragma clang fp contract(off)
+#elif defined(SAMPLER_X86) && defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+//GCC's own AVX-512 headers trip this warning
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+namespace{
+
+	//Everything a kernel needs to know about a grid with a linear layout
+	struct LinearGrid{
+		const float* data;
+		int pitch, slice;
+	};
+
+	//How the velocity kernels treat one axis of a component's grid. Points are clamped to [low, high] and their first
+	//corner to lastCorner. With fold set the first and last cells are the boundary layer, which holds mirror times the
+	//cell next to it: points next to one interpolate the inside cell alone, and the result is scaled to make up for it.
+	struct Axis{
+		float offset, low, high;
+		int lastCorner;
+		bool fold;
+	};
+
+	//The axes of the grid q of the velocity component normal to axis (see sampler::sampleVelocity)
+	void velocityAxes(const Grid3D<float>& q, int axis, Axis axes[3]){
+		const int size[3] = { q.width(), q.height(), q.depth() };
+		for (int a = 0; a < 3; ++a)
+		{
+			//Along the axis the component is normal to, faces 1 and size - 2 are on the walls
+			const bool normal = a == axis;
+			axes[a].offset = normal ? 0.0f : 0.5f;
+			axes[a].low = normal ? 1.0f : 0.0f;
+			axes[a].high = normal ? size[a] - 2.0f : size[a] - 1.0f;
+			axes[a].lastCorner = size[a] - 2;
+			axes[a].fold = !normal;
+		}
+	}
+
+	//The SIMD kernels compute storage indices themselves, which they can only do for the linear layout
+	inline bool toLinearGrid(const LinearLayout& layout, LinearGrid& grid){
+		grid.pitch = layout.pitch;
+		grid.slice = layout.slice;
+		return true;
+	}
+	template <typename Layout>
+	bool toLinearGrid(const Layout&, LinearGrid&){
+		return false;
+	}
+
+	inline float interpolateScalar(const Grid3D<float>& q, int x0, int y0, int z0, float fx, float fy, float fz){
+		float c00 = q(x0, y0, z0) + fx * (q(x0 + 1, y0, z0) - q(x0, y0, z0));
+		float c10 = q(x0, y0 + 1, z0) + fx * (q(x0 + 1, y0 + 1, z0) - q(x0, y0 + 1, z0));
+		float c01 = q(x0, y0, z0 + 1) + fx * (q(x0 + 1, y0, z0 + 1) - q(x0, y0, z0 + 1));
+		float c11 = q(x0, y0 + 1, z0 + 1) + fx * (q(x0 + 1, y0 + 1, z0 + 1) - q(x0, y0 + 1, z0 + 1));
+		float c0 = c00 + fy * (c10 - c00);
+		float c1 = c01 + fy * (c11 - c01);
+		return c0 + fz * (c1 - c0);
+	}
+
+	//Clamps coordinate p of a point along axis a and splits it into the first corner and the fraction.
+	//Folds the boundary layer into scale if the axis has one.
+	inline void splitScalar(float p, const Axis& a, float mirror, int& corner, float& fraction, float& scale){
+		const float c = std::min(std::max(a.low, p - a.offset), a.high);
+		corner = std::min(static_cast<int>(c), a.lastCorner);
+		fraction = c - corner;
+		if (!a.fold)
+			return;
+		const bool low = corner == 0, high = corner == a.lastCorner;
+		scale *= low ? fraction + mirror * (1.0f - fraction) : (high ? (1.0f - fraction) + mirror * fraction : 1.0f);
+		corner += low;
+		if (low || high)
+			fraction = 0.0f;
+	}
+
+	void sampleVelocityScalar(const Grid3D<float>& q, const Axis axes[3], float mirror,
+		const float* x, const float* y, const float* z, int count, float* out){
+		for (int i = 0; i < count; ++i)
+		{
+			int x0, y0, z0;
+			float fx, fy, fz, scale = 1.0f;
+			splitScalar(x[i], axes[0], mirror, x0, fx, scale);
+			splitScalar(y[i], axes[1], mirror, y0, fy, scale);
+			splitScalar(z[i], axes[2], mirror, z0, fz, scale);
+			out[i] = interpolateScalar(q, x0, y0, z0, fx, fy, fz) * scale;
+		}
+	}
+
+	void sampleWeightsScalar(const Grid3D<float>& q, const sampler::Weights& w, int begin, float* out){
+		for (int i = begin; i < w.count; ++i)
+			out[i] = interpolateScalar(q, w.x[i], w.y[i], w.z[i], w.fx[i], w.fy[i], w.fz[i]);
+	}
+
+#ifdef SAMPLER_X86
+	//Interpolates 8 points of g given the first corner of their cells and how far into them they are
+	TARGET_AVX2 inline __m256 interpolateAVX2(const float* data, __m256i pitch, __m256i slice,
+		__m256i x0, __m256i y0, __m256i z0, __m256 fx, __m256 fy, __m256 fz){
+		const __m256i one = _mm256_set1_epi32(1);
+		__m256i i000 = _mm256_add_epi32(x0, _mm256_add_epi32(_mm256_mullo_epi32(y0, pitch), _mm256_mullo_epi32(z0, slice)));
+		__m256i i010 = _mm256_add_epi32(i000, pitch);
+		__m256i i001 = _mm256_add_epi32(i000, slice);
+		__m256i i011 = _mm256_add_epi32(i010, slice);
+		__m256 q000 = _mm256_i32gather_ps(data, i000, 4);
+		__m256 q100 = _mm256_i32gather_ps(data, _mm256_add_epi32(i000, one), 4);
+		__m256 q010 = _mm256_i32gather_ps(data, i010, 4);
+		__m256 q110 = _mm256_i32gather_ps(data, _mm256_add_epi32(i010, one), 4);
+		__m256 q001 = _mm256_i32gather_ps(data, i001, 4);
+		__m256 q101 = _mm256_i32gather_ps(data, _mm256_add_epi32(i001, one), 4);
+		__m256 q011 = _mm256_i32gather_ps(data, i011, 4);
+		__m256 q111 = _mm256_i32gather_ps(data, _mm256_add_epi32(i011, one), 4);
+
+		//a + f * (b - a) without fused multiply-adds, to round the same way as the scalar code
+		__m256 c00 = _mm256_add_ps(q000, _mm256_mul_ps(fx, _mm256_sub_ps(q100, q000)));
+		__m256 c10 = _mm256_add_ps(q010, _mm256_mul_ps(fx, _mm256_sub_ps(q110, q010)));
+		__m256 c01 = _mm256_add_ps(q001, _mm256_mul_ps(fx, _mm256_sub_ps(q101, q001)));
+		__m256 c11 = _mm256_add_ps(q011, _mm256_mul_ps(fx, _mm256_sub_ps(q111, q011)));
+		__m256 c0 = _mm256_add_ps(c00, _mm256_mul_ps(fy, _mm256_sub_ps(c10, c00)));
+		__m256 c1 = _mm256_add_ps(c01, _mm256_mul_ps(fy, _mm256_sub_ps(c11, c01)));
+		return _mm256_add_ps(c0, _mm256_mul_ps(fz, _mm256_sub_ps(c1, c0)));
+	}
+
+	//splitScalar for 8 points
+	TARGET_AVX2 inline void splitAVX2(__m256 p, const Axis& a, __m256 mirror, __m256i& corner, __m256& fraction, __m256& scale){
+		const __m256i last = _mm256_set1_epi32(a.lastCorner);
+		//max returns its second operand for NaN, which clamps those to the low side as the scalar code does
+		const __m256 c = _mm256_min_ps(_mm256_max_ps(_mm256_sub_ps(p, _mm256_set1_ps(a.offset)), _mm256_set1_ps(a.low)), _mm256_set1_ps(a.high));
+		corner = _mm256_min_epi32(_mm256_cvttps_epi32(c), last);
+		fraction = _mm256_sub_ps(c, _mm256_cvtepi32_ps(corner));
+		if (!a.fold)
+			return;
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256i low = _mm256_cmpeq_epi32(corner, _mm256_setzero_si256());
+		const __m256i high = _mm256_cmpeq_epi32(corner, last);
+		const __m256 lowScale = _mm256_add_ps(fraction, _mm256_mul_ps(mirror, _mm256_sub_ps(one, fraction)));
+		const __m256 highScale = _mm256_add_ps(_mm256_sub_ps(one, fraction), _mm256_mul_ps(mirror, fraction));
+		const __m256 s = _mm256_blendv_ps(_mm256_blendv_ps(one, highScale, _mm256_castsi256_ps(high)), lowScale, _mm256_castsi256_ps(low));
+		scale = _mm256_mul_ps(scale, s);
+		//The masks are -1 where set
+		corner = _mm256_sub_epi32(corner, low);
+		fraction = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_or_si256(low, high)), fraction);
+	}
+
+	TARGET_AVX2 void sampleVelocityAVX2(const LinearGrid& g, const Axis axes[3], float mirror,
+		const float* px, const float* py, const float* pz, int count, float* out){
+		const __m256i pitch = _mm256_set1_epi32(g.pitch), slice = _mm256_set1_epi32(g.slice);
+		const __m256 m = _mm256_set1_ps(mirror);
+		for (int i = 0; i + 8 <= count; i += 8)
+		{
+			__m256i x0, y0, z0;
+			__m256 fx, fy, fz, scale = _mm256_set1_ps(1.0f);
+			splitAVX2(_mm256_loadu_ps(px + i), axes[0], m, x0, fx, scale);
+			splitAVX2(_mm256_loadu_ps(py + i), axes[1], m, y0, fy, scale);
+			splitAVX2(_mm256_loadu_ps(pz + i), axes[2], m, z0, fz, scale);
+			_mm256_storeu_ps(out + i, _mm256_mul_ps(interpolateAVX2(g.data, pitch, slice, x0, y0, z0, fx, fy, fz), scale));
+		}
+	}
+
+	//Interpolates 8 points at a time whose weights are already worked out
+	TARGET_AVX2 void sampleWeightsAVX2(const LinearGrid& g, const sampler::Weights& w, int count, float* out){
+		const __m256i pitch = _mm256_set1_epi32(g.pitch), slice = _mm256_set1_epi32(g.slice);
+		for (int i = 0; i + 8 <= count; i += 8)
+		{
+			__m256i x0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w.x + i));
+			__m256i y0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w.y + i));
+			__m256i z0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(w.z + i));
+			_mm256_storeu_ps(out + i, interpolateAVX2(g.data, pitch, slice, x0, y0, z0,
+				_mm256_loadu_ps(w.fx + i), _mm256_loadu_ps(w.fy + i), _mm256_loadu_ps(w.fz + i)));
+		}
+	}
+
+	TARGET_AVX512 inline __m512 interpolateAVX512(const float* data, __m512i pitch, __m512i slice,
+		__m512i x0, __m512i y0, __m512i z0, __m512 fx, __m512 fy, __m512 fz){
+		const __m512i one = _mm512_set1_epi32(1);
+		__m512i i000 = _mm512_add_epi32(x0, _mm512_add_epi32(_mm512_mullo_epi32(y0, pitch), _mm512_mullo_epi32(z0, slice)));
+		__m512i i010 = _mm512_add_epi32(i000, pitch);
+		__m512i i001 = _mm512_add_epi32(i000, slice);
+		__m512i i011 = _mm512_add_epi32(i010, slice);
+		__m512 q000 = _mm512_i32gather_ps(i000, data, 4);
+		__m512 q100 = _mm512_i32gather_ps(_mm512_add_epi32(i000, one), data, 4);
+		__m512 q010 = _mm512_i32gather_ps(i010, data, 4);
+		__m512 q110 = _mm512_i32gather_ps(_mm512_add_epi32(i010, one), data, 4);
+		__m512 q001 = _mm512_i32gather_ps(i001, data, 4);
+		__m512 q101 = _mm512_i32gather_ps(_mm512_add_epi32(i001, one), data, 4);
+		__m512 q011 = _mm512_i32gather_ps(i011, data, 4);
+		__m512 q111 = _mm512_i32gather_ps(_mm512_add_epi32(i011, one), data, 4);
+
+		__m512 c00 = _mm512_add_ps(q000, _mm512_mul_ps(fx, _mm512_sub_ps(q100, q000)));
+		__m512 c10 = _mm512_add_ps(q010, _mm512_mul_ps(fx, _mm512_sub_ps(q110, q010)));
+		__m512 c01 = _mm512_add_ps(q001, _mm512_mul_ps(fx, _mm512_sub_ps(q101, q001)));
+		__m512 c11 = _mm512_add_ps(q011, _mm512_mul_ps(fx, _mm512_sub_ps(q111, q011)));
+		__m512 c0 = _mm512_add_ps(c00, _mm512_mul_ps(fy, _mm512_sub_ps(c10, c00)));
+		__m512 c1 = _mm512_add_ps(c01, _mm512_mul_ps(fy, _mm512_sub_ps(c11, c01)));
+		return _mm512_add_ps(c0, _mm512_mul_ps(fz, _mm512_sub_ps(c1, c0)));
+	}
+
+	TARGET_AVX512 inline void splitAVX512(__m512 p, const Axis& a, __m512 mirror, __m512i& corner, __m512& fraction, __m512& scale){
+		const __m512i last = _mm512_set1_epi32(a.lastCorner);
+		const __m512 c = _mm512_min_ps(_mm512_max_ps(_mm512_sub_ps(p, _mm512_set1_ps(a.offset)), _mm512_set1_ps(a.low)), _mm512_set1_ps(a.high));
+		corner = _mm512_min_epi32(_mm512_cvttps_epi32(c), last);
+		fraction = _mm512_sub_ps(c, _mm512_cvtepi32_ps(corner));
+		if (!a.fold)
+			return;
+		const __m512 one = _mm512_set1_ps(1.0f);
+		const __mmask16 low = _mm512_cmpeq_epi32_mask(corner, _mm512_setzero_si512());
+		const __mmask16 high = _mm512_cmpeq_epi32_mask(corner, last);
+		const __m512 lowScale = _mm512_add_ps(fraction, _mm512_mul_ps(mirror, _mm512_sub_ps(one, fraction)));
+		const __m512 highScale = _mm512_add_ps(_mm512_sub_ps(one, fraction), _mm512_mul_ps(mirror, fraction));
+		scale = _mm512_mul_ps(scale, _mm512_mask_blend_ps(low, _mm512_mask_blend_ps(high, one, highScale), lowScale));
+		corner = _mm512_mask_add_epi32(corner, low, corner, _mm512_set1_epi32(1));
+		fraction = _mm512_maskz_mov_ps(static_cast<__mmask16>(~(low | high)), fraction);
+	}
+
+	TARGET_AVX512 void sampleVelocityAVX512(const LinearGrid& g, const Axis axes[3], float mirror,
+		const float* px, const float* py, const float* pz, int count, float* out){
+		const __m512i pitch = _mm512_set1_epi32(g.pitch), slice = _mm512_set1_epi32(g.slice);
+		const __m512 m = _mm512_set1_ps(mirror);
+		for (int i = 0; i + 16 <= count; i += 16)
+		{
+			__m512i x0, y0, z0;
+			__m512 fx, fy, fz, scale = _mm512_set1_ps(1.0f);
+			splitAVX512(_mm512_loadu_ps(px + i), axes[0], m, x0, fx, scale);
+			splitAVX512(_mm512_loadu_ps(py + i), axes[1], m, y0, fy, scale);
+			splitAVX512(_mm512_loadu_ps(pz + i), axes[2], m, z0, fz, scale);
+			_mm512_storeu_ps(out + i, _mm512_mul_ps(interpolateAVX512(g.data, pitch, slice, x0, y0, z0, fx, fy, fz), scale));
+		}
+	}
+
+	TARGET_AVX512 void sampleWeightsAVX512(const LinearGrid& g, const sampler::Weights& w, int count, float* out){
+		const __m512i pitch = _mm512_set1_epi32(g.pitch), slice = _mm512_set1_epi32(g.slice);
+		for (int i = 0; i + 16 <= count; i += 16)
+		{
+			__m512i x0 = _mm512_loadu_si512(w.x + i);
+			__m512i y0 = _mm512_loadu_si512(w.y + i);
+			__m512i z0 = _mm512_loadu_si512(w.z + i);
+			_mm512_storeu_ps(out + i, interpolateAVX512(g.data, pitch, slice, x0, y0, z0,
+				_mm512_loadu_ps(w.fx + i), _mm512_loadu_ps(w.fy + i), _mm512_loadu_ps(w.fz + i)));
+		}
+	}
+#endif
+
+	sampler::Kernel detectKernel(){
+#if defined(SAMPLER_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return sampler::Kernel::SCALAR;
+		//The OS has to save the AVX registers on a context switch, which it reports through XCR0
+		__cpuid(info, 1);
+		if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)))
+			return sampler::Kernel::SCALAR;
+		unsigned long long xcr0 = _xgetbv(0);
+		__cpuidex(info, 7, 0);
+		if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6)
+			return sampler::Kernel::AVX512;
+		if ((info[1] & (1 << 5)) && (xcr0 & 0x6) == 0x6)
+			return sampler::Kernel::AVX2;
+		return sampler::Kernel::SCALAR;
+#elif defined(SAMPLER_X86) && (defined(__GNUC__) || defined(__clang__))
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+			return sampler::Kernel::AVX512;
+		if (__builtin_cpu_supports("avx2"))
+			return sampler::Kernel::AVX2;
+		return sampler::Kernel::SCALAR;
+#else
+		return sampler::Kernel::SCALAR;
+#endif
+	}
+
+	const sampler::Kernel sBestKernel = detectKernel();
+	sampler::Kernel sKernel = sBestKernel;
+}
+
+namespace sampler{
+
+	Kernel kernel(){
+		return sKernel;
+	}
+
+	Kernel bestKernel(){
+		return sBestKernel;
+	}
+
+	bool setKernel(Kernel kernel){
+		if (static_cast<int>(kernel) > static_cast<int>(sBestKernel))
+			return false;
+		sKernel = kernel;
+		return true;
+	}
+
+	void sampleVelocity(const Grid3D<float>& q, int axis, float mirror, const float* x, const float* y, const float* z, int count, float* out){
+		Axis axes[3];
+		velocityAxes(q, axis, axes);
+		int done = 0;
+#ifdef SAMPLER_X86
+		LinearGrid grid;
+		if (sKernel != Kernel::SCALAR && toLinearGrid(q.layout(), grid))
+		{
+			grid.data = q.data();
+			//Full vectors go to the kernel, the rest is done below
+			if (sKernel == Kernel::AVX512)
+			{
+				done = count / 16 * 16;
+				sampleVelocityAVX512(grid, axes, mirror, x, y, z, done, out);
+			}
+			else
+			{
+				done = count / 8 * 8;
+				sampleVelocityAVX2(grid, axes, mirror, x, y, z, done, out);
+			}
+		}
+#endif
+		sampleVelocityScalar(q, axes, mirror, x + done, y + done, z + done, count - done, out + done);
+	}
+
+	void sample(const Grid3D<float>& q, const Weights& weights, float* out){
+		int done = 0;
+#ifdef SAMPLER_X86
+		LinearGrid grid;
+		if (sKernel != Kernel::SCALAR && toLinearGrid(q.layout(), grid))
+		{
+			grid.data = q.data();
+			if (sKernel == Kernel::AVX512)
+			{
+				done = weights.count / 16 * 16;
+				sampleWeightsAVX512(grid, weights, done, out);
+			}
+			else
+			{
+				done = weights.count / 8 * 8;
+				sampleWeightsAVX2(grid, weights, done, out);
+			}
+		}
+#endif
+		sampleWeightsScalar(q, weights, done, out);
+	}
+}
@@ -0,0 +1,82 @@
+#ifndef _TRILINEARSAMPLER_H_
+#define _TRILINEARSAMPLER_H_
+
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "Grid3D.h"
+
+//Number of points the simulation hands to the sampler at once. Large enough to keep the vector units busy,
+//small enough that the positions and results stay in L1.
+const int SAMPLE_BATCH = 64;
+
+/*
+Trilinear interpolation of grids in batches. q(x, y, z) is taken to be the value at (x, y, z) + offset in world
+coordinates, so the same positions work for cell centered and face centered values.
+Batches are run by a SIMD kernel picked at startup for the CPU (AVX-512, AVX2 or plain scalar code).
+Every kernel does the same arithmetic in the same order, so they all give the same results.
+*/
+namespace sampler{
+
+	enum class Kernel{
+		SCALAR,
+		AVX2, //8 points at a time with gathers
+		AVX512 //16 points at a time with gathers
+	};
+
+	//The kernel used for batches
+	Kernel kernel();
+	//Forces a kernel, e.g. to compare them. Returns false and leaves the kernel alone if the CPU can't run it.
+	bool setKernel(Kernel kernel);
+	//Best kernel the CPU can run
+	Kernel bestKernel();
+
+	//Where each point of a batch falls in a grid: the first corner of the cell around it and how far into that cell it is.
+	//Grids of the same size can all be interpolated at the same points with one set of weights.
+	struct Weights{
+		int count;
+		int x[SAMPLE_BATCH], y[SAMPLE_BATCH], z[SAMPLE_BATCH];
+		float fx[SAMPLE_BATCH], fy[SAMPLE_BATCH], fz[SAMPLE_BATCH];
+	};
+
+	//Works out the weights of count points (at most SAMPLE_BATCH) for grids of the given size.
+	//Positions outside the grid are clamped to it.
+	inline void computeWeights(int width, int height, int depth, const glm::vec3& offset,
+		const float* px, const float* py, const float* pz, int count, Weights& weights){
+		weights.count = count;
+		for (int i = 0; i < count; ++i)
+		{
+			float x = std::min(std::max(px[i] - offset.x, 0.0f), width - 1.0f);
+			float y = std::min(std::max(py[i] - offset.y, 0.0f), height - 1.0f);
+			float z = std::min(std::max(pz[i] - offset.z, 0.0f), depth - 1.0f);
+			weights.x[i] = std::min(static_cast<int>(x), width - 2);
+			weights.y[i] = std::min(static_cast<int>(y), height - 2);
+			weights.z[i] = std::min(static_cast<int>(z), depth - 2);
+			weights.fx[i] = x - weights.x[i];
+			weights.fy[i] = y - weights.y[i];
+			weights.fz[i] = z - weights.z[i];
+		}
+	}
+
+	//Interpolates q at the points the weights were computed for, q being the size they were computed for
+	void sample(const Grid3D<float>& q, const Weights& weights, float* out);
+
+	/*
+	Samples one component of a staggered velocity grid at count points, position i being (x[i], y[i], z[i]). axis is
+	the axis the component is normal to, 0 for u, whose q(x, y, z) is at (x, y + 0.5, z + 0.5). Results go to out.
+	The boundary layer of q is never read, its values come from mirror instead:
+		- along axis, points are clamped to the faces on the walls, so the faces outside carry on with the wall's value
+		- along the other axes, a boundary cell holds mirror times the cell next to it. Points between the two
+		  interpolate the inside cell only, scaled by the weight the boundary cell folds into it.
+	Positions that aren't numbers are clamped to the low side.
+	*/
+	void sampleVelocity(const Grid3D<float>& q, int axis, float mirror, const float* x, const float* y, const float* z, int count, float* out);
+
+	//Same, with the boundary layer given by a boundary condition policy. tangential only ever copies or negates
+	//the value next to the wall, so it is applied to 1 to get mirror.
+	template <typename Policy>
+	inline void sampleVelocity(const Grid3D<float>& q, int axis, const float* x, const float* y, const float* z, int count, float* out){
+		sampleVelocity(q, axis, Policy::tangential(1.0f), x, y, z, count, out);
+	}
+}
+
+#endif
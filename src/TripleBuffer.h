@@ -0,0 +1,46 @@
+#ifndef _TRIPLEBUFFER_H_
+#define _TRIPLEBUFFER_H_
+
+#include <array>
+#include <atomic>
+
+/*
+Hands the latest value from one writing thread to one reading thread without locks or waiting.
+There are three slots. The writer fills its own slot and publish() swaps it with the shared one, the reader's acquire()
+swaps the shared one with its own slot if something new was published since. Neither side ever touches the other's slot,
+so a value can be read for as long as needed while the writer moves on, and the writer never waits for the reader.
+Values the reader didn't get to in time are skipped, not queued.
+*/
+template <typename T>
+class TripleBuffer{
+public:
+	TripleBuffer() :mWriting(0), mReading(1), mShared(2){}
+	TripleBuffer(const TripleBuffer&) = delete;
+	TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+	//Writer side. The slot to fill, then publish it. The slot returned after publishing is a different one,
+	//holding an older value, so it can be reused without reallocating.
+	T& writeSlot(){ return mSlots[mWriting]; }
+	void publish(){ mWriting = mShared.exchange(mWriting | FRESH, std::memory_order_acq_rel) & INDEX; }
+
+	//Reader side. Takes the latest published value if there is a new one, returns true if so.
+	//The value read stays untouched until the next acquire.
+	bool acquire(){
+		if (!(mShared.load(std::memory_order_acquire) & FRESH))
+			return false;
+		mReading = mShared.exchange(mReading, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+	const T& readSlot() const { return mSlots[mReading]; }
+
+private:
+	//The shared index keeps a flag in the bit above the slot index, set while it holds a value the reader hasn't taken
+	static const unsigned int INDEX = 3;
+	static const unsigned int FRESH = 4;
+
+	std::array<T, 3> mSlots;
+	unsigned int mWriting, mReading;
+	std::atomic<unsigned int> mShared;
+};
+
+#endif
@@ -6,7 +6,13 @@
 #pragma comment(lib, "libpng/zlib.lib")
 #pragma comment(lib, "libpng/libpng16.lib")
 
-int main(){
+//Run with the path of a frame cache to play it back instead of simulating
+int main(int argc, char** argv){
 	FluidSim sim;
+	if (argc > 1 && !sim.openReplay(argv[1]))
+	{
+		std::cerr << "Could not replay " << argv[1] << std::endl;
+		return 1;
+	}
 	sim.runSim();
 }
\ No newline at end of file